@@ -11,11 +11,16 @@
  * on Receiver Side
  * */
 
-
-#include "packet-format.h"
+#define _GNU_SOURCE
+#include "rdt-delta.h"
+#include "rdt-group.h"
 #include <arpa/inet.h>
-#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -23,32 +28,90 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <inttypes.h>
+
+// Write each segment at its exact place in the file.
+static void write_file(void *ctx, uint64_t offset, const void *buf, size_t len)
+{
+    if (pwrite(*(int *) ctx, buf, len, offset) != (ssize_t) len) {
+        perror("pwrite");
+        exit(EXIT_FAILURE);
+    }
+}
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <file> <port> <window size>\n", argv[0]);
+    static const struct option options[] = {
+            {"delta", no_argument, NULL, 'd'},
+            {"group", optional_argument, NULL, 'g'},
+            {"interface", required_argument, NULL, 'i'},
+            {"low-latency", no_argument, NULL, 'l'},
+            {"quiet", no_argument, NULL, 'q'},
+            {"busy-poll", required_argument, NULL, 'p'},
+            {"cpu", required_argument, NULL, 'c'},
+            {0},
+    };
+    bool delta = false, group = false, low_latency = false, quiet = false;
+    int busy_poll = 0, cpu = -1;
+    const char *group_addr = NULL;
+    struct in_addr interface = { .s_addr = htonl(INADDR_LOOPBACK) };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                delta = true;
+                break;
+            case 'g':
+                group = true;
+                group_addr = optarg;
+                break;
+            case 'i':
+                if (!inet_aton(optarg, &interface)) {
+                    fprintf(stderr, "invalid interface address\n");
+                    exit(1);
+                }
+                break;
+            case 'l':
+                low_latency = quiet = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case 'p':
+                busy_poll = atoi(optarg);
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            default:
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [--delta | --group[=<multicast address>] [--interface <addr>]]\n"
+                        "          [--low-latency] [--quiet] [--busy-poll <usec>] [--cpu <n>]\n"
+                        "          <file> <port> <window size>\n", argv[0]);
         exit(1);
     }
 
-    char *file_name = argv[1];
-    int port = atoi(argv[2]);
-    int window_size = atoi(argv[3]);
+    char *file_name = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    int window_size = atoi(argv[optind + 2]);
 
     if(window_size > MAX_WINDOW_SIZE) {
         fprintf(stderr, "window size must be less than 32\n");
         exit(EXIT_FAILURE);
     }
 
-    FILE *file = fopen(file_name, "w");
-    if (!file) {
-        perror("fopen");
+    // In delta mode the old copy is kept until the new one is complete.
+    int file = delta ? -1 : open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (!delta && file == -1) {
+        perror("open");
         exit(EXIT_FAILURE);
     }
 
     // Prepare server socket.
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (sockfd == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
@@ -72,165 +135,116 @@ int main(int argc, char *argv[]) {
         perror("bind");
         exit(EXIT_FAILURE);
     }
-    fprintf(stderr, "Receiving on port: %d\n", port);
-
-    ssize_t len;
-    int seq_num = 0;
-    int end = 0;
-
-    int client_port = -1;
-    int client_id = -1;
-
-    if (window_size == 1) { // STOP-AND-WAIT    &&      GO-BACK-N
-        do { // Iterate over segments, until last the segment is detected.
-            // Receive segment.
-            struct sockaddr_in src_addr;
-            data_pkt_t data_pkt;
-            ack_pkt_t send_pkt;
+    if (!rdt_tune_socket(sockfd, busy_poll, cpu)) {
+        perror("sched_setaffinity");
+        exit(EXIT_FAILURE);
+    }
+    if (!quiet) {
+        fprintf(stderr, "Receiving on port: %d\n", port);
+    }
 
-            len =
-                    recvfrom(sockfd, &data_pkt, sizeof(data_pkt), 0,
-                             (struct sockaddr *)&src_addr, &(socklen_t){sizeof(src_addr)});
+    rdt_config_t config = {
+            .window_size = window_size,
+            .verbose = !delta && !group && !quiet,
+    };
 
-            if( client_port == -1 && client_id == -1){
-                client_port = src_addr.sin_port;
-                client_id = src_addr.sin_addr.s_addr;
-            } else if(client_port != src_addr.sin_port || client_id != src_addr.sin_addr.s_addr){
-                fprintf(stderr, "ACK received from wrong address.\n");
+    if (group) {
+        if (group_addr) {
+            struct ip_mreq mreq = { .imr_interface = interface };
+            if (!inet_aton(group_addr, &mreq.imr_multiaddr) ||
+                setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                           sizeof(mreq)) < 0) {
+                perror("IP_ADD_MEMBERSHIP");
                 exit(EXIT_FAILURE);
             }
-
-            if (len >= 0){
-                printf("Received segment %d.\n", ntohl(data_pkt.seq_num));
-
-                if (ntohl(data_pkt.seq_num) == seq_num) {
-                    // Write data to file.
-                    fwrite(data_pkt.data, 1, len - offsetof(data_pkt_t, data), file);
-                    seq_num++;
-
-                    if(len != sizeof(data_pkt_t)){
-                        end = 1;
-                    }
-
-                } else {
-                    printf("Segment out of window.\n");
-                }
-            }
-
-            send_pkt.seq_num = htonl(seq_num);
-            send_pkt.selective_acks = htonl(0b00);
-
-            ssize_t sent_len =
-                    sendto(sockfd, &send_pkt, sizeof(send_pkt), 0,
-                           (struct sockaddr *) &src_addr, sizeof(src_addr));
-            if (sent_len > 0) {
-                printf("Sending ACK %d / %08" PRIu32 ".\n", ntohl(send_pkt.seq_num), send_pkt.selective_acks);
-            }
-
-            if(end == 1) break;
-
-        } while (true);
-
-    } else if ( window_size > 1 ) { // Selective Repeat
-
-        uint32_t sltv_acks = 0b00;
-
-        do {
-            struct sockaddr_in src_addr;
-            data_pkt_t data_pkt;
-            ack_pkt_t send_pkt;
-
-            len =
-                    recvfrom(sockfd, &data_pkt, sizeof(data_pkt), 0,
-                             (struct sockaddr *)&src_addr, &(socklen_t){sizeof(src_addr)});
-
-            if( client_port == -1 && client_id == -1){
-                client_port = src_addr.sin_port;
-                client_id = src_addr.sin_addr.s_addr;
-            } else if(client_port != src_addr.sin_port || client_id != src_addr.sin_addr.s_addr){
-                fprintf(stderr, "ACK received from wrong address.\n");
+        }
+
+        rdt_group_receiver_t *receiver = rdt_group_receiver_new(
+                sockfd, &config, write_file, &file);
+        if (!receiver) {
+            perror("rdt_group_receiver_new");
+            exit(EXIT_FAILURE);
+        }
+
+        rdt_status_t status = RDT_RUNNING;
+        while (status == RDT_RUNNING) {
+            struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+            int ready = poll(&pfd, 1, rdt_group_receiver_timeout(receiver));
+            if (ready < 0 && errno != EINTR) {
+                perror("poll");
                 exit(EXIT_FAILURE);
             }
 
-            if (len >= 0){
-                printf("Received segment %d.\n", ntohl(data_pkt.seq_num));
-
-                int rcv_seq = ntohl(data_pkt.seq_num);
-
-                // Make sure that it writes on exact place
-                fseek(file, ( rcv_seq * 1000 ), SEEK_SET);
-
-                // Write data to file.
-                fwrite(data_pkt.data, 1, len - offsetof(data_pkt_t, data), file);
-
-                if (rcv_seq == seq_num) {
-
-                    if (sltv_acks != 0b00) {
-
-                        uint32_t temp = sltv_acks;
-                        int reset = -1; // everything was sent?
-
-                        while (temp > 0 ) {
-
-                            seq_num++;
-                            sltv_acks >>= 1; // shift right window
-
-
-                            if(!(temp & 1)) {
-                                reset = 1; // there's some acks left to send
-                                break;
-                            }
-                            temp = temp >> 1;
-                        }
-
-                        if(reset != 1){ // if everything in the window was sent reset it
-                            seq_num++;
-                            sltv_acks = 0b00;
-                        }
-
-                        if(end == 2){
-                            end = 1;
-                        }
-                    } else {
-                        seq_num++;
-                    }
-
-                    if(len != sizeof(data_pkt_t)){ // last segment was received, shut down
-                        end = 1;
-                    }
-
-                } else if( rcv_seq > seq_num && rcv_seq < seq_num + window_size ) {
-                    sltv_acks |= 1 << (rcv_seq - seq_num - 1);
-
-                    if(len != sizeof(data_pkt_t)){ // last segment was received out of order
-                        end = 2;
-                    }
-
-                } else {
-                    printf("Segment out of window.\n");
-                }
-            }
+            status = ready > 0 ? rdt_group_receiver_on_readable(receiver)
+                               : rdt_group_receiver_on_timer(receiver);
+        }
+
+        if (status == RDT_FAILED) {
+            fprintf(stderr, "%s\n", rdt_group_receiver_error(receiver));
+            exit(EXIT_FAILURE);
+        }
+        rdt_group_receiver_free(receiver);
+        close(sockfd);
+        close(file);
+        exit(EXIT_SUCCESS);
+    }
 
-            send_pkt.selective_acks = htonl(sltv_acks);
-            send_pkt.seq_num = htonl(seq_num);
+    if (delta) {
+        rdt_delta_stats_t stats = {0};
+        const char *error = NULL;
+        if (rdt_delta_receive_file(sockfd, &config, file_name, &stats,
+                                   &error) != RDT_DONE) {
+            fprintf(stderr, "%s\n", error);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr,
+                "File: %" PRIu64 " bytes, signatures: %" PRIu64
+                ", delta: %" PRIu64 "\n",
+                stats.file_bytes, stats.signature_bytes, stats.delta_bytes);
+        close(sockfd);
+        exit(EXIT_SUCCESS);
+    }
 
-            ssize_t sent_len =
-                    sendto(sockfd, &send_pkt, sizeof(send_pkt), 0,
-                           (struct sockaddr *) &src_addr, sizeof(src_addr));
-            if (sent_len > 0) {
-                printf("Sending ACK %d / %08" PRIu32 ".\n", ntohl(send_pkt.seq_num), ntohl(send_pkt.selective_acks));
-            }
+    rdt_receiver_t *receiver = rdt_receiver_new(sockfd, &config, write_file,
+                                                &file);
+    if (!receiver) {
+        perror("rdt_receiver_new");
+        exit(EXIT_FAILURE);
+    }
 
-            if(end == 1) break;
+    // With busy polling the loop spins instead of sleeping in poll().
+    rdt_status_t status = RDT_RUNNING;
+    while (status == RDT_RUNNING) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        int ready = poll(&pfd, 1,
+                         busy_poll ? 0 : rdt_receiver_timeout(receiver));
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        status = ready > 0 ? rdt_receiver_on_readable(receiver)
+                           : rdt_receiver_on_timer(receiver);
+    }
 
-        } while (true);
+    if (status == RDT_FAILED) {
+        fprintf(stderr, "%s\n", rdt_receiver_error(receiver));
+        exit(EXIT_FAILURE);
+    }
 
+    // Linger so a lost final ACK is answered by the sender's next probe,
+    // until the sender has been quiet for a whole timeout.
+    if (low_latency) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        while (poll(&pfd, 1, TIMEOUT) > 0) {
+            rdt_receiver_on_readable(receiver);
+        }
     }
 
     // Clean up and exit.
+    rdt_receiver_free(receiver);
     close(sockfd);
-    fclose(file);
+    close(file);
 
     exit(EXIT_SUCCESS);
 }
-
@@ -11,299 +11,332 @@
  * on Sender Side
  * */
 
-#include "packet-format.h"
+#define _GNU_SOURCE
+#include "rdt-delta.h"
+#include "rdt-group.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include <inttypes.h>
 
 
-long int findSize(char *file_name)
+// Read segments straight from the file into the outgoing packet.
+static size_t read_file(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+    ssize_t n = pread(*(int *) ctx, buf, len, offset);
+    return n < 0 ? 0 : n;
+}
+
+// Group mode reads segments out of a mapping of the whole file.
+static size_t read_mapping(void *ctx, uint64_t offset, void *buf, size_t len)
 {
-    // opening the file in read mode
-    FILE* fp = fopen(file_name, "r");
+    memcpy(buf, (const char *) ctx + offset, len);
+    return len;
+}
 
-    // checking if the file exist or not
-    if (fp == NULL) {
-        perror("fopen");
+// Numeric addresses skip the resolver altogether.
+static void resolve(const char *host, struct in_addr *addr)
+{
+    if (inet_pton(AF_INET, host, addr) == 1) {
+        return;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *res;
+    int err = getaddrinfo(host, NULL, &hints, &res);
+    if (err) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
         exit(EXIT_FAILURE);
     }
+    *addr = ((struct sockaddr_in *) res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+}
 
-    fseek(fp, 0L, SEEK_END);
+// Resolve a comma separated list of host[:port] destinations.
+static int parse_group(char *list, int port, struct sockaddr_in **dests)
+{
+    int n = 0;
+    *dests = NULL;
+    for (char *save, *entry = strtok_r(list, ",", &save); entry;
+         entry = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(entry, ':');
+        int entry_port = port;
+        if (colon) {
+            *colon = '\0';
+            entry_port = atoi(colon + 1);
+        }
+
+        *dests = realloc(*dests, (n + 1) * sizeof(**dests));
+        (*dests)[n] = (struct sockaddr_in) {
+                .sin_family = AF_INET,
+                .sin_port = htons(entry_port),
+        };
+        resolve(entry, &(*dests)[n++].sin_addr);
+    }
+    return n;
+}
+
+static void send_group(int sockfd, int file, uint64_t length, char *host,
+                       int port, const rdt_config_t *config, int receivers,
+                       int straggler_rounds, struct in_addr interface)
+{
+    struct sockaddr_in *dests;
+    int n_dests = parse_group(host, port, &dests);
+    if (n_dests == 1 && IN_MULTICAST(ntohl(dests[0].sin_addr.s_addr))) {
+        if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &interface,
+                       sizeof(interface)) < 0) {
+            perror("setsockopt");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        receivers = n_dests;
+    }
+
+    void *data = NULL;
+    if (length && (data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file,
+                               0)) == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    rdt_group_sender_t *sender = rdt_group_sender_new(
+            sockfd, dests, n_dests, receivers, straggler_rounds, config,
+            length, read_mapping, data);
+    if (!sender) {
+        perror("rdt_group_sender_new");
+        exit(EXIT_FAILURE);
+    }
+
+    rdt_status_t status = rdt_group_sender_start(sender);
+    while (status == RDT_RUNNING) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        int ready = poll(&pfd, 1, rdt_group_sender_timeout(sender));
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        status = ready > 0 ? rdt_group_sender_on_readable(sender)
+                           : rdt_group_sender_on_timer(sender);
+    }
 
-    // calculating the size of the file
-    long int res = ftell(fp);
+    if (status == RDT_FAILED) {
+        fprintf(stderr, "%s\n", rdt_group_sender_error(sender));
+        exit(EXIT_FAILURE);
+    }
 
-    // closing the file
-    fclose(fp);
+    const rdt_group_stats_t *stats = rdt_group_sender_stats(sender);
+    fprintf(stderr,
+            "Receivers: %d, cut loose: %d, segments: %" PRIu64
+            ", retransmissions: %" PRIu64 ", NAKs: %" PRIu64 ", rounds: %d\n",
+            stats->receivers, stats->cut, stats->segments,
+            stats->retransmissions, stats->naks, stats->rounds);
 
-    return res;
+    rdt_group_sender_free(sender);
+    if (data) {
+        munmap(data, length);
+    }
+    free(dests);
 }
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 5) {
-        fprintf (stderr,"Usage: %s <file> <host> <port> <window size>\n", argv[0]);
+    static const struct option options[] = {
+            {"delta", no_argument, NULL, 'd'},
+            {"block-size", required_argument, NULL, 'b'},
+            {"group", no_argument, NULL, 'g'},
+            {"receivers", required_argument, NULL, 'n'},
+            {"straggler-rounds", required_argument, NULL, 's'},
+            {"interface", required_argument, NULL, 'i'},
+            {"low-latency", no_argument, NULL, 'l'},
+            {"quiet", no_argument, NULL, 'q'},
+            {"busy-poll", required_argument, NULL, 'p'},
+            {"cpu", required_argument, NULL, 'c'},
+            {0},
+    };
+    bool delta = false, group = false, low_latency = false, quiet = false;
+    int busy_poll = 0, cpu = -1;
+    uint32_t block_size = 0;
+    int receivers = 1, straggler_rounds = 0;
+    struct in_addr interface = { .s_addr = htonl(INADDR_LOOPBACK) };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                delta = true;
+                break;
+            case 'b': {
+                char *end;
+                unsigned long size = strtoul(optarg, &end, 10);
+                if (!isdigit((unsigned char) optarg[0]) || *end ||
+                    !rdt_delta_valid_block_size(size)) {
+                    fprintf(stderr, "invalid block size, 1 to %d bytes\n",
+                            RDT_DELTA_MAX_BLOCK);
+                    exit(1);
+                }
+                block_size = size;
+                break;
+            }
+            case 'g':
+                group = true;
+                break;
+            case 'n':
+                receivers = atoi(optarg);
+                break;
+            case 's':
+                straggler_rounds = atoi(optarg);
+                break;
+            case 'i':
+                if (!inet_aton(optarg, &interface)) {
+                    fprintf(stderr, "invalid interface address\n");
+                    exit(1);
+                }
+                break;
+            case 'l':
+                low_latency = quiet = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            case 'p':
+                busy_poll = atoi(optarg);
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            default:
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 4) {
+        fprintf (stderr,"Usage: %s [--delta [--block-size <bytes>]] [--low-latency] [--quiet]\n"
+                        "          [--busy-poll <usec>] [--cpu <n>] <file> <host> <port> <window size>\n"
+                        "       %s --group [--receivers <n>] [--straggler-rounds <n>] [--interface <addr>]\n"
+                        "          <file> <group address | host[:port],...> <port> <window size>\n",
+                 argv[0], argv[0]);
         exit (1);
     }
 
-    char *file_name = argv[1];
-    char *host = argv[2];
-    int port = atoi(argv[3]);
-    int window_size = atoi(argv[4]);
+    char *file_name = argv[optind];
+    char *host = argv[optind + 1];
+    int port = atoi(argv[optind + 2]);
+    int window_size = atoi(argv[optind + 3]);
 
     if(window_size > MAX_WINDOW_SIZE) {
         fprintf(stderr, "window size must be less than 32\n");
         exit(EXIT_FAILURE);
     }
 
-    FILE *file = fopen(file_name, "r");
-    if (!file) {
-        perror("fopen");
+    int file = open(file_name, O_RDONLY);
+    struct stat file_stat;
+    if (file == -1 || fstat(file, &file_stat) == -1) {
+        perror("open");
         exit(EXIT_FAILURE);
     }
 
-    // Prepare server host address.
-    struct hostent *he;
-    if (!(he = gethostbyname(host))) {
-        perror("gethostbyname");
-        exit(EXIT_FAILURE);
+    if (group) {
+        int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (sockfd == -1) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        rdt_config_t config = {
+                .window_size = window_size,
+        };
+        send_group(sockfd, file, file_stat.st_size, host, port, &config,
+                   receivers, straggler_rounds, interface);
+        close(sockfd);
+        close(file);
+        exit(EXIT_SUCCESS);
     }
 
+    // Prepare server host address.
     struct sockaddr_in srv_addr = {
             .sin_family = AF_INET,
             .sin_port = htons(port),
-            .sin_addr = *((struct in_addr *) he->h_addr),
     };
+    resolve(host, &srv_addr.sin_addr);
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (sockfd == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
-
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-
-    if (setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
-        perror("setsockopt failed");
+    if (!rdt_tune_socket(sockfd, busy_poll, cpu)) {
+        perror("sched_setaffinity");
         exit(EXIT_FAILURE);
     }
 
-    long int file_lenght = findSize(file_name);
-    long int total_chunks = file_lenght / 1000;
-    total_chunks++;
-
-    int tries = 1;
-    uint32_t seq_num=0;
-
-    size_t data_len;
-    data_pkt_t data_pkt;
-    ack_pkt_t recv_pkt;
-
-
-    if ( window_size == 1){
-        do { // Generate segments from file, until the the end of the file.
-            // Prepare data segment.
-
-            data_pkt.seq_num = htonl(seq_num++);
-
-            // Load data from file.
-            data_len = fread(data_pkt.data, 1, sizeof(data_pkt.data), file);
-
-            // Send segment.
-            ssize_t sent_len =
-                    sendto(sockfd, &data_pkt, offsetof(data_pkt_t, data) + data_len, 0,
-                           (struct sockaddr *)&srv_addr, sizeof(srv_addr));
-            printf("Sending segment %d.\n", ntohl(data_pkt.seq_num));
-            if (sent_len != offsetof(data_pkt_t, data) + data_len) {
-                fprintf(stderr, "Truncated packet.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            while( recvfrom(sockfd, &recv_pkt, sizeof(recv_pkt), 0,
-                            (struct sockaddr *) &srv_addr, &(socklen_t) {sizeof(srv_addr)}) < 0 ){
-
-                if(port != htons(srv_addr.sin_port) && ((struct in_addr *) he->h_addr)->s_addr != srv_addr.sin_addr.s_addr){
-                    fprintf(stderr, "ACK received from wrong address.\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                printf("Timed out.\n");
-
-                if(tries == MAX_RETRIES) {
-                    fprintf(stderr, "Could not receive server acknowledge\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                // Resend segment.
-                sent_len =
-                        sendto(sockfd, &data_pkt, offsetof(data_pkt_t, data) + data_len, 0,
-                               (struct sockaddr *) &srv_addr, sizeof(srv_addr));
-                printf("Resending segment %d.\n", ntohl(data_pkt.seq_num));
-
-                if (sent_len != offsetof(data_pkt_t, data) + data_len) {
-                    fprintf(stderr, "Truncated packet.\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                tries++;
-            }
-
-            if(port != htons(srv_addr.sin_port) && ((struct in_addr *) he->h_addr)->s_addr != srv_addr.sin_addr.s_addr){
-                fprintf(stderr, "ACK received from wrong address.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            printf("Received ACK %d / %08" PRIu32 ".\n", ntohl(recv_pkt.seq_num), ntohl(recv_pkt.selective_acks));
+    rdt_config_t config = {
+            .window_size = window_size,
+            .verbose = !delta && !quiet,
+            .tail_loss_probe = low_latency,
+    };
 
-        } while (!(feof(file) && data_len < sizeof(data_pkt.data)));
+    if (delta) {
+        // Only send what the receiver's copy lacks.
+        rdt_delta_stats_t stats = {0};
+        const char *error = NULL;
+        if (rdt_delta_send_file(sockfd, &srv_addr, &config, file, block_size,
+                                &stats, &error) != RDT_DONE) {
+            fprintf(stderr, "%s\n", error);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr,
+                "File: %" PRIu64 " bytes, matched: %" PRIu64
+                ", literal: %" PRIu64 ", signatures: %" PRIu64
+                ", delta: %" PRIu64 "\n",
+                stats.file_bytes, stats.matched_bytes, stats.literal_bytes,
+                stats.signature_bytes, stats.delta_bytes);
+        close(sockfd);
+        close(file);
+        exit(EXIT_SUCCESS);
     }
-    else if (window_size > 1 ) { // GO BACK-N and Selective Repeat
-
-        // Sequence number of the last packet sent (rcvbase)
-        int last_sent = 0;
-
-        // Sequence number of the last acked packet
-        int last_acked = 0;
-
-        int sr_flag = -1;
-        uint32_t prev_sltvno = 0;
-        int ackno = 0;
-
-        int f_recv_size;
-
-        while (last_acked < total_chunks) {
-
-            while ( last_sent < last_acked + window_size && last_sent < total_chunks ) {
-
-                data_pkt.seq_num = htonl(last_sent);
-
-                fseek(file, (last_sent) * 1000, SEEK_SET);
-
-                // Load data from file.
-                data_len = fread(data_pkt.data, 1, sizeof(data_pkt.data), file);
-
-                // Send segment.
-                ssize_t sent_len =
-                        sendto(sockfd, &data_pkt, offsetof(data_pkt_t, data) + data_len, 0,
-                               (struct sockaddr *) &srv_addr, sizeof(srv_addr));
-                printf("Sending segment %d.\n", ntohl(data_pkt.seq_num));
-
-                if (sent_len != offsetof(data_pkt_t, data) + data_len) {
-                    fprintf(stderr, "Truncated packet.\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                last_sent++;
-                tries = 0;
-            }
-
-            f_recv_size = recvfrom(sockfd, &recv_pkt, sizeof(recv_pkt), 0,
-                                       (struct sockaddr *) &srv_addr, &(socklen_t) {sizeof(srv_addr)});
-
-            if(port != htons(srv_addr.sin_port) && ((struct in_addr *) he->h_addr)->s_addr != srv_addr.sin_addr.s_addr){
-                fprintf(stderr, "ACK received from wrong address.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            if( f_recv_size >= 0 ){
 
-                ackno = ntohl(recv_pkt.seq_num);
-                int selectiveno = ntohl(recv_pkt.selective_acks);
-
-                printf("Received ACK %d / %08" PRIu32 ".\n", ackno, selectiveno);
-
-                if(last_acked + 1 == ackno) {
-                    last_acked++;
-
-                } else if ( ackno < last_acked + 1 && selectiveno > prev_sltvno) {
-                    prev_sltvno = selectiveno;
-
-                } else if (prev_sltvno == -2 ){
-                    last_acked = last_sent;
-                }
-
-                if( selectiveno != 0)
-                    sr_flag = 1;
-
-            } else {
-                printf("Timed out.\n");
-
-                if(tries == MAX_RETRIES) {
-                    fprintf(stderr, "Could not receive server acknowledge\n");
-                    exit(EXIT_FAILURE);
-                }
-                tries++;
-
-                if (sr_flag == 1) {
-
-                    int seg_to_send = 0 ;
-                    uint32_t new_selective = prev_sltvno<<1;
-
-                    while (new_selective > 0) {
-
-                        // If current bit is 0
-                        if (!(new_selective & 1)) {
-
-                            data_pkt.seq_num = htonl(seg_to_send + last_acked);
-
-                            fseek(file, (seg_to_send + last_acked) * 1000, SEEK_SET);
-
-                            // Load data from file.
-                            data_len = fread(data_pkt.data, 1, sizeof(data_pkt.data), file);
-
-                            // Send segment.
-                            ssize_t sent_len =
-                                    sendto(sockfd, &data_pkt, offsetof(data_pkt_t, data) + data_len, 0,
-                                           (struct sockaddr *) &srv_addr, sizeof(srv_addr));
-                            printf("Resending segment %d.\n", ntohl(data_pkt.seq_num));
-                            if (sent_len != offsetof(data_pkt_t, data) + data_len) {
-                                fprintf(stderr, "Truncated packet.\n");
-                                exit(EXIT_FAILURE);
-                            }
-                        }
-                        seg_to_send++;
-                        new_selective = new_selective >> 1;
-                    }
-
-                    last_sent = last_sent > seg_to_send + ackno? (seg_to_send + ackno) : last_sent; // in case seg was sent out of window
-                    prev_sltvno = -2;
-                    sr_flag = -1;
-                } else {
-
-                    for (int temp = last_acked; temp < last_sent; temp++) {
-
-                        data_pkt.seq_num = htonl(temp);
+    rdt_sender_t *sender = rdt_sender_new(sockfd, &srv_addr, &config,
+                                          file_stat.st_size, read_file, &file);
+    if (!sender) {
+        perror("rdt_sender_new");
+        exit(EXIT_FAILURE);
+    }
 
-                        fseek(file, (temp) * 1000, SEEK_SET);
+    // With busy polling the loop spins instead of sleeping in poll().
+    rdt_status_t status = rdt_sender_start(sender);
+    while (status == RDT_RUNNING) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        int ready = poll(&pfd, 1, busy_poll ? 0 : rdt_sender_timeout(sender));
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
 
-                        // Load data from file.
-                        data_len = fread(data_pkt.data, 1, sizeof(data_pkt.data), file);
+        status = ready > 0 ? rdt_sender_on_readable(sender)
+                           : rdt_sender_on_timer(sender);
+    }
 
-                        // Send segment.
-                        ssize_t sent_len =
-                                sendto(sockfd, &data_pkt, offsetof(data_pkt_t, data) + data_len, 0,
-                                       (struct sockaddr *) &srv_addr, sizeof(srv_addr));
-                        printf("Resending segment %d.\n", ntohl(data_pkt.seq_num));
-                        if (sent_len != offsetof(data_pkt_t, data) + data_len) {
-                            fprintf(stderr, "Truncated packet.\n");
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                }
-            }
-        }
+    if (status == RDT_FAILED) {
+        fprintf(stderr, "%s\n", rdt_sender_error(sender));
+        exit(EXIT_FAILURE);
     }
 
     // Clean up and exit.
+    rdt_sender_free(sender);
     close(sockfd);
-    fclose(file);
+    close(file);
 
     exit(EXIT_SUCCESS);
 }
-
@@ -5,15 +5,48 @@
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "packet-log.h"
+
 #define PASS_THROUGH(fn, ...)                                                  \
   (((__typeof__(fn) *)dlsym(RTLD_NEXT, #fn))(__VA_ARGS__))
 
+// PACKET_LOG_FORMAT=binary writes packet_log_record_t records instead of
+// text lines, see packet-log.h.
+static int binary_log() {
+  const char *format = getenv("PACKET_LOG_FORMAT");
+  return format && !strcmp(format, "binary");
+}
+
+static void log_binary(FILE *log, uint8_t kind, const struct timespec *tp,
+                       const struct sockaddr_in *local,
+                       const struct sockaddr_in *remote, const void *message,
+                       size_t length) {
+  fseek(log, 0, SEEK_END);
+  if (ftell(log) == 0) {
+    fwrite(PACKET_LOG_MAGIC, 1, sizeof(PACKET_LOG_MAGIC) - 1, log);
+  }
+
+  packet_log_record_t record = {
+      .kind = kind,
+      .length = length,
+      .sec = tp->tv_sec,
+      .nsec = tp->tv_nsec,
+      .local_addr = local->sin_addr.s_addr,
+      .local_port = local->sin_port,
+      .remote_addr = remote ? remote->sin_addr.s_addr : 0,
+      .remote_port = remote ? remote->sin_port : 0,
+  };
+  fwrite(&record, sizeof(record), 1, log);
+  fwrite(message, 1, length, log);
+}
+
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dst_addr, socklen_t dst_length) {
   const char *packet_log = getenv("PACKET_LOG");
@@ -49,6 +82,13 @@ ssize_t sendto(int socket, const void *message, size_t length, int flags,
   socklen_t bind_len = sizeof(bind_addr);
   assert(getsockname(socket, &bind_addr, &bind_len) == 0);
 
+  if (binary_log()) {
+    log_binary(log, drop_pattern[0] != '1' ? PACKET_LOG_SENT : PACKET_LOG_DROPPED,
+               &tp, &bind_addr, (const struct sockaddr_in *)dst_addr, message,
+               length);
+    goto done;
+  }
+
   char bind_addr_str[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &bind_addr.sin_addr, bind_addr_str, INET_ADDRSTRLEN);
 
@@ -64,6 +104,8 @@ ssize_t sendto(int socket, const void *message, size_t length, int flags,
     fprintf(log, " %02X", ((uint8_t *)message)[i]);
   }
   fprintf(log, "\n");
+
+done:
   fflush(log);
 
   fclose(log);
@@ -92,6 +134,16 @@ ssize_t recvfrom(int socket, void *message, size_t length, int flags,
   socklen_t bind_len = sizeof(bind_addr);
   assert(getsockname(socket, &bind_addr, &bind_len) == 0);
 
+  if (binary_log()) {
+    if (result >= 0) {
+      log_binary(log, PACKET_LOG_RECEIVED, &tp, &bind_addr,
+                 (const struct sockaddr_in *)src_addr, message, result);
+    } else {
+      log_binary(log, PACKET_LOG_TIMEOUT, &tp, &bind_addr, NULL, NULL, 0);
+    }
+    goto done;
+  }
+
   char bind_addr_str[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &bind_addr.sin_addr, bind_addr_str, INET_ADDRSTRLEN);
 
@@ -113,6 +165,7 @@ ssize_t recvfrom(int socket, void *message, size_t length, int flags,
             ntohs(bind_addr.sin_port));
   }
 
+done:
   fflush(log);
 
   fclose(log);
@@ -0,0 +1,882 @@
+/*
+ * Reliable Data Transfer
+ * Packet log analyzer
+ *
+ * Streams the text or binary logs written by log-packets.so, merging them by
+ * timestamp, and matches every received packet with the send it came from
+ * through a hash index, so the whole pass is linear in the number of packets.
+ * Reports per-flow statistics and, optionally, an mscgen diagram of a chosen
+ * time slice.
+ *
+ * Endpoints are identified by port only: senders bind to 0.0.0.0, so the same
+ * socket shows up with different addresses in each log. A flow is one stream
+ * between two ports, so the sessions of a delta transfer each get their own.
+ * */
+
+#include "packet-log.h"
+#include "rdt-group.h"
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LOGS 16
+#define KEY_BYTES 8 // Packet prefix used to tell packets of a flow apart.
+
+typedef struct {
+  int64_t time; // ns
+  uint8_t kind;
+  uint16_t local_port, remote_port;
+  uint16_t length;
+  uint8_t prefix[KEY_BYTES]; // Zero padded.
+} record_t;
+
+typedef struct {
+  FILE *file;
+  bool binary;
+  bool has_record;
+  record_t record;
+  char *line;
+  size_t line_cap;
+  char *data;
+} log_reader_t;
+
+static void *xrealloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (!ptr && size) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+/******************************************************************************\
+* Log readers                                                                  *
+\******************************************************************************/
+
+static bool parse_text(log_reader_t *reader, record_t *r) {
+  ssize_t len;
+  while ((len = getline(&reader->line, &reader->line_cap, reader->file)) > 0) {
+    char *p = reader->line, *end;
+    memset(r, 0, sizeof(*r));
+
+    // Nanoseconds are logged without zero padding.
+    long long sec = strtoll(p, &end, 10);
+    if (*end != '.') {
+      continue;
+    }
+    long long nsec = strtoll(end + 1, &end, 10);
+    r->time = sec * 1000000000LL + nsec;
+
+    char addr[INET_ADDRSTRLEN + 1], op[3];
+    unsigned local_port, remote_port;
+    int consumed = 0;
+    int fields = sscanf(end, " %16s %u %2s%n", addr, &local_port, op, &consumed);
+    if (fields != 3) {
+      continue;
+    }
+    p = end + consumed;
+    r->local_port = local_port;
+
+    if (!strcmp(op, "x-")) {
+      r->kind = PACKET_LOG_TIMEOUT;
+      return true;
+    } else if (!strcmp(op, "=>")) {
+      r->kind = PACKET_LOG_SENT;
+    } else if (!strcmp(op, "-x")) {
+      r->kind = PACKET_LOG_DROPPED;
+    } else if (!strcmp(op, "<=")) {
+      r->kind = PACKET_LOG_RECEIVED;
+    } else {
+      continue;
+    }
+
+    if (sscanf(p, " %16s %u%n", addr, &remote_port, &consumed) != 2) {
+      continue;
+    }
+    p += consumed;
+    r->remote_port = remote_port;
+
+    // Packet bytes: " XX" each.
+    while (*p == ' ') {
+      if (r->length < KEY_BYTES) {
+        r->prefix[r->length] = strtoul(p + 1, NULL, 16);
+      }
+      r->length++;
+      p += 3;
+    }
+    return true;
+  }
+  return false;
+}
+
+static bool parse_binary(log_reader_t *reader, record_t *r) {
+  packet_log_record_t raw;
+  if (fread(&raw, sizeof(raw), 1, reader->file) != 1) {
+    return false;
+  }
+  memset(r, 0, sizeof(*r));
+  r->time = raw.sec * 1000000000LL + raw.nsec;
+  r->kind = raw.kind;
+  r->length = raw.length;
+  r->local_port = ntohs(raw.local_port);
+  r->remote_port = ntohs(raw.remote_port);
+
+  reader->data = xrealloc(reader->data, raw.length ? raw.length : 1);
+  if (fread(reader->data, 1, raw.length, reader->file) != raw.length) {
+    return false;
+  }
+  memcpy(r->prefix, reader->data, raw.length < KEY_BYTES ? raw.length : KEY_BYTES);
+  return true;
+}
+
+static void reader_open(log_reader_t *reader, const char *file_name) {
+  memset(reader, 0, sizeof(*reader));
+  reader->file = fopen(file_name, "r");
+  if (!reader->file) {
+    perror(file_name);
+    exit(EXIT_FAILURE);
+  }
+
+  char magic[sizeof(PACKET_LOG_MAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), reader->file) == sizeof(magic) &&
+      !memcmp(magic, PACKET_LOG_MAGIC, sizeof(magic))) {
+    reader->binary = true;
+  } else {
+    rewind(reader->file);
+  }
+}
+
+static void reader_advance(log_reader_t *reader) {
+  reader->has_record = reader->binary
+                           ? parse_binary(reader, &reader->record)
+                           : parse_text(reader, &reader->record);
+}
+
+/******************************************************************************\
+* Send/receive matching                                                        *
+\******************************************************************************/
+
+// The logger timestamps a send after sendto() returns, so the receive of a
+// packet can be logged before its send. Each key therefore queues whichever
+// side showed up first, and the other side consumes it.
+typedef struct {
+  int64_t time;
+  int32_t next;   // Next entry with the same key, -1 at the tail.
+  uint16_t length;
+  uint64_t row;   // MSC row, UINT64_MAX when outside the slice.
+} pending_t;
+
+typedef struct {
+  uint16_t src, dst;
+  uint8_t prefix[KEY_BYTES];
+  int32_t head, tail; // FIFO of unmatched entries, -1 when empty.
+  bool receives;      // Queued entries are receives waiting for their send.
+  bool used;
+} slot_t;
+
+typedef struct {
+  slot_t *slots;
+  size_t cap, used;
+  pending_t *pending;
+  size_t pending_len, pending_cap;
+  int32_t free_list;
+} match_index_t;
+
+static uint64_t key_hash(uint16_t src, uint16_t dst, const uint8_t *prefix) {
+  uint64_t h = 1469598103934665603ULL;
+  uint8_t bytes[4 + KEY_BYTES] = {src >> 8, src, dst >> 8, dst};
+  memcpy(bytes + 4, prefix, KEY_BYTES);
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    h = (h ^ bytes[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static slot_t *index_slot(match_index_t *idx, uint16_t src, uint16_t dst,
+                          const uint8_t *prefix);
+
+static void index_grow(match_index_t *idx) {
+  slot_t *old = idx->slots;
+  size_t old_cap = idx->cap;
+  idx->cap = idx->cap ? idx->cap * 2 : 1024;
+  idx->slots = calloc(idx->cap, sizeof(slot_t));
+  if (!idx->slots) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  idx->used = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].used && old[i].head >= 0) { // Drop drained keys on rehash.
+      slot_t *s = index_slot(idx, old[i].src, old[i].dst, old[i].prefix);
+      s->head = old[i].head;
+      s->tail = old[i].tail;
+      s->receives = old[i].receives;
+    }
+  }
+  free(old);
+}
+
+static slot_t *index_slot(match_index_t *idx, uint16_t src, uint16_t dst,
+                          const uint8_t *prefix) {
+  if ((idx->used + 1) * 4 > idx->cap * 3) {
+    index_grow(idx);
+  }
+  size_t mask = idx->cap - 1;
+  for (size_t i = key_hash(src, dst, prefix) & mask;; i = (i + 1) & mask) {
+    slot_t *s = &idx->slots[i];
+    if (!s->used) {
+      s->used = true;
+      s->src = src;
+      s->dst = dst;
+      memcpy(s->prefix, prefix, KEY_BYTES);
+      s->head = s->tail = -1;
+      idx->used++;
+      return s;
+    }
+    if (s->src == src && s->dst == dst && !memcmp(s->prefix, prefix, KEY_BYTES)) {
+      return s;
+    }
+  }
+}
+
+// Match a send or a receive against the oldest unmatched entry of the other
+// side. Returns true and fills `other` on a match, otherwise queues `self`.
+static bool index_match(match_index_t *idx, const record_t *r, bool receive,
+                        uint64_t row, pending_t *other) {
+  uint16_t src = receive ? r->remote_port : r->local_port;
+  uint16_t dst = receive ? r->local_port : r->remote_port;
+  slot_t *s = index_slot(idx, src, dst, r->prefix);
+
+  if (s->head >= 0 && s->receives != receive) {
+    int32_t n = s->head;
+    *other = idx->pending[n];
+    s->head = idx->pending[n].next;
+    if (s->head < 0) {
+      s->tail = -1;
+    }
+    idx->pending[n].next = idx->free_list;
+    idx->free_list = n;
+    return true;
+  }
+
+  int32_t n;
+  if (idx->free_list >= 0) {
+    n = idx->free_list;
+    idx->free_list = idx->pending[n].next;
+  } else {
+    if (idx->pending_len == idx->pending_cap) {
+      idx->pending_cap = idx->pending_cap ? idx->pending_cap * 2 : 1024;
+      idx->pending =
+          xrealloc(idx->pending, idx->pending_cap * sizeof(pending_t));
+    }
+    n = idx->pending_len++;
+  }
+  idx->pending[n] = (pending_t){r->time, -1, r->length, row};
+
+  if (s->tail >= 0) {
+    idx->pending[s->tail].next = n;
+  } else {
+    s->head = n;
+  }
+  s->tail = n;
+  s->receives = receive;
+  return false;
+}
+
+/******************************************************************************\
+* Flow statistics                                                              *
+\******************************************************************************/
+
+typedef struct {
+  uint64_t delivered_bytes;
+  uint32_t sent, retransmissions, drops;
+  uint32_t max_window;
+} bucket_t;
+
+typedef struct {
+  uint16_t sender, receiver; // Ports; the sender speaks first.
+  uint8_t stream;
+
+  uint64_t data_sent, data_bytes, retransmissions, data_dropped;
+  uint64_t data_delivered, delivered_bytes, data_lost;
+  uint64_t acks_sent, acks_dropped, acks_delivered, acks_lost;
+  int64_t first_time, last_delivery;
+
+  // Per segment: first transmission time, whether it was resent, and
+  // whether a selective ack covered it before the cumulative ack did.
+  int64_t *first_sent;
+  bool *resent, *sacked;
+  size_t seq_cap;
+  int64_t highest_sent;
+  uint32_t cum_ack;
+
+  // RTT samples in ns, Karn's rule: only never-retransmitted segments.
+  int64_t *rtt;
+  size_t rtt_len, rtt_cap;
+
+  // Window occupancy, time weighted.
+  uint32_t window, max_window;
+  int64_t window_since;
+  long double window_area;
+
+  // Episodes are runs of consecutive lost or retransmitted data packets.
+  uint64_t loss_episodes, loss_run, longest_loss;
+  uint64_t retx_episodes, retx_run, longest_retx;
+
+  bucket_t *buckets;
+  size_t buckets_len;
+} flow_t;
+
+static flow_t *flows;
+static size_t num_flows;
+
+static int64_t bucket_ns = 100 * 1000000LL;
+static int64_t origin = -1;
+static FILE *rtt_file;
+
+static bool same_ports(const flow_t *f, uint16_t a, uint16_t b) {
+  return (f->sender == a && f->receiver == b) ||
+         (f->sender == b && f->receiver == a);
+}
+
+// Stream of a packet between two ports. Sessions on other streams carry the
+// stream id in the top byte of every sequence number, stream 0 uses all 32
+// bits: the first packet between the ports tells which.
+static uint8_t packet_stream(uint16_t a, uint16_t b, const uint8_t *prefix) {
+  for (size_t i = num_flows; i-- > 0;) {
+    if (same_ports(&flows[i], a, b)) {
+      return flows[i].stream ? prefix[0] : 0;
+    }
+  }
+  return prefix[0];
+}
+
+// Find the flow of a packet from port `a` to port `b`, creating it with `a`
+// as the sender. Group NAKs come from a port of their own, so one that
+// starts a flow makes `b`, the group sender, the sender.
+static flow_t *find_flow(uint16_t a, uint16_t b, const record_t *r,
+                         bool create) {
+  uint8_t stream = packet_stream(a, b, r->prefix);
+  for (size_t i = num_flows; i-- > 0;) {
+    if (flows[i].stream == stream && same_ports(&flows[i], a, b)) {
+      return &flows[i];
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  bool nak = stream == RDT_GROUP_STREAM && r->length == sizeof(ack_pkt_t);
+  flows = xrealloc(flows, (num_flows + 1) * sizeof(flow_t));
+  flow_t *f = &flows[num_flows++];
+  memset(f, 0, sizeof(*f));
+  f->sender = nak ? b : a;
+  f->receiver = nak ? a : b;
+  f->stream = stream;
+  f->highest_sent = -1;
+  f->first_time = -1;
+  return f;
+}
+
+// Sequence number of a packet of the flow, without the stream id.
+static uint32_t flow_seq(const flow_t *f, const uint8_t *prefix) {
+  uint32_t seq = (uint32_t)prefix[0] << 24 | prefix[1] << 16 | prefix[2] << 8 |
+                 prefix[3];
+  return f->stream ? seq & RDT_SEQ_MASK : seq;
+}
+
+// The group sender closes with RDT_GROUP_FIN, not a segment.
+static bool flow_control(const flow_t *f, const uint8_t *prefix) {
+  return f->stream == RDT_GROUP_STREAM && flow_seq(f, prefix) == RDT_GROUP_FIN;
+}
+
+static bucket_t *flow_bucket(flow_t *f, int64_t time) {
+  size_t b = (time - origin) / bucket_ns;
+  if (b >= f->buckets_len) {
+    f->buckets = xrealloc(f->buckets, (b + 1) * sizeof(bucket_t));
+    memset(f->buckets + f->buckets_len, 0,
+           (b + 1 - f->buckets_len) * sizeof(bucket_t));
+    f->buckets_len = b + 1;
+  }
+  return &f->buckets[b];
+}
+
+static void flow_window(flow_t *f, int64_t time) {
+  f->window_area += (long double)f->window * (time - f->window_since);
+  f->window_since = time;
+  int64_t w = f->highest_sent + 1 - (int64_t)f->cum_ack;
+  f->window = w > 0 ? w : 0;
+  if (f->window > f->max_window) {
+    f->max_window = f->window;
+  }
+  bucket_t *b = flow_bucket(f, time);
+  if (f->window > b->max_window) {
+    b->max_window = f->window;
+  }
+}
+
+static void end_run(uint64_t *run, uint64_t *longest) {
+  if (*run > *longest) {
+    *longest = *run;
+  }
+  *run = 0;
+}
+
+static void data_sent(flow_t *f, const record_t *r, bool dropped) {
+  uint32_t seq = flow_seq(f, r->prefix);
+  if (f->first_time < 0) {
+    f->first_time = r->time;
+  }
+  if (seq >= f->seq_cap) {
+    size_t cap = f->seq_cap ? f->seq_cap : 1024;
+    while (cap <= seq) {
+      cap *= 2;
+    }
+    f->first_sent = xrealloc(f->first_sent, cap * sizeof(int64_t));
+    f->resent = xrealloc(f->resent, cap * sizeof(bool));
+    f->sacked = xrealloc(f->sacked, cap * sizeof(bool));
+    memset(f->resent + f->seq_cap, 0, cap - f->seq_cap);
+    memset(f->sacked + f->seq_cap, 0, cap - f->seq_cap);
+    f->seq_cap = cap;
+  }
+
+  bucket_t *b = flow_bucket(f, r->time);
+  f->data_sent++;
+  f->data_bytes += r->length;
+  b->sent++;
+
+  if ((int64_t)seq <= f->highest_sent) {
+    f->resent[seq] = true;
+    f->retransmissions++;
+    b->retransmissions++;
+    if (f->retx_run++ == 0) {
+      f->retx_episodes++;
+    }
+  } else {
+    for (int64_t s = f->highest_sent + 1; s <= seq; s++) {
+      f->first_sent[s] = r->time;
+    }
+    f->highest_sent = seq;
+    end_run(&f->retx_run, &f->longest_retx);
+  }
+
+  if (dropped) {
+    f->data_dropped++;
+    b->drops++;
+    if (f->loss_run++ == 0) {
+      f->loss_episodes++;
+    }
+  } else {
+    end_run(&f->loss_run, &f->longest_loss);
+  }
+  flow_window(f, r->time);
+}
+
+// RTT sample from a cumulative ack, as sample_rtt() in rdt.c takes it: from
+// the last segment the ack newly acknowledges, skipping those a selective ack
+// covered before, and none if that segment was resent (Karn).
+static void sample_rtt(flow_t *f, const record_t *r, uint32_t ack) {
+  uint32_t s = ack - 1;
+  while (s > f->cum_ack && s < f->seq_cap && f->sacked[s]) {
+    s--;
+  }
+  if (s >= f->seq_cap || (int64_t)s > f->highest_sent || f->resent[s]) {
+    return;
+  }
+  if (f->rtt_len == f->rtt_cap) {
+    f->rtt_cap = f->rtt_cap ? f->rtt_cap * 2 : 256;
+    f->rtt = xrealloc(f->rtt, f->rtt_cap * sizeof(int64_t));
+  }
+  int64_t sample = r->time - f->first_sent[s];
+  f->rtt[f->rtt_len++] = sample;
+  if (rtt_file) {
+    fprintf(rtt_file, "%u,%u,%u,%.3f,%u,%.3f\n", f->sender, f->receiver,
+            f->stream, (r->time - origin) / 1e6, s, sample / 1e6);
+  }
+}
+
+static void ack_received(flow_t *f, const record_t *r) {
+  uint32_t ack = flow_seq(f, r->prefix);
+  if (ack > f->cum_ack) {
+    sample_rtt(f, r, ack);
+    f->cum_ack = ack;
+  }
+
+  // Bit i of the selective acks stands for segment ack + 1 + i.
+  uint32_t bits = (uint32_t)r->prefix[4] << 24 | r->prefix[5] << 16 |
+                  r->prefix[6] << 8 | r->prefix[7];
+  for (uint32_t i = 0; bits; i++, bits >>= 1) {
+    uint64_t s = (uint64_t)ack + 1 + i;
+    if ((bits & 1) && s < f->seq_cap && (int64_t)s <= f->highest_sent) {
+      f->sacked[s] = true;
+    }
+  }
+  flow_window(f, r->time);
+}
+
+static void data_delivered(const record_t *r, uint16_t sender,
+                           uint16_t receiver, uint16_t length, int64_t time) {
+  flow_t *f = find_flow(sender, receiver, r, true);
+  if (f->receiver != receiver || flow_control(f, r->prefix)) {
+    return;
+  }
+  // Receivers log their whole buffer; trust the sender's length.
+  uint64_t payload = length > 4 ? length - 4 : 0;
+  f->data_delivered++;
+  f->delivered_bytes += payload;
+  if (time > f->last_delivery) {
+    f->last_delivery = time;
+  }
+  flow_bucket(f, time)->delivered_bytes += payload;
+}
+
+static void record_stats(const record_t *r) {
+  switch (r->kind) {
+  case PACKET_LOG_SENT:
+  case PACKET_LOG_DROPPED: {
+    flow_t *f = find_flow(r->local_port, r->remote_port, r, true);
+    if (flow_control(f, r->prefix)) {
+      break;
+    }
+    if (f->sender == r->local_port) {
+      data_sent(f, r, r->kind == PACKET_LOG_DROPPED);
+    } else {
+      f->acks_sent++;
+      f->acks_dropped += r->kind == PACKET_LOG_DROPPED;
+    }
+  } break;
+
+  case PACKET_LOG_RECEIVED: {
+    flow_t *f = find_flow(r->remote_port, r->local_port, r, true);
+    if (f->sender == r->local_port) {
+      f->acks_delivered++;
+      ack_received(f, r);
+    }
+  } break;
+  }
+}
+
+static int cmp_i64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void report_flow(flow_t *f, int64_t end_time) {
+  end_run(&f->loss_run, &f->longest_loss);
+  end_run(&f->retx_run, &f->longest_retx);
+  f->window_area += (long double)f->window * (end_time - f->window_since);
+
+  double span = f->first_time >= 0 && f->last_delivery > f->first_time
+                    ? (f->last_delivery - f->first_time) / 1e6
+                    : 0;
+
+  if (f->stream) {
+    printf("Flow %u -> %u, stream %u\n", f->sender, f->receiver, f->stream);
+  } else {
+    printf("Flow %u -> %u\n", f->sender, f->receiver);
+  }
+  printf("  Data packets: %" PRIu64 " sent (%" PRIu64 " bytes), %" PRIu64
+         " retransmissions, %" PRIu64 " dropped, %" PRIu64
+         " lost in transit.\n",
+         f->data_sent, f->data_bytes, f->retransmissions, f->data_dropped,
+         f->data_lost);
+  printf("  Delivered: %" PRIu64 " packets, %" PRIu64 " payload bytes in %.3f"
+         " ms (%.1f KB/s).\n",
+         f->data_delivered, f->delivered_bytes, span,
+         span > 0 ? f->delivered_bytes / span : 0);
+  printf("  ACKs: %" PRIu64 " sent, %" PRIu64 " dropped, %" PRIu64
+         " delivered, %" PRIu64 " lost in transit.\n",
+         f->acks_sent, f->acks_dropped, f->acks_delivered, f->acks_lost);
+
+  if (f->rtt_len) {
+    qsort(f->rtt, f->rtt_len, sizeof(int64_t), cmp_i64);
+    long double sum = 0;
+    for (size_t i = 0; i < f->rtt_len; i++) {
+      sum += f->rtt[i];
+    }
+    printf("  RTT: %zu samples, min %.3f, mean %.3f, p50 %.3f, p99 %.3f,"
+           " max %.3f ms.\n",
+           f->rtt_len, f->rtt[0] / 1e6, (double)(sum / f->rtt_len) / 1e6,
+           f->rtt[f->rtt_len / 2] / 1e6, f->rtt[f->rtt_len * 99 / 100] / 1e6,
+           f->rtt[f->rtt_len - 1] / 1e6);
+  } else {
+    printf("  RTT: no samples.\n");
+  }
+
+  int64_t active = end_time - f->first_time;
+  printf("  Window occupancy: mean %.2f, max %u segments.\n",
+         active > 0 ? (double)(f->window_area / active) : 0, f->max_window);
+  printf("  Loss episodes: %" PRIu64 " (longest %" PRIu64 " packets).\n",
+         f->loss_episodes, f->longest_loss);
+  printf("  Retransmission episodes: %" PRIu64 " (longest %" PRIu64
+         " packets).\n",
+         f->retx_episodes, f->longest_retx);
+}
+
+static void dump_timeline(FILE *out) {
+  fprintf(out, "sender,receiver,stream,start_ms,delivered_bytes,"
+               "throughput_kbps,sent,retransmissions,drops,max_window\n");
+  for (size_t i = 0; i < num_flows; i++) {
+    flow_t *f = &flows[i];
+    for (size_t b = 0; b < f->buckets_len; b++) {
+      bucket_t *k = &f->buckets[b];
+      fprintf(out, "%u,%u,%u,%.3f,%" PRIu64 ",%.1f,%u,%u,%u,%u\n", f->sender,
+              f->receiver, f->stream, b * bucket_ns / 1e6, k->delivered_bytes,
+              k->delivered_bytes * 8 / (bucket_ns / 1e6), k->sent,
+              k->retransmissions, k->drops, k->max_window);
+    }
+  }
+}
+
+/******************************************************************************\
+* MSC slice                                                                    *
+\******************************************************************************/
+
+typedef struct {
+  record_t record;
+  int64_t arcskip; // Rows until the matching receive, -1 if still pending.
+} msc_row_t;
+
+static msc_row_t *msc_rows;
+static size_t msc_len, msc_cap;
+static int64_t msc_from = 0, msc_to = INT64_MAX; // ns relative to origin.
+
+static void msc_add(const record_t *r) {
+  if (msc_len == msc_cap) {
+    msc_cap = msc_cap ? msc_cap * 2 : 1024;
+    msc_rows = xrealloc(msc_rows, msc_cap * sizeof(msc_row_t));
+  }
+  msc_rows[msc_len++] = (msc_row_t){*r, -1};
+}
+
+static void set_arcskip(uint64_t send_row, uint64_t receive_row) {
+  if (send_row != UINT64_MAX && receive_row != UINT64_MAX) {
+    msc_rows[send_row].arcskip =
+        receive_row > send_row ? receive_row - send_row : 0;
+  }
+}
+
+static void dump_msc(FILE *out) {
+  fprintf(out, "msc {\n");
+
+  // One entity per port, in order of appearance.
+  uint16_t *seen = calloc(msc_len * 2 + 1, sizeof(uint16_t));
+  size_t num_seen = 0;
+  for (size_t i = 0; i < msc_len; i++) {
+    uint16_t ports[2] = {msc_rows[i].record.local_port,
+                         msc_rows[i].record.remote_port};
+    for (int p = 0; p < (msc_rows[i].record.kind == PACKET_LOG_TIMEOUT ? 1 : 2);
+         p++) {
+      bool known = false;
+      for (size_t s = 0; s < num_seen && !known; s++) {
+        known = seen[s] == ports[p];
+      }
+      if (!known) {
+        fprintf(out, "%sp%u [label=\"127.0.0.1:%u\"]", num_seen ? ", " : "  ",
+                ports[p], ports[p]);
+        seen[num_seen++] = ports[p];
+      }
+    }
+  }
+  fprintf(out, ";\n");
+  free(seen);
+
+  for (size_t i = 0; i < msc_len; i++) {
+    const record_t *r = &msc_rows[i].record;
+    long ms = (r->time - origin) / 1000000;
+    switch (r->kind) {
+    case PACKET_LOG_SENT:
+      fprintf(out,
+              "  p%u => p%u [label=\"t=%ldms:%02X%02X%02X%02X\", "
+              "arcskip=\"%" PRId64 "\"];\n",
+              r->local_port, r->remote_port, ms, r->prefix[0], r->prefix[1],
+              r->prefix[2], r->prefix[3],
+              msc_rows[i].arcskip >= 0 ? msc_rows[i].arcskip
+                                       : (int64_t)(msc_len - i + 1));
+      break;
+    case PACKET_LOG_DROPPED:
+      fprintf(out, "  p%u -x p%u [label=\"t=%ldms:%02X%02X%02X%02X\"];\n",
+              r->local_port, r->remote_port, ms, r->prefix[0], r->prefix[1],
+              r->prefix[2], r->prefix[3]);
+      break;
+    case PACKET_LOG_RECEIVED:
+      fprintf(out, "|||;\n");
+      break;
+    case PACKET_LOG_TIMEOUT:
+      fprintf(out, "...;\n");
+      break;
+    }
+  }
+  fprintf(out, "  --- [label = \"Done\"];\n  |||;\n}\n");
+}
+
+/******************************************************************************\
+* Main                                                                         *
+\******************************************************************************/
+
+static void show_usage(const char *command) {
+  fprintf(stderr,
+          "Usage: %s [--bucket <ms>] [--timeline <csv-file>]"
+          " [--rtt <csv-file>] [--msc <msc-file>] [--from <ms>] [--to <ms>]"
+          " [--quiet] <log-file>...\n"
+          "\n"
+          " --bucket <ms>          - Throughput timeline resolution"
+          " (default: 100).\n"
+          " --timeline <csv-file>  - Write the per-flow timeline.\n"
+          " --rtt <csv-file>       - Write every RTT sample.\n"
+          " --msc <msc-file>       - Write an mscgen diagram of the slice.\n"
+          " --from <ms>            - Start of the MSC slice, relative to the"
+          " first packet (default: 0).\n"
+          " --to <ms>              - End of the MSC slice (default: end of"
+          " log).\n"
+          " --quiet                - Do not print flow statistics.\n",
+          command);
+  exit(EXIT_FAILURE);
+}
+
+static FILE *open_output(const char *file_name) {
+  FILE *f = fopen(file_name, "w");
+  if (!f) {
+    perror(file_name);
+    exit(EXIT_FAILURE);
+  }
+  return f;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *timeline_file = NULL, *msc_file = NULL;
+  bool quiet = false;
+
+  static const struct option options[] = {
+      {"bucket", required_argument, NULL, 'b'},
+      {"timeline", required_argument, NULL, 't'},
+      {"rtt", required_argument, NULL, 'r'},
+      {"msc", required_argument, NULL, 'm'},
+      {"from", required_argument, NULL, 'f'},
+      {"to", required_argument, NULL, 'T'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'b': bucket_ns = atof(optarg) * 1e6; break;
+    case 't': timeline_file = open_output(optarg); break;
+    case 'r': rtt_file = open_output(optarg); break;
+    case 'm': msc_file = open_output(optarg); break;
+    case 'f': msc_from = atof(optarg) * 1e6; break;
+    case 'T': msc_to = atof(optarg) * 1e6; break;
+    case 'q': quiet = true; break;
+    default: show_usage(argv[0]);
+    }
+  }
+  int num_logs = argc - optind;
+  if (num_logs < 1 || num_logs > MAX_LOGS || bucket_ns <= 0) {
+    show_usage(argv[0]);
+  }
+
+  if (rtt_file) {
+    fprintf(rtt_file, "sender,receiver,stream,time_ms,seq,rtt_ms\n");
+  }
+
+  log_reader_t readers[MAX_LOGS];
+  for (int i = 0; i < num_logs; i++) {
+    reader_open(&readers[i], argv[optind + i]);
+    reader_advance(&readers[i]);
+  }
+
+  match_index_t idx = {.free_list = -1};
+  int64_t last_time = 0;
+
+  // Each log is already in time order, so a k-way merge is enough.
+  for (;;) {
+    log_reader_t *next = NULL;
+    for (int i = 0; i < num_logs; i++) {
+      if (readers[i].has_record &&
+          (!next || readers[i].record.time < next->record.time)) {
+        next = &readers[i];
+      }
+    }
+    if (!next) {
+      break;
+    }
+    record_t r = next->record;
+    reader_advance(next);
+
+    if (origin < 0) {
+      origin = r.time;
+    }
+    last_time = r.time;
+
+    bool in_slice = msc_file && r.time - origin >= msc_from &&
+                    r.time - origin < msc_to;
+
+    uint64_t row = in_slice ? msc_len : UINT64_MAX;
+    if (in_slice) {
+      msc_add(&r);
+    }
+
+    record_stats(&r);
+    pending_t other;
+    if (r.kind == PACKET_LOG_SENT &&
+        index_match(&idx, &r, false, row, &other)) {
+      data_delivered(&r, r.local_port, r.remote_port, r.length, other.time);
+      set_arcskip(row, other.row);
+    } else if (r.kind == PACKET_LOG_RECEIVED &&
+               index_match(&idx, &r, true, row, &other)) {
+      data_delivered(&r, r.remote_port, r.local_port, other.length, r.time);
+      set_arcskip(other.row, row);
+    }
+
+  }
+
+  // Sends still pending were lost without being logged as dropped.
+  for (size_t i = 0; i < idx.cap; i++) {
+    slot_t *s = &idx.slots[i];
+    if (!s->used || s->receives) {
+      continue;
+    }
+    record_t key = {0};
+    memcpy(key.prefix, s->prefix, KEY_BYTES);
+    flow_t *f = find_flow(s->src, s->dst, &key, false);
+    if (f && flow_control(f, s->prefix)) {
+      continue; // Extra copies of the close.
+    }
+    for (int32_t n = s->head; n >= 0 && f; n = idx.pending[n].next) {
+      if (f->sender == s->src) {
+        f->data_lost++;
+      } else {
+        f->acks_lost++;
+      }
+    }
+  }
+
+  if (!quiet) {
+    for (size_t i = 0; i < num_flows; i++) {
+      report_flow(&flows[i], last_time);
+    }
+  }
+  if (timeline_file) {
+    dump_timeline(timeline_file);
+    fclose(timeline_file);
+  }
+  if (rtt_file) {
+    fclose(rtt_file);
+  }
+  if (msc_file) {
+    dump_msc(msc_file);
+    fclose(msc_file);
+  }
+
+  for (int i = 0; i < num_logs; i++) {
+    fclose(readers[i].file);
+    free(readers[i].line);
+    free(readers[i].data);
+  }
+  return 0;
+}
@@ -1,3 +1,6 @@
+#ifndef PACKET_FORMAT_H
+#define PACKET_FORMAT_H
+
 #include <stdint.h>
 
 #define MAX_WINDOW_SIZE 32
@@ -13,3 +16,5 @@ typedef struct __attribute__((__packed__)) ack_pkt_t {
   uint32_t seq_num;
   uint32_t selective_acks;
 } ack_pkt_t;
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PACKET_LOG_H
+#define PACKET_LOG_H
+
+#include <stdint.h>
+
+// Binary packet log: PACKET_LOG_MAGIC followed by one record per packet,
+// each followed by `length` bytes of packet data. Host byte order except for
+// addresses and ports, which are kept in network byte order.
+#define PACKET_LOG_MAGIC "RDTPLOG1"
+
+enum {
+  PACKET_LOG_SENT,     // "=>"
+  PACKET_LOG_DROPPED,  // "-x"
+  PACKET_LOG_RECEIVED, // "<="
+  PACKET_LOG_TIMEOUT,  // "x-"
+};
+
+typedef struct __attribute__((__packed__)) packet_log_record_t {
+  uint8_t kind;
+  uint16_t length;
+  int64_t sec;
+  int32_t nsec;
+  uint32_t local_addr;
+  uint16_t local_port;
+  uint32_t remote_addr;
+  uint16_t remote_port;
+} packet_log_record_t;
+
+#endif
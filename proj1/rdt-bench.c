@@ -0,0 +1,290 @@
+/*
+ * Reliable Data Transfer
+ * Small transfer latency benchmark
+ *
+ * Runs a librdt sender and receiver in one process over real loopback
+ * sockets and reports completion time percentiles for files of 1 to 64 KB,
+ * with the default timers and with tail loss probing. Losses are injected
+ * on transmission through the rdt_io_t hooks, so both modes face the exact
+ * same drops for a given seed.
+ * */
+
+#define _GNU_SOURCE
+#include "rdt.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SIZE (64 * 1024)
+
+typedef struct {
+  int sockfd;
+  struct sockaddr_in peer;
+  double loss;
+  uint64_t *rng;
+} endpoint_t;
+
+typedef struct {
+  char *data;
+  uint64_t written;
+} sink_t;
+
+// xorshift64*, as in rdt-sim.
+static uint64_t rng_next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_uniform(uint64_t *state) {
+  return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static ssize_t lossy_send(void *ctx, const void *pkt, size_t len) {
+  endpoint_t *e = ctx;
+  if (e->loss > 0 && rng_uniform(e->rng) < e->loss) {
+    return len;
+  }
+  return sendto(e->sockfd, pkt, len, 0, (struct sockaddr *)&e->peer,
+                sizeof(e->peer));
+}
+
+static uint64_t clock_ms(void *ctx) { return now_ns() / 1000000; }
+
+static size_t read_buffer(void *ctx, uint64_t offset, void *buf, size_t len) {
+  memcpy(buf, (const char *)ctx + offset, len);
+  return len;
+}
+
+static void write_buffer(void *ctx, uint64_t offset, const void *buf,
+                         size_t len) {
+  sink_t *sink = ctx;
+  memcpy(sink->data + offset, buf, len);
+  if (offset + len > sink->written) {
+    sink->written = offset + len;
+  }
+}
+
+static int bound_socket(struct sockaddr_in *addr) {
+  int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  *addr = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  if (sockfd == -1 ||
+      bind(sockfd, (struct sockaddr *)addr, sizeof(*addr)) == -1 ||
+      getsockname(sockfd, (struct sockaddr *)addr,
+                   &(socklen_t){sizeof(*addr)}) == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  return sockfd;
+}
+
+// Discard whatever the previous run left in flight.
+static void drain(int sockfd) {
+  data_pkt_t pkt;
+  while (recv(sockfd, &pkt, sizeof(pkt), MSG_DONTWAIT) >= 0) {
+  }
+}
+
+// Completion time in microseconds, 0 if the transfer failed.
+static uint64_t run_transfer(endpoint_t *tx, endpoint_t *rx,
+                             const rdt_config_t *base, const char *payload,
+                             uint64_t length, char *scratch, bool busy_poll) {
+  rdt_io_t tx_io = {lossy_send, clock_ms, tx}, rx_io = {lossy_send, clock_ms, rx};
+  rdt_config_t config = *base;
+  sink_t sink = {scratch, 0};
+
+  uint64_t start = now_ns();
+  config.io = &tx_io;
+  rdt_sender_t *sender = rdt_sender_new(tx->sockfd, &tx->peer, &config, length,
+                                        read_buffer, (void *)payload);
+  config.io = &rx_io;
+  rdt_receiver_t *receiver =
+      rdt_receiver_new(rx->sockfd, &config, write_buffer, &sink);
+  if (!sender || !receiver) {
+    perror("rdt_*_new");
+    exit(EXIT_FAILURE);
+  }
+
+  // The receiver keeps acknowledging once done, as in --low-latency.
+  rdt_status_t status = rdt_sender_start(sender);
+  while (status == RDT_RUNNING) {
+    struct pollfd pfds[2] = {{.fd = tx->sockfd, .events = POLLIN},
+                             {.fd = rx->sockfd, .events = POLLIN}};
+    int ready = poll(pfds, 2, busy_poll ? 0 : rdt_sender_timeout(sender));
+    if (ready < 0 && errno != EINTR) {
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+    if (ready > 0 && (pfds[1].revents & POLLIN)) {
+      rdt_receiver_on_readable(receiver);
+    }
+    status = ready > 0 && (pfds[0].revents & POLLIN)
+                 ? rdt_sender_on_readable(sender)
+                 : rdt_sender_on_timer(sender);
+  }
+  uint64_t elapsed = (now_ns() - start) / 1000;
+
+  bool ok = status == RDT_DONE &&
+            rdt_receiver_status(receiver) == RDT_DONE &&
+            sink.written == length && !memcmp(payload, scratch, length);
+  rdt_sender_free(sender);
+  rdt_receiver_free(receiver);
+  drain(tx->sockfd);
+  drain(rx->sockfd);
+  return ok ? (elapsed ? elapsed : 1) : 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void show_usage(const char *command) {
+  fprintf(stderr,
+          "Usage: %s [--runs <n>] [--window <n>] [--loss <p>] [--seed <n>]"
+          " [--busy-poll] [--cpu <n>] [--csv]\n"
+          "\n"
+          " --runs <n>    - Transfers per size and mode (default: 200).\n"
+          " --window <n>  - Window size (default: 8).\n"
+          " --loss <p>    - Per packet loss probability, both ways"
+          " (default: 0).\n"
+          " --seed <n>    - Loss pattern seed (default: 1).\n"
+          " --busy-poll   - Spin instead of sleeping in poll().\n"
+          " --cpu <n>     - Pin the benchmark to a CPU.\n"
+          " --csv         - Print CSV instead of a table.\n",
+          command);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  long runs = 200;
+  int window_size = 8, cpu = -1;
+  double loss = 0;
+  uint64_t seed = 1;
+  bool busy_poll = false, csv = false;
+
+  static const struct option options[] = {
+      {"runs", required_argument, NULL, 'n'},
+      {"window", required_argument, NULL, 'w'},
+      {"loss", required_argument, NULL, 'l'},
+      {"seed", required_argument, NULL, 'S'},
+      {"busy-poll", no_argument, NULL, 'b'},
+      {"cpu", required_argument, NULL, 'C'},
+      {"csv", no_argument, NULL, 'c'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'n': runs = atol(optarg); break;
+    case 'w': window_size = atoi(optarg); break;
+    case 'l': loss = atof(optarg); break;
+    case 'S': seed = strtoull(optarg, NULL, 10); break;
+    case 'b': busy_poll = true; break;
+    case 'C': cpu = atoi(optarg); break;
+    case 'c': csv = true; break;
+    default: show_usage(argv[0]);
+    }
+  }
+  if (optind != argc || window_size < 1 || window_size > MAX_WINDOW_SIZE ||
+      runs < 1) {
+    show_usage(argv[0]);
+  }
+
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+      perror("sched_setaffinity");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  char *payload = malloc(MAX_SIZE);
+  char *scratch = malloc(MAX_SIZE);
+  uint64_t *times = malloc(runs * sizeof(uint64_t));
+  if (!payload || !scratch || !times) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t fill = 0x5EED;
+  for (int i = 0; i < MAX_SIZE; i++) {
+    payload[i] = rng_next(&fill);
+  }
+
+  endpoint_t tx = {.loss = loss}, rx = {.loss = loss};
+  tx.sockfd = bound_socket(&rx.peer);
+  rx.sockfd = bound_socket(&tx.peer);
+
+  if (csv) {
+    printf("size,mode,completed,mean_us,p50_us,p99_us,max_us\n");
+  } else {
+    printf("%6s %-14s %9s %9s %9s %9s %9s\n", "size", "mode", "completed",
+           "mean us", "p50 us", "p99 us", "max us");
+  }
+
+  for (int size = 1024; size <= MAX_SIZE; size *= 2) {
+    for (int probe = 0; probe <= 1; probe++) {
+      rdt_config_t config = {.window_size = window_size,
+                             .tail_loss_probe = probe};
+      uint64_t rng = seed * 0x9E3779B97F4A7C15ULL | 1;
+      tx.rng = rx.rng = &rng;
+
+      long completed = 0;
+      double mean = 0;
+      for (long i = 0; i < runs; i++) {
+        uint64_t t = run_transfer(&tx, &rx, &config, payload, size, scratch,
+                                  busy_poll);
+        if (t) {
+          times[completed++] = t;
+          mean += t;
+        }
+      }
+      qsort(times, completed, sizeof(uint64_t), cmp_u64);
+      mean = completed ? mean / completed : 0;
+
+      const char *mode = probe ? "tail-probe" : "default";
+      uint64_t p50 = completed ? times[completed / 2] : 0;
+      uint64_t p99 = completed ? times[completed * 99 / 100] : 0;
+      uint64_t max = completed ? times[completed - 1] : 0;
+      if (csv) {
+        printf("%d,%s,%ld,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", size,
+               mode, completed, mean, p50, p99, max);
+      } else {
+        printf("%5dK %-14s %9ld %9.1f %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+               "\n",
+               size / 1024, mode, completed, mean, p50, p99, max);
+      }
+      fflush(stdout);
+    }
+  }
+
+  close(tx.sockfd);
+  close(rx.sockfd);
+  free(payload);
+  free(scratch);
+  free(times);
+  return 0;
+}
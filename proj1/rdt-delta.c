@@ -0,0 +1,707 @@
+/*
+ * Reliable Data Transfer library (librdt)
+ * Delta synchronisation, see rdt-delta.h.
+ * */
+
+#include "rdt-delta.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define REQUEST_MAGIC "RDTR"
+#define SIGNATURE_MAGIC "RDTS"
+#define DELTA_MAGIC "RDTD"
+
+#define OP_COPY 'C'    // u32 first block, u32 block count
+#define OP_LITERAL 'L' // u32 length, then the bytes
+
+#define SIGNATURE_HEADER 20 // magic, u32 block size, u64 file size, u32 count
+#define SIGNATURE_ENTRY 12  // u32 weak, u64 strong
+#define DELTA_HEADER 12     // magic, u64 file size
+
+/******************************************************************************\
+* Buffers and byte order helpers                                               *
+\******************************************************************************/
+
+static void buffer_reserve(rdt_buffer_t *b, size_t len) {
+  if (len <= b->cap) {
+    return;
+  }
+  size_t cap = b->cap ? b->cap : 4096;
+  while (cap < len) {
+    cap *= 2;
+  }
+  b->data = realloc(b->data, cap);
+  if (!b->data) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  b->cap = cap;
+}
+
+static void buffer_append(rdt_buffer_t *b, const void *data, size_t len) {
+  buffer_reserve(b, b->len + len);
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static void put_u32(rdt_buffer_t *b, uint32_t v) {
+  uint32_t n = htonl(v);
+  buffer_append(b, &n, 4);
+}
+
+static void put_u64(rdt_buffer_t *b, uint64_t v) {
+  put_u32(b, v >> 32);
+  put_u32(b, v);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  uint32_t n;
+  memcpy(&n, p, 4);
+  return ntohl(n);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+size_t rdt_buffer_read(void *ctx, uint64_t offset, void *buf, size_t len) {
+  rdt_buffer_t *b = ctx;
+  if (offset >= b->len) {
+    return 0;
+  }
+  if (len > b->len - offset) {
+    len = b->len - offset;
+  }
+  memcpy(buf, b->data + offset, len);
+  return len;
+}
+
+void rdt_buffer_write(void *ctx, uint64_t offset, const void *buf, size_t len) {
+  rdt_buffer_t *b = ctx;
+  buffer_reserve(b, offset + len);
+  memcpy(b->data + offset, buf, len);
+  if (offset + len > b->len) {
+    b->len = offset + len;
+  }
+}
+
+/******************************************************************************\
+* Checksums                                                                    *
+\******************************************************************************/
+
+uint32_t rdt_weak_checksum(const uint8_t *buf, size_t len) {
+  uint32_t a = 0, b = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // Per 16 byte chunk k at offset 16k, with n = len / 16 chunks and
+  // r = len % 16: b gets (r + 16 (n - k)) S_k - J_k, where S_k is the byte
+  // sum and J_k = sum(j x[16k + j]). The (n - k) S_k terms are accumulated
+  // as running prefix sums, as in Adler-32 implementations.
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w_lo = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m128i w_hi = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i v_sum = zero, v_prefix = zero, v_j = zero;
+  size_t chunks = len / 16;
+  for (; i < chunks * 16; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+    v_prefix = _mm_add_epi64(v_prefix, v_sum);
+    v_sum = _mm_add_epi64(v_sum, _mm_sad_epu8(x, zero));
+    v_j = _mm_add_epi32(v_j,
+                        _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(x, zero), w_lo),
+                                      _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), w_hi)));
+  }
+
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, v_sum);
+  uint32_t sum = lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i *)lanes, v_prefix);
+  uint32_t prefix = lanes[0] + lanes[1];
+  uint32_t j[4];
+  _mm_storeu_si128((__m128i *)j, v_j);
+
+  uint32_t r = len - chunks * 16;
+  a = sum;
+  b = r * sum + 16 * (prefix + sum) - (j[0] + j[1] + j[2] + j[3]);
+#endif
+
+  for (; i < len; i++) {
+    a += buf[i];
+    b += (uint32_t)(len - i) * buf[i];
+  }
+  return (a & 0xFFFF) | b << 16;
+}
+
+uint64_t rdt_strong_hash(const uint8_t *buf, size_t len) {
+  const uint64_t m = 0xC6A4A7935BD1E995ULL;
+  const int r = 47;
+  uint64_t h = 0x5EEDULL ^ (len * m);
+
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t k;
+    memcpy(&k, buf + i, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  if (i < len) {
+    uint64_t k = 0;
+    memcpy(&k, buf + i, len - i);
+    h ^= k;
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+bool rdt_delta_valid_block_size(uint64_t block_size) {
+  return block_size > 0 && block_size <= RDT_DELTA_MAX_BLOCK;
+}
+
+uint32_t rdt_delta_block_size(uint64_t len) {
+  // Integer square root, Newton's method.
+  uint64_t b = len, next = (len + 1) / 2;
+  while (next < b) {
+    b = next;
+    next = (b + len / b) / 2;
+  }
+  b = (b + 7) & ~7ULL;
+  if (b < RDT_DELTA_MIN_BLOCK) {
+    return RDT_DELTA_MIN_BLOCK;
+  }
+  return b > RDT_DELTA_MAX_BLOCK ? RDT_DELTA_MAX_BLOCK : b;
+}
+
+/******************************************************************************\
+* Signatures, encoding and decoding                                            *
+\******************************************************************************/
+
+void rdt_delta_signature(const uint8_t *old, uint64_t old_len,
+                         uint32_t block_size, rdt_buffer_t *out) {
+  uint32_t count = old_len / block_size; // Only full blocks can be matched.
+  buffer_reserve(out, out->len + SIGNATURE_HEADER + count * SIGNATURE_ENTRY);
+  buffer_append(out, SIGNATURE_MAGIC, 4);
+  put_u32(out, block_size);
+  put_u64(out, old_len);
+  put_u32(out, count);
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t *block = old + (uint64_t)i * block_size;
+    put_u32(out, rdt_weak_checksum(block, block_size));
+    put_u64(out, rdt_strong_hash(block, block_size));
+  }
+}
+
+typedef struct {
+  uint32_t *heads; // Weak checksum bucket -> first block, UINT32_MAX if none.
+  uint32_t *next;  // Block -> next block in the same bucket.
+  uint32_t mask;
+} block_index_t;
+
+static void flush_literal(rdt_buffer_t *out, const uint8_t *data,
+                          uint64_t from, uint64_t to,
+                          rdt_delta_stats_t *stats) {
+  while (from < to) {
+    uint32_t len = to - from > UINT32_MAX ? UINT32_MAX : to - from;
+    uint8_t op = OP_LITERAL;
+    buffer_append(out, &op, 1);
+    put_u32(out, len);
+    buffer_append(out, data + from, len);
+    stats->literal_bytes += len;
+    from += len;
+  }
+}
+
+static void flush_copy(rdt_buffer_t *out, uint32_t first, uint32_t count) {
+  if (count) {
+    uint8_t op = OP_COPY;
+    buffer_append(out, &op, 1);
+    put_u32(out, first);
+    put_u32(out, count);
+  }
+}
+
+bool rdt_delta_encode(const uint8_t *sig, size_t sig_len, const uint8_t *data,
+                      uint64_t len, rdt_buffer_t *out,
+                      rdt_delta_stats_t *stats) {
+  if (sig_len < SIGNATURE_HEADER || memcmp(sig, SIGNATURE_MAGIC, 4)) {
+    return false;
+  }
+  uint32_t block_size = get_u32(sig + 4);
+  uint32_t count = get_u32(sig + 16);
+  if (!rdt_delta_valid_block_size(block_size) ||
+      (sig_len - SIGNATURE_HEADER) / SIGNATURE_ENTRY < count) {
+    return false;
+  }
+  const uint8_t *entries = sig + SIGNATURE_HEADER;
+
+  buffer_append(out, DELTA_MAGIC, 4);
+  put_u64(out, len);
+  stats->file_bytes = len;
+
+  block_index_t idx = {0};
+  uint32_t buckets = 1;
+  while (buckets < 2 * count) {
+    buckets *= 2;
+  }
+  idx.mask = buckets - 1;
+  idx.heads = malloc(buckets * sizeof(uint32_t));
+  idx.next = malloc((count ? count : 1) * sizeof(uint32_t));
+  if (!idx.heads || !idx.next) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(idx.heads, 0xFF, buckets * sizeof(uint32_t));
+  // Insert backwards so each bucket lists blocks in file order.
+  for (uint32_t i = count; i-- > 0;) {
+    uint32_t weak = get_u32(entries + (size_t)i * SIGNATURE_ENTRY);
+    uint32_t h = (weak * 0x9E3779B1u) & idx.mask;
+    idx.next[i] = idx.heads[h];
+    idx.heads[h] = i;
+  }
+
+  uint64_t literal_from = 0, pos = 0;
+  uint32_t run_first = 0, run_count = 0; // Pending run of consecutive copies.
+
+  while (count && pos + block_size <= len) {
+    uint32_t weak = rdt_weak_checksum(data + pos, block_size);
+    uint32_t a = weak & 0xFFFF, b = weak >> 16;
+
+    for (;;) {
+      uint32_t match = UINT32_MAX;
+      uint32_t h = (weak * 0x9E3779B1u) & idx.mask;
+      bool have_strong = false;
+      uint64_t strong = 0;
+
+      // Prefer the block after the previous match, so runs stay contiguous.
+      uint32_t preferred = run_count ? run_first + run_count : UINT32_MAX;
+      for (uint32_t i = idx.heads[h]; i != UINT32_MAX; i = idx.next[i]) {
+        // Buckets list blocks in file order: once past the preferred block,
+        // the first match found is the one to take.
+        if (match != UINT32_MAX && (preferred == UINT32_MAX || i > preferred)) {
+          break;
+        }
+        const uint8_t *e = entries + (size_t)i * SIGNATURE_ENTRY;
+        if (get_u32(e) != weak) {
+          continue;
+        }
+        if (!have_strong) {
+          strong = rdt_strong_hash(data + pos, block_size);
+          have_strong = true;
+        }
+        if (get_u64(e + 4) == strong) {
+          if (i == preferred) {
+            match = i;
+            break;
+          }
+          if (match == UINT32_MAX) {
+            match = i;
+          }
+        }
+      }
+
+      if (match != UINT32_MAX) {
+        flush_literal(out, data, literal_from, pos, stats);
+        if (run_count && match == run_first + run_count) {
+          run_count++;
+        } else {
+          flush_copy(out, run_first, run_count);
+          run_first = match;
+          run_count = 1;
+        }
+        stats->matched_bytes += block_size;
+        pos += block_size;
+        literal_from = pos;
+        break; // Recompute the checksum from scratch at the new position.
+      }
+
+      if (run_count) {
+        flush_copy(out, run_first, run_count);
+        run_count = 0;
+      }
+
+      // Roll the window one byte forward.
+      if (pos + block_size >= len) {
+        pos = len;
+        break;
+      }
+      uint8_t drop = data[pos], add = data[pos + block_size];
+      a = a - drop + add;
+      b = b - block_size * drop + a;
+      weak = (a & 0xFFFF) | b << 16;
+      pos++;
+    }
+  }
+
+  flush_copy(out, run_first, run_count);
+  flush_literal(out, data, literal_from, len, stats);
+  free(idx.heads);
+  free(idx.next);
+  return true;
+}
+
+static bool write_all(int fd, const uint8_t *data, uint64_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool rdt_delta_apply(const uint8_t *delta, size_t delta_len,
+                     const uint8_t *old, uint64_t old_len, uint32_t block_size,
+                     int out_fd) {
+  if (delta_len < DELTA_HEADER || memcmp(delta, DELTA_MAGIC, 4)) {
+    return false;
+  }
+  uint64_t expected = get_u64(delta + 4), written = 0;
+  size_t p = DELTA_HEADER;
+
+  while (p < delta_len) {
+    uint8_t op = delta[p++];
+    if (op == OP_COPY && p + 8 <= delta_len) {
+      uint64_t first = get_u32(delta + p), count = get_u32(delta + p + 4);
+      p += 8;
+      // Both come from the peer: bound them without multiplying.
+      uint64_t blocks = block_size ? old_len / block_size : 0;
+      if (first > blocks || count > blocks - first ||
+          !write_all(out_fd, old + first * block_size, count * block_size)) {
+        return false;
+      }
+      written += count * block_size;
+    } else if (op == OP_LITERAL && p + 4 <= delta_len) {
+      uint32_t len = get_u32(delta + p);
+      p += 4;
+      if (len > delta_len - p || !write_all(out_fd, delta + p, len)) {
+        return false;
+      }
+      p += len;
+      written += len;
+    } else {
+      return false;
+    }
+  }
+  return written == expected;
+}
+
+/******************************************************************************\
+* Drivers                                                                      *
+\******************************************************************************/
+
+typedef struct {
+  const uint8_t *data;
+  uint64_t len;
+} mapping_t;
+
+static bool map_file(int fd, mapping_t *m) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return false;
+  }
+  m->len = st.st_size;
+  m->data = NULL;
+  if (m->len) {
+    void *p = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    m->data = p;
+  }
+  return true;
+}
+
+static void unmap_file(mapping_t *m) {
+  if (m->len) {
+    munmap((void *)m->data, m->len);
+  }
+}
+
+// Wait for the socket or the earliest session deadline.
+static bool wait_ready(int sockfd, rdt_sender_t **senders, int n) {
+  int timeout = -1;
+  for (int i = 0; i < n; i++) {
+    int t = senders[i] ? rdt_sender_timeout(senders[i]) : -1;
+    if (t >= 0 && (timeout < 0 || t < timeout)) {
+      timeout = t;
+    }
+  }
+  struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+  return poll(&pfd, 1, timeout) > 0;
+}
+
+// Receive one datagram, returning its length or -1 when none is pending.
+// Called once per readiness, so that log-packets.so logs no empty reads.
+static ssize_t receive(int sockfd, data_pkt_t *pkt, struct sockaddr_in *from) {
+  ssize_t len =
+      recvfrom(sockfd, pkt, sizeof(*pkt), MSG_DONTWAIT,
+               (struct sockaddr *)from, &(socklen_t){sizeof(*from)});
+  return len >= 4 ? len : -1;
+}
+
+rdt_status_t rdt_delta_send_file(int sockfd, const struct sockaddr_in *peer,
+                                 const rdt_config_t *config, int fd,
+                                 uint32_t block_size, rdt_delta_stats_t *stats,
+                                 const char **error) {
+  mapping_t file;
+  if (!map_file(fd, &file)) {
+    *error = strerror(errno);
+    return RDT_FAILED;
+  }
+  if (!block_size) {
+    block_size = rdt_delta_block_size(file.len);
+  }
+
+  rdt_buffer_t request = {0}, signature = {0}, delta = {0};
+  buffer_append(&request, REQUEST_MAGIC, 4);
+  put_u32(&request, block_size);
+
+  rdt_config_t c = *config;
+  c.stream = RDT_DELTA_REQUEST_STREAM;
+  rdt_sender_t *req = rdt_sender_new(sockfd, peer, &c, request.len,
+                                     rdt_buffer_read, &request);
+  c.stream = RDT_DELTA_SIGNATURE_STREAM;
+  rdt_receiver_t *sig = rdt_receiver_new(sockfd, &c, rdt_buffer_write,
+                                         &signature);
+  rdt_sender_t *data = NULL;
+  if (!req || !sig) {
+    *error = strerror(errno);
+    return RDT_FAILED;
+  }
+
+  rdt_status_t status = rdt_sender_start(req);
+  while (status == RDT_RUNNING) {
+    rdt_sender_t *senders[] = {req, data};
+    if (wait_ready(sockfd, senders, 2)) {
+      data_pkt_t pkt;
+      struct sockaddr_in from;
+      ssize_t len;
+      if ((len = receive(sockfd, &pkt, &from)) >= 0) {
+        switch (rdt_packet_stream(&pkt)) {
+        case RDT_DELTA_REQUEST_STREAM:
+          rdt_sender_on_packet(req, &pkt, len, &from);
+          break;
+        case RDT_DELTA_SIGNATURE_STREAM:
+          rdt_receiver_on_packet(sig, &pkt, len, &from);
+          break;
+        case RDT_DELTA_DATA_STREAM:
+          if (data) {
+            rdt_sender_on_packet(data, &pkt, len, &from);
+          }
+          break;
+        }
+      }
+    }
+    rdt_sender_on_timer(req);
+    if (data) {
+      rdt_sender_on_timer(data);
+    }
+
+    if (!data && rdt_receiver_status(sig) == RDT_DONE) {
+      if (!rdt_delta_encode(signature.data, signature.len, file.data,
+                            file.len, &delta, stats)) {
+        *error = "Malformed signatures.";
+        status = RDT_FAILED;
+        break;
+      }
+      stats->signature_bytes = signature.len;
+      stats->delta_bytes = delta.len;
+
+      c.stream = RDT_DELTA_DATA_STREAM;
+      data = rdt_sender_new(sockfd, peer, &c, delta.len, rdt_buffer_read,
+                            &delta);
+      if (!data) {
+        *error = strerror(errno);
+        status = RDT_FAILED;
+        break;
+      }
+      rdt_sender_start(data);
+    }
+
+    // The request only matters until signatures start flowing.
+    if (rdt_sender_status(req) == RDT_FAILED && !rdt_receiver_peer(sig)) {
+      *error = rdt_sender_error(req);
+      status = RDT_FAILED;
+    } else if (rdt_receiver_status(sig) == RDT_FAILED) {
+      *error = rdt_receiver_error(sig);
+      status = RDT_FAILED;
+    } else if (data) {
+      status = rdt_sender_status(data);
+      *error = rdt_sender_error(data);
+    }
+  }
+
+  rdt_sender_free(req);
+  rdt_receiver_free(sig);
+  if (data) {
+    rdt_sender_free(data);
+  }
+  free(request.data);
+  free(signature.data);
+  free(delta.data);
+  unmap_file(&file);
+  return status;
+}
+
+rdt_status_t rdt_delta_receive_file(int sockfd, const rdt_config_t *config,
+                                    const char *file_name,
+                                    rdt_delta_stats_t *stats,
+                                    const char **error) {
+  rdt_buffer_t request = {0}, signature = {0}, delta = {0};
+  mapping_t old = {0};
+  int old_fd = -1;
+  uint32_t block_size = 0;
+
+  rdt_config_t c = *config;
+  c.stream = RDT_DELTA_REQUEST_STREAM;
+  rdt_receiver_t *req = rdt_receiver_new(sockfd, &c, rdt_buffer_write,
+                                         &request);
+  c.stream = RDT_DELTA_DATA_STREAM;
+  rdt_receiver_t *data = rdt_receiver_new(sockfd, &c, rdt_buffer_write,
+                                          &delta);
+  rdt_sender_t *sig = NULL;
+  if (!req || !data) {
+    *error = strerror(errno);
+    return RDT_FAILED;
+  }
+
+  rdt_status_t status = RDT_RUNNING;
+  while (status == RDT_RUNNING) {
+    if (wait_ready(sockfd, &sig, 1)) {
+      data_pkt_t pkt;
+      struct sockaddr_in from;
+      ssize_t len;
+      if ((len = receive(sockfd, &pkt, &from)) >= 0) {
+        switch (rdt_packet_stream(&pkt)) {
+        case RDT_DELTA_REQUEST_STREAM:
+          rdt_receiver_on_packet(req, &pkt, len, &from);
+          break;
+        case RDT_DELTA_SIGNATURE_STREAM:
+          if (sig) {
+            rdt_sender_on_packet(sig, &pkt, len, &from);
+          }
+          break;
+        case RDT_DELTA_DATA_STREAM:
+          rdt_receiver_on_packet(data, &pkt, len, &from);
+          break;
+        }
+      }
+    }
+    if (sig) {
+      rdt_sender_on_timer(sig);
+    }
+
+    if (!sig && rdt_receiver_status(req) == RDT_DONE) {
+      if (request.len != 8 || memcmp(request.data, REQUEST_MAGIC, 4) ||
+          !rdt_delta_valid_block_size(block_size =
+                                          get_u32(request.data + 4))) {
+        *error = "Malformed delta request.";
+        status = RDT_FAILED;
+        break;
+      }
+
+      // A missing file simply has no blocks to match.
+      old_fd = open(file_name, O_RDONLY);
+      if (old_fd != -1 && !map_file(old_fd, &old)) {
+        *error = strerror(errno);
+        status = RDT_FAILED;
+        break;
+      }
+      rdt_delta_signature(old.data, old.len, block_size, &signature);
+      stats->signature_bytes = signature.len;
+
+      c.stream = RDT_DELTA_SIGNATURE_STREAM;
+      sig = rdt_sender_new(sockfd, rdt_receiver_peer(req), &c, signature.len,
+                           rdt_buffer_read, &signature);
+      if (!sig) {
+        *error = strerror(errno);
+        status = RDT_FAILED;
+        break;
+      }
+      rdt_sender_start(sig);
+    }
+
+    if (rdt_receiver_status(req) == RDT_FAILED) {
+      *error = rdt_receiver_error(req);
+      status = RDT_FAILED;
+    } else if (rdt_receiver_status(data) == RDT_FAILED) {
+      *error = rdt_receiver_error(data);
+      status = RDT_FAILED;
+    } else if (sig && rdt_sender_status(sig) == RDT_FAILED &&
+               !rdt_receiver_peer(data)) {
+      *error = rdt_sender_error(sig);
+      status = RDT_FAILED;
+    } else if (rdt_receiver_status(data) == RDT_DONE) {
+      status = RDT_DONE;
+    }
+  }
+
+  if (status == RDT_DONE) {
+    stats->delta_bytes = delta.len;
+
+    // Rebuild next to the old copy, then atomically replace it.
+    size_t tmp_len = strlen(file_name) + sizeof(".rdt-delta");
+    char *tmp_name = malloc(tmp_len);
+    snprintf(tmp_name, tmp_len, "%s.rdt-delta", file_name);
+    int out_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd == -1) {
+      *error = strerror(errno);
+      status = RDT_FAILED;
+    } else if (!rdt_delta_apply(delta.data, delta.len, old.data, old.len,
+                                block_size, out_fd)) {
+      *error = "Malformed delta.";
+      status = RDT_FAILED;
+    }
+    if (out_fd != -1) {
+      close(out_fd);
+    }
+    if (status == RDT_DONE && rename(tmp_name, file_name) == -1) {
+      *error = strerror(errno);
+      status = RDT_FAILED;
+    }
+    if (status == RDT_FAILED) {
+      unlink(tmp_name);
+    }
+    free(tmp_name);
+    if (delta.len >= DELTA_HEADER) {
+      stats->file_bytes = get_u64(delta.data + 4);
+    }
+  }
+
+  rdt_receiver_free(req);
+  rdt_receiver_free(data);
+  if (sig) {
+    rdt_sender_free(sig);
+  }
+  unmap_file(&old);
+  if (old_fd != -1) {
+    close(old_fd);
+  }
+  free(request.data);
+  free(signature.data);
+  free(delta.data);
+  return status;
+}
@@ -0,0 +1,83 @@
+/*
+ * Reliable Data Transfer library (librdt)
+ * Delta synchronisation
+ *
+ * rsync-style transfer of a file the receiver already has an older copy of.
+ * Three librdt sessions share the socket pair, told apart by stream id:
+ *
+ *   1. sender -> receiver  request: block size to use.
+ *   2. receiver -> sender  signatures: weak rolling checksum and strong hash
+ *                          of every full block of the receiver's copy.
+ *   3. sender -> receiver  delta: block references and literal data.
+ *
+ * The receiver rebuilds the file next to the old copy and renames it over.
+ * */
+
+#ifndef RDT_DELTA_H
+#define RDT_DELTA_H
+
+#include "rdt.h"
+
+#define RDT_DELTA_REQUEST_STREAM 1
+#define RDT_DELTA_SIGNATURE_STREAM 2
+#define RDT_DELTA_DATA_STREAM 3
+
+#define RDT_DELTA_MIN_BLOCK 700
+#define RDT_DELTA_MAX_BLOCK (1 << 17)
+
+// Growable in-memory payload, usable as rdt_read_fn/rdt_write_fn context.
+typedef struct rdt_buffer_t {
+  uint8_t *data;
+  size_t len, cap;
+} rdt_buffer_t;
+
+size_t rdt_buffer_read(void *ctx, uint64_t offset, void *buf, size_t len);
+void rdt_buffer_write(void *ctx, uint64_t offset, const void *buf, size_t len);
+
+typedef struct rdt_delta_stats_t {
+  uint64_t file_bytes;      // Size of the new file.
+  uint64_t matched_bytes;   // Bytes sent as block references.
+  uint64_t literal_bytes;   // Bytes sent as literal data.
+  uint64_t signature_bytes; // Size of the signature stream.
+  uint64_t delta_bytes;     // Size of the delta stream.
+} rdt_delta_stats_t;
+
+// rsync rolling checksum of a block: a = sum(x[i]), b = sum((len - i) x[i]),
+// both mod 2^16, packed as a | b << 16.
+uint32_t rdt_weak_checksum(const uint8_t *buf, size_t len);
+// 64 bit MurmurHash64A of a block.
+uint64_t rdt_strong_hash(const uint8_t *buf, size_t len);
+
+// Block sizes a request may ask for: 1 to RDT_DELTA_MAX_BLOCK bytes.
+bool rdt_delta_valid_block_size(uint64_t block_size);
+
+// Block size for a file of `len` bytes: sqrt(len), at least
+// RDT_DELTA_MIN_BLOCK.
+uint32_t rdt_delta_block_size(uint64_t len);
+
+// Append the signatures of `old` to `out`.
+void rdt_delta_signature(const uint8_t *old, uint64_t old_len,
+                         uint32_t block_size, rdt_buffer_t *out);
+// Append the delta turning the signed file into `data` to `out`.
+// Returns false if `sig` is malformed.
+bool rdt_delta_encode(const uint8_t *sig, size_t sig_len, const uint8_t *data,
+                      uint64_t len, rdt_buffer_t *out,
+                      rdt_delta_stats_t *stats);
+// Write the file described by `delta` to `out_fd`, copying matched blocks from
+// `old`. Returns false if `delta` is malformed.
+bool rdt_delta_apply(const uint8_t *delta, size_t delta_len,
+                     const uint8_t *old, uint64_t old_len, uint32_t block_size,
+                     int out_fd);
+
+// Blocking drivers running the three sessions over `sockfd`.
+// `config` supplies window size and verbosity; streams are set internally.
+rdt_status_t rdt_delta_send_file(int sockfd, const struct sockaddr_in *peer,
+                                 const rdt_config_t *config, int fd,
+                                 uint32_t block_size, rdt_delta_stats_t *stats,
+                                 const char **error);
+rdt_status_t rdt_delta_receive_file(int sockfd, const rdt_config_t *config,
+                                    const char *file_name,
+                                    rdt_delta_stats_t *stats,
+                                    const char **error);
+
+#endif
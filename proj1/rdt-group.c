@@ -0,0 +1,694 @@
+/*
+ * Reliable Data Transfer library (librdt)
+ * One-to-many distribution, see rdt-group.h.
+ * */
+
+#include "rdt-group.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PACING 1        // ms between bursts of window_size segments.
+#define LINGER 2000     // ms a complete receiver waits for the sender to close.
+#define REPORT_GRACE 1  // ms left for the rest of a NAK burst to arrive.
+#define IDLE ((MAX_RETRIES + 1) * TIMEOUT) // ms of sender silence to give up.
+#define FIN_COPIES 3
+
+static uint64_t now_ms(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+static uint32_t wire_seq(uint32_t seq) {
+  return htonl((uint32_t)RDT_GROUP_STREAM << 24 | seq);
+}
+
+static bool test_bit(const uint64_t *bits, uint32_t i) {
+  return bits[i / 64] >> (i % 64) & 1;
+}
+
+static void set_bit(uint64_t *bits, uint32_t i) {
+  bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void clear_bit(uint64_t *bits, uint32_t i) {
+  bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/******************************************************************************\
+* Sender                                                                       *
+\******************************************************************************/
+
+typedef struct {
+  struct sockaddr_in addr;
+  bool done, cut;
+  bool responded;   // Answered the current heartbeat.
+  bool reported;    // Answered any heartbeat before.
+  uint32_t base;    // Lowest missing segment reported this round.
+  uint32_t missing; // Missing segments reported this round.
+  uint32_t last_base, last_missing;
+  int stalled;      // Rounds without progress.
+} member_t;
+
+struct rdt_group_sender {
+  int sockfd;
+  struct sockaddr_in *dests;
+  int n_dests;
+  int receivers;
+  int straggler_rounds;
+  rdt_config_t config;
+  rdt_read_fn read;
+  void *ctx;
+
+  uint64_t length;
+  uint32_t total_segments;
+  size_t words;
+
+  uint64_t *pending; // Segments to send this round.
+  uint64_t *missing; // Segments NAKed for the next round.
+  uint32_t cursor;   // Next candidate in pending.
+  bool first_round;
+  bool waiting;      // Heartbeat sent, collecting NAKs.
+  uint64_t deadline; // Next burst, or end of the NAK collection.
+  int unheard;       // Rounds in which some receiver was never heard of.
+
+  member_t *members;
+  int n_members, cap_members;
+
+  rdt_group_stats_t stats;
+  rdt_status_t status;
+  const char *error;
+
+  data_pkt_t pkt;
+};
+
+static rdt_status_t sender_fail(rdt_group_sender_t *s, const char *error) {
+  s->status = RDT_FAILED;
+  s->error = error;
+  return s->status;
+}
+
+static bool multicast(rdt_group_sender_t *s, const void *pkt, size_t len) {
+  for (int i = 0; i < s->n_dests; i++) {
+    ssize_t sent_len = sendto(s->sockfd, pkt, len, 0,
+                              (struct sockaddr *)&s->dests[i],
+                              sizeof(s->dests[i]));
+    if (sent_len != (ssize_t)len) {
+      sender_fail(s, sent_len < 0 ? strerror(errno) : "Truncated packet.");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read the segment once, whatever the number of destinations.
+static bool send_segment(rdt_group_sender_t *s, uint32_t seq, bool resend) {
+  uint64_t offset = (uint64_t)seq * SEGMENT_SIZE;
+  size_t data_len = 0;
+  if (offset < s->length) {
+    size_t want = s->length - offset < SEGMENT_SIZE ? s->length - offset
+                                                    : SEGMENT_SIZE;
+    data_len = s->read(s->ctx, offset, s->pkt.data, want);
+  }
+
+  s->pkt.seq_num = wire_seq(seq);
+  if (s->config.verbose) {
+    printf("%s segment %" PRIu32 ".\n", resend ? "Resending" : "Sending", seq);
+  }
+  if (resend) {
+    s->stats.retransmissions++;
+  } else {
+    s->stats.segments++;
+  }
+  return multicast(s, &s->pkt, offsetof(data_pkt_t, data) + data_len);
+}
+
+rdt_group_sender_t *rdt_group_sender_new(int sockfd,
+                                         const struct sockaddr_in *dests,
+                                         int n_dests, int receivers,
+                                         int straggler_rounds,
+                                         const rdt_config_t *config,
+                                         uint64_t length, rdt_read_fn read,
+                                         void *ctx) {
+  if (config->window_size < 1 || config->window_size > MAX_WINDOW_SIZE ||
+      config->io || n_dests < 1 || receivers < 1 || straggler_rounds < 0 ||
+      length / SEGMENT_SIZE + 1 >= RDT_GROUP_FIN) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rdt_group_sender_t *s = calloc(1, sizeof(rdt_group_sender_t));
+  if (!s) {
+    return NULL;
+  }
+  s->total_segments = length / SEGMENT_SIZE + 1;
+  s->words = (s->total_segments + 63) / 64;
+  s->dests = malloc(n_dests * sizeof(*dests));
+  s->pending = calloc(s->words, sizeof(uint64_t));
+  s->missing = calloc(s->words, sizeof(uint64_t));
+  if (!s->dests || !s->pending || !s->missing) {
+    rdt_group_sender_free(s);
+    return NULL;
+  }
+  memcpy(s->dests, dests, n_dests * sizeof(*dests));
+  s->sockfd = sockfd;
+  s->n_dests = n_dests;
+  s->receivers = receivers;
+  s->straggler_rounds = straggler_rounds;
+  s->config = *config;
+  s->read = read;
+  s->ctx = ctx;
+  s->length = length;
+  s->status = RDT_RUNNING;
+
+  // First round: everything but the final segment, which is the heartbeat.
+  for (uint32_t seq = 0; seq + 1 < s->total_segments; seq++) {
+    set_bit(s->pending, seq);
+  }
+  s->first_round = true;
+  return s;
+}
+
+void rdt_group_sender_free(rdt_group_sender_t *s) {
+  free(s->dests);
+  free(s->pending);
+  free(s->missing);
+  free(s->members);
+  free(s);
+}
+
+static void send_burst(rdt_group_sender_t *s) {
+  int sent = 0;
+  while (sent < s->config.window_size && s->cursor < s->total_segments) {
+    uint64_t word = s->pending[s->cursor / 64] >> (s->cursor % 64);
+    if (!word) { // Skip to the next word.
+      s->cursor = (s->cursor / 64 + 1) * 64;
+      continue;
+    }
+    s->cursor += __builtin_ctzll(word);
+    if (s->cursor >= s->total_segments) {
+      break;
+    }
+    if (!send_segment(s, s->cursor, !s->first_round)) {
+      return;
+    }
+    s->cursor++;
+    sent++;
+  }
+
+  uint64_t now = now_ms();
+  if (s->cursor < s->total_segments) {
+    s->deadline = now + PACING;
+    return;
+  }
+
+  // Round over: ask every receiver what it still lacks.
+  if (!send_segment(s, s->total_segments - 1, !s->first_round)) {
+    return;
+  }
+  for (int i = 0; i < s->n_members; i++) {
+    s->members[i].responded = false;
+  }
+  s->waiting = true;
+  s->deadline = now + TIMEOUT;
+}
+
+rdt_status_t rdt_group_sender_start(rdt_group_sender_t *s) {
+  send_burst(s);
+  return s->status;
+}
+
+static void close_session(rdt_group_sender_t *s) {
+  s->pkt.seq_num = wire_seq(RDT_GROUP_FIN);
+  for (int i = 0; i < FIN_COPIES; i++) {
+    if (!multicast(s, &s->pkt, offsetof(data_pkt_t, data))) {
+      return;
+    }
+  }
+  s->status = RDT_DONE;
+  s->deadline = 0;
+}
+
+static void end_round(rdt_group_sender_t *s) {
+  int limit = s->straggler_rounds ? s->straggler_rounds : MAX_RETRIES + 1;
+  int active = 0;
+
+  for (int i = 0; i < s->n_members; i++) {
+    member_t *m = &s->members[i];
+    if (m->done || m->cut) {
+      continue;
+    }
+    bool progress = m->responded && (!m->reported || m->base > m->last_base ||
+                                     m->missing < m->last_missing);
+    if (m->responded) {
+      m->reported = true;
+      m->last_base = m->base;
+      m->last_missing = m->missing;
+    }
+    m->stalled = progress ? 0 : m->stalled + 1;
+    if (m->stalled < limit) {
+      active++;
+    } else if (s->straggler_rounds) {
+      if (s->config.verbose) {
+        printf("Cutting loose %s:%d.\n", inet_ntoa(m->addr.sin_addr),
+               ntohs(m->addr.sin_port));
+      }
+      m->cut = true;
+      s->stats.cut++;
+    } else {
+      sender_fail(s, "Receiver stopped making progress.");
+      return;
+    }
+  }
+
+  // Receivers that never answered at all.
+  if (s->n_members < s->receivers) {
+    if (++s->unheard < limit) {
+      active++;
+    } else if (s->straggler_rounds) {
+      s->stats.cut += s->receivers - s->n_members;
+      s->receivers = s->n_members;
+    } else {
+      sender_fail(s, "Could not reach every receiver.");
+      return;
+    }
+  }
+
+  if (!active) {
+    if (s->stats.receivers == 0) {
+      sender_fail(s, "No receiver got the file.");
+    } else {
+      close_session(s);
+    }
+    return;
+  }
+
+  // Next round resends what was NAKed, the heartbeat goes out regardless.
+  uint64_t *swap = s->pending;
+  s->pending = s->missing;
+  s->missing = swap;
+  memset(s->missing, 0, s->words * sizeof(uint64_t));
+  clear_bit(s->pending, s->total_segments - 1);
+  s->cursor = 0;
+  s->first_round = false;
+  s->waiting = false;
+  s->stats.rounds++;
+  send_burst(s);
+}
+
+static member_t *find_member(rdt_group_sender_t *s,
+                             const struct sockaddr_in *from) {
+  for (int i = 0; i < s->n_members; i++) {
+    if (same_addr(&s->members[i].addr, from)) {
+      return &s->members[i];
+    }
+  }
+  if (s->n_members == s->cap_members) {
+    int cap = s->cap_members ? 2 * s->cap_members : 8;
+    member_t *members = realloc(s->members, cap * sizeof(member_t));
+    if (!members) {
+      return NULL;
+    }
+    s->members = members;
+    s->cap_members = cap;
+  }
+  member_t *m = &s->members[s->n_members++];
+  *m = (member_t){.addr = *from};
+  return m;
+}
+
+static void handle_nak(rdt_group_sender_t *s, member_t *m, const ack_pkt_t *nak) {
+  uint32_t base = ntohl(nak->seq_num) & RDT_SEQ_MASK;
+  uint32_t bits = ntohl(nak->selective_acks);
+
+  if (s->config.verbose) {
+    printf("Received NAK %" PRIu32 " / %08" PRIu32 ".\n", base, bits);
+  }
+  s->stats.naks++;
+
+  if (base == s->total_segments && bits == 0) {
+    if (!m->done) {
+      m->done = true;
+      s->stats.receivers++;
+    }
+    return;
+  }
+  if (base >= s->total_segments) {
+    return;
+  }
+
+  // The first packet of a report starts a fresh count.
+  if (!m->responded) {
+    m->responded = true;
+    m->base = base;
+    m->missing = 0;
+  }
+  if (base < m->base) {
+    m->base = base;
+  }
+  m->missing += 1 + __builtin_popcount(bits);
+
+  set_bit(s->missing, base);
+  for (uint32_t i = 0; bits; i++, bits >>= 1) {
+    if ((bits & 1) && base + 1 + i < s->total_segments) {
+      set_bit(s->missing, base + 1 + i);
+    }
+  }
+}
+
+rdt_status_t rdt_group_sender_on_packet(rdt_group_sender_t *s, const void *pkt,
+                                        size_t len,
+                                        const struct sockaddr_in *from) {
+  if (s->status != RDT_RUNNING || len != sizeof(ack_pkt_t) ||
+      rdt_packet_stream(pkt) != RDT_GROUP_STREAM) {
+    return s->status;
+  }
+
+  member_t *m = find_member(s, from);
+  if (!m) {
+    return sender_fail(s, strerror(errno));
+  }
+  if (m->cut) {
+    return s->status;
+  }
+  handle_nak(s, m, pkt);
+
+  // Once everyone answered, wait only for the tail of their reports.
+  if (s->waiting && s->n_members >= s->receivers) {
+    for (int i = 0; i < s->n_members; i++) {
+      member_t *o = &s->members[i];
+      if (!o->done && !o->cut && !o->responded) {
+        return s->status;
+      }
+    }
+    uint64_t grace = now_ms() + REPORT_GRACE;
+    if (grace < s->deadline) {
+      s->deadline = grace;
+    }
+  }
+  return s->status;
+}
+
+rdt_status_t rdt_group_sender_on_readable(rdt_group_sender_t *s) {
+  if (s->status != RDT_RUNNING) {
+    return s->status;
+  }
+
+  // One datagram per readiness, as in rdt.c.
+  ack_pkt_t nak;
+  struct sockaddr_in src_addr;
+  ssize_t len =
+      recvfrom(s->sockfd, &nak, sizeof(nak), MSG_DONTWAIT,
+               (struct sockaddr *)&src_addr, &(socklen_t){sizeof(src_addr)});
+  if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      sender_fail(s, strerror(errno));
+    }
+    return s->status;
+  }
+
+  return rdt_group_sender_on_packet(s, &nak, len, &src_addr);
+}
+
+rdt_status_t rdt_group_sender_on_timer(rdt_group_sender_t *s) {
+  if (s->status != RDT_RUNNING || now_ms() < s->deadline) {
+    return s->status;
+  }
+  if (s->waiting) {
+    end_round(s);
+  } else {
+    send_burst(s);
+  }
+  return s->status;
+}
+
+int rdt_group_sender_timeout(const rdt_group_sender_t *s) {
+  if (s->status != RDT_RUNNING) {
+    return -1;
+  }
+  uint64_t now = now_ms();
+  return s->deadline > now ? (int)(s->deadline - now) : 0;
+}
+
+rdt_status_t rdt_group_sender_status(const rdt_group_sender_t *s) {
+  return s->status;
+}
+
+const char *rdt_group_sender_error(const rdt_group_sender_t *s) {
+  return s->error;
+}
+
+const rdt_group_stats_t *rdt_group_sender_stats(const rdt_group_sender_t *s) {
+  return &s->stats;
+}
+
+/******************************************************************************\
+* Receiver                                                                     *
+\******************************************************************************/
+
+struct rdt_group_receiver {
+  int sockfd;
+  int nak_sockfd; // Own port, so receivers sharing a group port stay apart.
+  struct sockaddr_in peer;
+  bool has_peer;
+  rdt_config_t config;
+  rdt_write_fn write;
+  void *ctx;
+
+  uint64_t *received; // Bit per segment, grown on demand.
+  size_t words;
+  uint32_t count;     // Distinct segments received.
+  bool has_last;
+  uint32_t total_segments;
+  uint64_t deadline;  // End of the linger once complete, 0 before.
+  uint64_t idle;      // Sender presumed gone, 0 before its first packet.
+
+  rdt_status_t status;
+  const char *error;
+
+  data_pkt_t pkt;
+};
+
+rdt_group_receiver_t *rdt_group_receiver_new(int sockfd,
+                                             const rdt_config_t *config,
+                                             rdt_write_fn write, void *ctx) {
+  if (config->io) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rdt_group_receiver_t *r = calloc(1, sizeof(rdt_group_receiver_t));
+  if (!r) {
+    return NULL;
+  }
+  r->nak_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (r->nak_sockfd == -1) {
+    free(r);
+    return NULL;
+  }
+  r->sockfd = sockfd;
+  r->config = *config;
+  r->write = write;
+  r->ctx = ctx;
+  r->status = RDT_RUNNING;
+  return r;
+}
+
+void rdt_group_receiver_free(rdt_group_receiver_t *r) {
+  close(r->nak_sockfd);
+  free(r->received);
+  free(r);
+}
+
+static rdt_status_t receiver_fail(rdt_group_receiver_t *r, const char *error) {
+  r->status = RDT_FAILED;
+  r->error = error;
+  return r->status;
+}
+
+static bool send_nak(rdt_group_receiver_t *r, uint32_t base, uint32_t bits) {
+  ack_pkt_t nak = {
+      .seq_num = wire_seq(base),
+      .selective_acks = htonl(bits),
+  };
+  ssize_t sent_len = sendto(r->nak_sockfd, &nak, sizeof(nak), 0,
+                            (struct sockaddr *)&r->peer, sizeof(r->peer));
+  if (sent_len != sizeof(nak)) {
+    receiver_fail(r, sent_len < 0 ? strerror(errno) : "Truncated packet.");
+    return false;
+  }
+  if (r->config.verbose) {
+    printf("Sending NAK %" PRIu32 " / %08" PRIu32 ".\n", base, bits);
+  }
+  return true;
+}
+
+static void send_report(rdt_group_receiver_t *r) {
+  if (r->count == r->total_segments) {
+    send_nak(r, r->total_segments, 0);
+    return;
+  }
+
+  uint32_t seq = 0;
+  for (int naks = 0; naks < RDT_GROUP_MAX_NAKS; naks++) {
+    while (seq < r->total_segments && test_bit(r->received, seq)) {
+      seq++;
+    }
+    if (seq >= r->total_segments) {
+      return;
+    }
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < 32 && seq + 1 + i < r->total_segments; i++) {
+      if (!test_bit(r->received, seq + 1 + i)) {
+        bits |= 1u << i;
+      }
+    }
+    if (!send_nak(r, seq, bits)) {
+      return;
+    }
+    seq += 33;
+  }
+}
+
+static bool grow(rdt_group_receiver_t *r, uint32_t seq) {
+  size_t words = seq / 64 + 1;
+  if (words <= r->words) {
+    return true;
+  }
+  if (words < 2 * r->words) {
+    words = 2 * r->words;
+  }
+  uint64_t *received = realloc(r->received, words * sizeof(uint64_t));
+  if (!received) {
+    return false;
+  }
+  memset(received + r->words, 0, (words - r->words) * sizeof(uint64_t));
+  r->received = received;
+  r->words = words;
+  return true;
+}
+
+static void handle_segment(rdt_group_receiver_t *r, const data_pkt_t *pkt,
+                           size_t len) {
+  uint32_t seq = ntohl(pkt->seq_num) & RDT_SEQ_MASK;
+  size_t data_len = len - offsetof(data_pkt_t, data);
+
+  if (seq == RDT_GROUP_FIN) {
+    if (r->has_last && r->count == r->total_segments) {
+      r->status = RDT_DONE;
+    } else {
+      receiver_fail(r, "Cut loose by the sender.");
+    }
+    return;
+  }
+  if (r->config.verbose) {
+    printf("Received segment %" PRIu32 ".\n", seq);
+  }
+  if (r->has_last && seq >= r->total_segments) {
+    return;
+  }
+  if (!grow(r, seq)) {
+    receiver_fail(r, strerror(errno));
+    return;
+  }
+
+  if (!test_bit(r->received, seq)) {
+    r->write(r->ctx, (uint64_t)seq * SEGMENT_SIZE, pkt->data, data_len);
+    set_bit(r->received, seq);
+    r->count++;
+  }
+  if (data_len < SEGMENT_SIZE) {
+    r->has_last = true;
+    r->total_segments = seq + 1;
+  }
+
+  // The final segment doubles as the sender's heartbeat.
+  if (r->has_last && seq == r->total_segments - 1) {
+    if (r->count == r->total_segments) {
+      r->deadline = now_ms() + LINGER;
+    }
+    send_report(r);
+  }
+}
+
+rdt_status_t rdt_group_receiver_on_packet(rdt_group_receiver_t *r,
+                                          const void *pkt, size_t len,
+                                          const struct sockaddr_in *from) {
+  if (r->status != RDT_RUNNING || len < offsetof(data_pkt_t, data) ||
+      len > sizeof(data_pkt_t) || rdt_packet_stream(pkt) != RDT_GROUP_STREAM) {
+    return r->status;
+  }
+  if (!r->has_peer) {
+    r->peer = *from;
+    r->has_peer = true;
+  } else if (!same_addr(from, &r->peer)) {
+    return r->status; // Another sender on the same group.
+  }
+  // Heartbeats come at least every TIMEOUT until the sender closes.
+  r->idle = now_ms() + IDLE;
+  handle_segment(r, pkt, len);
+  return r->status;
+}
+
+rdt_status_t rdt_group_receiver_on_readable(rdt_group_receiver_t *r) {
+  if (r->status != RDT_RUNNING) {
+    return r->status;
+  }
+
+  // One datagram per readiness, as in rdt.c.
+  struct sockaddr_in src_addr;
+  ssize_t len =
+      recvfrom(r->sockfd, &r->pkt, sizeof(r->pkt), MSG_DONTWAIT,
+               (struct sockaddr *)&src_addr, &(socklen_t){sizeof(src_addr)});
+  if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      receiver_fail(r, strerror(errno));
+    }
+    return r->status;
+  }
+
+  return rdt_group_receiver_on_packet(r, &r->pkt, len, &src_addr);
+}
+
+rdt_status_t rdt_group_receiver_on_timer(rdt_group_receiver_t *r) {
+  if (r->status != RDT_RUNNING) {
+    return r->status;
+  }
+  uint64_t now = now_ms();
+  // Complete, and the sender stopped asking: its close was lost.
+  if (r->deadline && now >= r->deadline) {
+    r->status = RDT_DONE;
+  } else if (r->idle && now >= r->idle) {
+    receiver_fail(r, "Sender stopped responding.");
+  }
+  return r->status;
+}
+
+int rdt_group_receiver_timeout(const rdt_group_receiver_t *r) {
+  uint64_t deadline = r->deadline && r->deadline < r->idle ? r->deadline
+                                                           : r->idle;
+  if (r->status != RDT_RUNNING || deadline == 0) {
+    return -1;
+  }
+  uint64_t now = now_ms();
+  return deadline > now ? (int)(deadline - now) : 0;
+}
+
+rdt_status_t rdt_group_receiver_status(const rdt_group_receiver_t *r) {
+  return r->status;
+}
+
+const char *rdt_group_receiver_error(const rdt_group_receiver_t *r) {
+  return r->error;
+}
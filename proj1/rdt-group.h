@@ -0,0 +1,90 @@
+/*
+ * Reliable Data Transfer library (librdt)
+ * One-to-many distribution
+ *
+ * The sender transmits every segment once to the whole group, either a
+ * multicast address or a list of unicast destinations, then follows the
+ * final segment with nothing but heartbeats. Receivers stay silent until a
+ * heartbeat (the final segment) arrives and then report what they still
+ * lack as NAKs: an ack_pkt_t whose seq_num is the first missing segment and
+ * whose bit i marks segment seq_num + 1 + i as missing too. A receiver with
+ * the whole file answers seq_num = segment count, no bits set.
+ *
+ * Each round the sender merges the NAKs of all receivers and retransmits
+ * every missing segment once, whichever receivers asked for it. A receiver
+ * that makes no progress for several rounds either fails the transfer or,
+ * with a straggler limit, is cut loose so the others can finish.
+ *
+ * Group sessions always use the socket and the monotonic clock; an rdt_io_t
+ * in the config is rejected.
+ * */
+
+#ifndef RDT_GROUP_H
+#define RDT_GROUP_H
+
+#include "rdt.h"
+
+#define RDT_GROUP_STREAM 4
+#define RDT_GROUP_FIN RDT_SEQ_MASK // Sequence number closing the session.
+#define RDT_GROUP_MAX_NAKS 32      // NAK packets per report.
+
+typedef struct rdt_group_stats_t {
+  uint64_t segments;        // Segments sent in the first round.
+  uint64_t retransmissions; // Segments sent in later rounds.
+  uint64_t naks;            // NAK packets received.
+  int rounds;               // Recovery rounds after the first one.
+  int receivers;            // Receivers that got the whole file.
+  int cut;                  // Receivers cut loose.
+} rdt_group_stats_t;
+
+typedef struct rdt_group_sender rdt_group_sender_t;
+typedef struct rdt_group_receiver rdt_group_receiver_t;
+
+// Sender: same calling convention as rdt_sender_t. `dests` lists the group
+// addresses, `receivers` how many receivers must answer: the number of
+// destinations for unicast fan-out, the expected group size for multicast.
+// A receiver without progress for `straggler_rounds` rounds is cut loose;
+// 0 fails the transfer after MAX_RETRIES such rounds instead.
+rdt_group_sender_t *rdt_group_sender_new(int sockfd,
+                                         const struct sockaddr_in *dests,
+                                         int n_dests, int receivers,
+                                         int straggler_rounds,
+                                         const rdt_config_t *config,
+                                         uint64_t length, rdt_read_fn read,
+                                         void *ctx);
+void rdt_group_sender_free(rdt_group_sender_t *s);
+
+rdt_status_t rdt_group_sender_start(rdt_group_sender_t *s);
+rdt_status_t rdt_group_sender_on_readable(rdt_group_sender_t *s);
+rdt_status_t rdt_group_sender_on_packet(rdt_group_sender_t *s, const void *pkt,
+                                        size_t len,
+                                        const struct sockaddr_in *from);
+rdt_status_t rdt_group_sender_on_timer(rdt_group_sender_t *s);
+int rdt_group_sender_timeout(const rdt_group_sender_t *s);
+
+rdt_status_t rdt_group_sender_status(const rdt_group_sender_t *s);
+const char *rdt_group_sender_error(const rdt_group_sender_t *s);
+const rdt_group_stats_t *rdt_group_sender_stats(const rdt_group_sender_t *s);
+
+// Receiver: segments may come from any group, NAKs go back to the address
+// of the first segment, from a socket of the receiver's own as several
+// receivers on one host share the group port. Once the file is complete the
+// receiver keeps answering heartbeats until the sender closes the session or
+// goes quiet. Short of the whole file, a receiver that hears nothing from the
+// sender for MAX_RETRIES + 1 timeouts fails.
+rdt_group_receiver_t *rdt_group_receiver_new(int sockfd,
+                                             const rdt_config_t *config,
+                                             rdt_write_fn write, void *ctx);
+void rdt_group_receiver_free(rdt_group_receiver_t *r);
+
+rdt_status_t rdt_group_receiver_on_readable(rdt_group_receiver_t *r);
+rdt_status_t rdt_group_receiver_on_packet(rdt_group_receiver_t *r,
+                                          const void *pkt, size_t len,
+                                          const struct sockaddr_in *from);
+rdt_status_t rdt_group_receiver_on_timer(rdt_group_receiver_t *r);
+int rdt_group_receiver_timeout(const rdt_group_receiver_t *r);
+
+rdt_status_t rdt_group_receiver_status(const rdt_group_receiver_t *r);
+const char *rdt_group_receiver_error(const rdt_group_receiver_t *r);
+
+#endif
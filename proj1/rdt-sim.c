@@ -0,0 +1,404 @@
+/*
+ * Reliable Data Transfer
+ * Deterministic virtual-time simulator
+ *
+ * Runs the librdt sender and receiver state machines against a simulated
+ * channel with configurable loss, duplication, reordering and delay. Time
+ * only advances to the next packet delivery or retransmission deadline, so
+ * a lossy scenario that takes seconds over real sockets completes in
+ * microseconds, and the same seed always produces the same run.
+ * */
+
+#include "rdt.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SENDER 0
+#define RECEIVER 1
+
+typedef struct {
+  double loss;      // Probability of dropping a packet.
+  double duplicate; // Probability of delivering a packet twice.
+  double reorder;   // Probability of holding a packet back by `reorder_delay`.
+  uint64_t delay;   // One way delay in ms.
+  uint64_t jitter;  // Extra uniform delay in [0, jitter] ms.
+  uint64_t reorder_delay;
+} channel_config_t;
+
+typedef struct {
+  uint64_t time;
+  uint64_t order; // Ties broken by transmission order.
+  int to;
+  uint16_t len;
+  char data[sizeof(data_pkt_t)];
+} in_flight_t;
+
+typedef struct {
+  // Min-heap of packets in flight, keyed by (time, order).
+  in_flight_t *heap;
+  size_t heap_len, heap_cap;
+  uint64_t order;
+
+  uint64_t now;
+  uint64_t rng;
+  const channel_config_t *channel;
+
+  long sent[2];    // Packets transmitted by each end.
+  long dropped[2]; // Packets lost on the way from each end.
+} sim_t;
+
+typedef struct {
+  sim_t *sim;
+  int from;
+} endpoint_t;
+
+typedef struct {
+  int status;        // Receiver got the whole file intact.
+  int sender_status; // Sender saw every segment acknowledged.
+  uint64_t time;     // Virtual completion time in ms.
+  long data_pkts, ack_pkts, drops;
+} run_result_t;
+
+// xorshift64*: small, fast and reproducible across platforms.
+static uint64_t rng_next(sim_t *sim) {
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  return sim->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_uniform(sim_t *sim) {
+  return (rng_next(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool heap_less(const in_flight_t *a, const in_flight_t *b) {
+  return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void heap_push(sim_t *sim, const in_flight_t *pkt) {
+  if (sim->heap_len == sim->heap_cap) {
+    sim->heap_cap = sim->heap_cap ? sim->heap_cap * 2 : 64;
+    sim->heap = realloc(sim->heap, sim->heap_cap * sizeof(in_flight_t));
+    if (!sim->heap) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  size_t i = sim->heap_len++;
+  while (i > 0 && heap_less(pkt, &sim->heap[(i - 1) / 2])) {
+    sim->heap[i] = sim->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  sim->heap[i] = *pkt;
+}
+
+static void heap_pop(sim_t *sim, in_flight_t *out) {
+  *out = sim->heap[0];
+  in_flight_t *last = &sim->heap[--sim->heap_len];
+  size_t i = 0;
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= sim->heap_len) {
+      break;
+    }
+    if (c + 1 < sim->heap_len && heap_less(&sim->heap[c + 1], &sim->heap[c])) {
+      c++;
+    }
+    if (!heap_less(&sim->heap[c], last)) {
+      break;
+    }
+    sim->heap[i] = sim->heap[c];
+    i = c;
+  }
+  sim->heap[i] = *last;
+}
+
+static void channel_enqueue(sim_t *sim, int to, const void *pkt, size_t len) {
+  const channel_config_t *ch = sim->channel;
+  in_flight_t p = {.to = to, .len = len};
+  memcpy(p.data, pkt, len);
+
+  int copies = rng_uniform(sim) < ch->duplicate ? 2 : 1;
+  for (int c = 0; c < copies; c++) {
+    p.time = sim->now + ch->delay;
+    if (ch->jitter) {
+      p.time += rng_next(sim) % (ch->jitter + 1);
+    }
+    if (rng_uniform(sim) < ch->reorder) {
+      p.time += ch->reorder_delay;
+    }
+    p.order = sim->order++;
+    heap_push(sim, &p);
+  }
+}
+
+static ssize_t sim_send(void *ctx, const void *pkt, size_t len) {
+  endpoint_t *ep = ctx;
+  sim_t *sim = ep->sim;
+  sim->sent[ep->from]++;
+  if (rng_uniform(sim) < sim->channel->loss) {
+    sim->dropped[ep->from]++;
+  } else {
+    channel_enqueue(sim, !ep->from, pkt, len);
+  }
+  return len;
+}
+
+static uint64_t sim_now(void *ctx) { return ((endpoint_t *)ctx)->sim->now; }
+
+typedef struct {
+  const char *data;
+} source_t;
+
+static size_t read_buffer(void *ctx, uint64_t offset, void *buf, size_t len) {
+  memcpy(buf, ((source_t *)ctx)->data + offset, len);
+  return len;
+}
+
+typedef struct {
+  char *data;
+  uint64_t capacity;
+  uint64_t written; // Bytes in order, up to the first gap or the end.
+} sink_t;
+
+static void write_buffer(void *ctx, uint64_t offset, const void *buf,
+                         size_t len) {
+  sink_t *sink = ctx;
+  if (offset + len <= sink->capacity) {
+    memcpy(sink->data + offset, buf, len);
+    if (offset + len > sink->written) {
+      sink->written = offset + len;
+    }
+  }
+}
+
+static run_result_t run_scenario(const channel_config_t *channel,
+                                 int window_size, bool probe,
+                                 const char *payload,
+                                 uint64_t length, uint64_t seed, char *scratch) {
+  sim_t sim = {.channel = channel, .rng = seed * 0x9E3779B97F4A7C15ULL | 1};
+  endpoint_t ends[2] = {{&sim, SENDER}, {&sim, RECEIVER}};
+  rdt_io_t io[2] = {{sim_send, sim_now, &ends[SENDER]},
+                    {sim_send, sim_now, &ends[RECEIVER]}};
+
+  source_t source = {payload};
+  sink_t sink = {scratch, length, 0};
+
+  rdt_config_t config = {.window_size = window_size,
+                         .io = &io[SENDER],
+                         .tail_loss_probe = probe};
+  rdt_sender_t *sender =
+      rdt_sender_new(-1, NULL, &config, length, read_buffer, &source);
+  config.io = &io[RECEIVER];
+  rdt_receiver_t *receiver =
+      rdt_receiver_new(-1, &config, write_buffer, &sink);
+  if (!sender || !receiver) {
+    perror("rdt_*_new");
+    exit(EXIT_FAILURE);
+  }
+
+  rdt_status_t s_status = rdt_sender_start(sender);
+  rdt_status_t r_status = RDT_RUNNING;
+
+  // Both ends behave like the binaries: once done they stop reading, unless
+  // the receiver lingers to answer probes.
+  while (s_status == RDT_RUNNING) {
+    int timeout = rdt_sender_timeout(sender);
+    uint64_t deadline = timeout < 0 ? UINT64_MAX : sim.now + timeout;
+
+    if (sim.heap_len > 0 && sim.heap[0].time <= deadline) {
+      in_flight_t pkt;
+      heap_pop(&sim, &pkt);
+      sim.now = pkt.time;
+      if (pkt.to == SENDER) {
+        s_status = rdt_sender_on_packet(sender, pkt.data, pkt.len, NULL);
+      } else if (r_status == RDT_RUNNING || probe) {
+        r_status = rdt_receiver_on_packet(receiver, pkt.data, pkt.len, NULL);
+      }
+    } else if (deadline != UINT64_MAX) {
+      sim.now = deadline;
+      s_status = rdt_sender_on_timer(sender);
+    } else {
+      break;
+    }
+  }
+
+  run_result_t result = {
+      .status = r_status == RDT_DONE && sink.written == length &&
+                !memcmp(payload, scratch, length),
+      .sender_status = s_status == RDT_DONE,
+      .time = sim.now,
+      .data_pkts = sim.sent[SENDER],
+      .ack_pkts = sim.sent[RECEIVER],
+      .drops = sim.dropped[SENDER] + sim.dropped[RECEIVER],
+  };
+
+  rdt_sender_free(sender);
+  rdt_receiver_free(receiver);
+  free(sim.heap);
+  return result;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void show_usage(const char *command) {
+  fprintf(stderr,
+          "Usage: %s [--size <bytes>] [--window <n>] [--loss <p>]"
+          " [--duplicate <p>] [--reorder <p>] [--reorder-delay <ms>]"
+          " [--delay <ms>] [--jitter <ms>] [--runs <n>] [--seed <n>]"
+          " [--tail-loss-probe] [--csv]\n"
+          "\n"
+          " --size <bytes>        - Payload size (default: 100000).\n"
+          " --window <n>          - Window size, 1 for stop-and-wait"
+          " (default: 1).\n"
+          " --loss <p>            - Per packet loss probability"
+          " (default: 0).\n"
+          " --duplicate <p>       - Per packet duplication probability"
+          " (default: 0).\n"
+          " --reorder <p>         - Probability of holding a packet back"
+          " (default: 0).\n"
+          " --reorder-delay <ms>  - How long reordered packets are held"
+          " (default: 2 * delay + 1).\n"
+          " --delay <ms>          - One way delay (default: 10).\n"
+          " --jitter <ms>         - Extra uniform delay (default: 0).\n"
+          " --runs <n>            - Number of scenarios, each with its own"
+          " seed (default: 1).\n"
+          " --seed <n>            - Seed of the first scenario"
+          " (default: 1).\n"
+          " --tail-loss-probe     - Probe after two RTTs without progress,"
+          " receiver lingers.\n"
+          " --csv                 - Print one CSV line per scenario.\n",
+          command);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  channel_config_t channel = {.delay = 10, .reorder_delay = UINT64_MAX};
+  uint64_t length = 100000;
+  int window_size = 1;
+  long runs = 1;
+  uint64_t seed = 1;
+  bool csv = false, probe = false;
+
+  static const struct option options[] = {
+      {"size", required_argument, NULL, 's'},
+      {"window", required_argument, NULL, 'w'},
+      {"loss", required_argument, NULL, 'l'},
+      {"duplicate", required_argument, NULL, 'd'},
+      {"reorder", required_argument, NULL, 'r'},
+      {"reorder-delay", required_argument, NULL, 'R'},
+      {"delay", required_argument, NULL, 't'},
+      {"jitter", required_argument, NULL, 'j'},
+      {"runs", required_argument, NULL, 'n'},
+      {"seed", required_argument, NULL, 'S'},
+      {"tail-loss-probe", no_argument, NULL, 'p'},
+      {"csv", no_argument, NULL, 'c'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 's': length = strtoull(optarg, NULL, 10); break;
+    case 'w': window_size = atoi(optarg); break;
+    case 'l': channel.loss = atof(optarg); break;
+    case 'd': channel.duplicate = atof(optarg); break;
+    case 'r': channel.reorder = atof(optarg); break;
+    case 'R': channel.reorder_delay = strtoull(optarg, NULL, 10); break;
+    case 't': channel.delay = strtoull(optarg, NULL, 10); break;
+    case 'j': channel.jitter = strtoull(optarg, NULL, 10); break;
+    case 'n': runs = atol(optarg); break;
+    case 'S': seed = strtoull(optarg, NULL, 10); break;
+    case 'p': probe = true; break;
+    case 'c': csv = true; break;
+    default: show_usage(argv[0]);
+    }
+  }
+  if (optind != argc || window_size < 1 || window_size > MAX_WINDOW_SIZE ||
+      runs < 1) {
+    show_usage(argv[0]);
+  }
+  if (channel.reorder_delay == UINT64_MAX) {
+    channel.reorder_delay = 2 * channel.delay + 1;
+  }
+
+  char *payload = malloc(length + 1);
+  char *scratch = malloc(length + 1);
+  uint64_t *times = malloc(runs * sizeof(uint64_t));
+  if (!payload || !scratch || !times) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  sim_t fill = {.rng = 0x5EED};
+  for (uint64_t i = 0; i < length; i++) {
+    payload[i] = rng_next(&fill);
+  }
+
+  if (csv) {
+    printf("seed,delivered,acknowledged,time_ms,data_packets,ack_packets,"
+           "drops\n");
+  }
+
+  struct timespec wall_start, wall_end;
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+  long delivered = 0, acknowledged = 0, data_pkts = 0, ack_pkts = 0;
+  long completed = 0;
+  for (long i = 0; i < runs; i++) {
+    run_result_t r = run_scenario(&channel, window_size, probe, payload,
+                                  length, seed + i, scratch);
+    delivered += r.status;
+    acknowledged += r.sender_status;
+    data_pkts += r.data_pkts;
+    ack_pkts += r.ack_pkts;
+    if (r.status && r.sender_status) {
+      times[completed++] = r.time;
+    }
+    if (csv) {
+      printf("%" PRIu64 ",%d,%d,%" PRIu64 ",%ld,%ld,%ld\n", seed + i,
+             r.status, r.sender_status, r.time, r.data_pkts, r.ack_pkts,
+             r.drops);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  double wall = (wall_end.tv_sec - wall_start.tv_sec) +
+                (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+  if (!csv) {
+    qsort(times, completed, sizeof(uint64_t), cmp_u64);
+    double mean = 0;
+    for (long i = 0; i < completed; i++) {
+      mean += times[i];
+    }
+    mean = completed ? mean / completed : 0;
+
+    printf("Simulated %ld transfers of %" PRIu64 " bytes, window %d.\n", runs,
+           length, window_size);
+    printf("Delivered intact: %ld, fully acknowledged: %ld.\n", delivered,
+           acknowledged);
+    printf("Data packets per transfer: %.1f, ACKs per transfer: %.1f.\n",
+           (double)data_pkts / runs, (double)ack_pkts / runs);
+    if (completed) {
+      printf("Completion time (virtual ms): mean %.1f, p50 %" PRIu64
+             ", p99 %" PRIu64 ", max %" PRIu64 ".\n",
+             mean, times[completed / 2], times[completed * 99 / 100],
+             times[completed - 1]);
+      printf("Mean goodput: %.1f KB/s.\n", mean > 0 ? length / mean : 0);
+    }
+    printf("Wall clock: %.3f s (%.0f scenarios/s).\n", wall, runs / wall);
+  }
+
+  free(payload);
+  free(scratch);
+  free(times);
+  return 0;
+}
@@ -0,0 +1,499 @@
+/*
+ * Reliable Data Transfer library (librdt)
+ *
+ * Sender and receiver state machines shared by file-sender and
+ * file-receiver. See rdt.h for the calling convention.
+ * */
+
+#define _GNU_SOURCE // sched_setaffinity()
+#include "rdt.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define MIN_PTO 1      // ms, floor of the tail loss probe timeout.
+#define INITIAL_PTO 10 // ms, probe timeout before the first RTT sample.
+
+static uint64_t now_ms(const rdt_io_t *io) {
+  if (io) {
+    return io->now(io->ctx);
+  }
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static ssize_t xmit(const rdt_io_t *io, int sockfd,
+                    const struct sockaddr_in *peer, const void *pkt,
+                    size_t len) {
+  if (io) {
+    return io->send(io->ctx, pkt, len);
+  }
+  return sendto(sockfd, pkt, len, 0, (struct sockaddr *)peer, sizeof(*peer));
+}
+
+static bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+// Stream 0 keeps the full 32 bit sequence space of the original format.
+static uint32_t seq_mask(uint8_t stream) {
+  return stream ? RDT_SEQ_MASK : UINT32_MAX;
+}
+
+// Whether a packet belongs to the session. Stream 0 has no stream id: the top
+// byte is part of its sequence number past 2^24 segments.
+static bool same_stream(uint8_t stream, const void *pkt) {
+  return stream == 0 || rdt_packet_stream(pkt) == stream;
+}
+
+static uint32_t wire_seq(uint8_t stream, uint32_t seq) {
+  return htonl((uint32_t)stream << 24 | seq);
+}
+
+/******************************************************************************\
+* Sender                                                                       *
+\******************************************************************************/
+
+struct rdt_sender {
+  int sockfd;
+  struct sockaddr_in peer;
+  rdt_config_t config;
+  rdt_read_fn read;
+  void *ctx;
+
+  uint32_t total_segments; // Last segment is always shorter than SEGMENT_SIZE.
+  uint64_t length;
+
+  uint32_t base;   // First unacknowledged segment.
+  uint32_t next;   // Next segment never sent.
+  uint64_t acked;  // Selective acks: bit i set if base + i was received.
+  int tries;       // Consecutive timeouts without progress.
+  uint64_t deadline; // Retransmission deadline, 0 if not armed.
+
+  // Send time of each segment in the window, 0 once retransmitted, as
+  // only first transmissions give unambiguous RTT samples (Karn).
+  uint64_t sent_at[MAX_WINDOW_SIZE];
+  int64_t srtt8;        // Smoothed RTT in 1/8 ms, -1 before the first sample.
+  uint64_t probe_deadline; // Tail loss probe deadline, 0 if not armed.
+
+  rdt_status_t status;
+  const char *error;
+
+  data_pkt_t pkt;
+};
+
+static rdt_status_t sender_fail(rdt_sender_t *s, const char *error) {
+  s->status = RDT_FAILED;
+  s->error = error;
+  return s->status;
+}
+
+static bool send_segment(rdt_sender_t *s, uint32_t seq, bool resend) {
+  uint64_t offset = (uint64_t)seq * SEGMENT_SIZE;
+  size_t data_len = 0;
+  if (offset < s->length) {
+    size_t want = s->length - offset < SEGMENT_SIZE ? s->length - offset
+                                                    : SEGMENT_SIZE;
+    data_len = s->read(s->ctx, offset, s->pkt.data, want);
+  }
+
+  s->sent_at[seq % MAX_WINDOW_SIZE] = resend ? 0 : now_ms(s->config.io);
+  s->pkt.seq_num = wire_seq(s->config.stream, seq);
+  ssize_t sent_len = xmit(s->config.io, s->sockfd, &s->peer, &s->pkt,
+                          offsetof(data_pkt_t, data) + data_len);
+  if (s->config.verbose) {
+    printf("%s segment %" PRIu32 ".\n", resend ? "Resending" : "Sending", seq);
+  }
+  if (sent_len != offsetof(data_pkt_t, data) + data_len) {
+    sender_fail(s, "Truncated packet.");
+    return false;
+  }
+  return true;
+}
+
+static void arm_probe(rdt_sender_t *s) {
+  if (!s->config.tail_loss_probe || s->base == s->next) {
+    s->probe_deadline = 0;
+    return;
+  }
+  uint64_t pto = s->srtt8 < 0 ? INITIAL_PTO : (uint64_t)s->srtt8 / 4;
+  s->probe_deadline = now_ms(s->config.io) + (pto < MIN_PTO ? MIN_PTO : pto);
+}
+
+static void fill_window(rdt_sender_t *s) {
+  while (s->status == RDT_RUNNING && s->next < s->total_segments &&
+         s->next < s->base + s->config.window_size) {
+    if (!send_segment(s, s->next, false)) {
+      return;
+    }
+    s->next++;
+  }
+  if (s->deadline == 0 && s->base < s->next) {
+    s->deadline = now_ms(s->config.io) + TIMEOUT;
+    arm_probe(s);
+  }
+}
+
+rdt_sender_t *rdt_sender_new(int sockfd, const struct sockaddr_in *peer,
+                             const rdt_config_t *config, uint64_t length,
+                             rdt_read_fn read, void *ctx) {
+  if (config->window_size < 1 || config->window_size > MAX_WINDOW_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rdt_sender_t *s = calloc(1, sizeof(rdt_sender_t));
+  if (!s) {
+    return NULL;
+  }
+  s->sockfd = sockfd;
+  if (peer) {
+    s->peer = *peer;
+  }
+  s->config = *config;
+  s->read = read;
+  s->ctx = ctx;
+  s->length = length;
+  s->total_segments = length / SEGMENT_SIZE + 1;
+  s->srtt8 = -1;
+  s->status = RDT_RUNNING;
+  return s;
+}
+
+void rdt_sender_free(rdt_sender_t *s) { free(s); }
+
+rdt_status_t rdt_sender_start(rdt_sender_t *s) {
+  fill_window(s);
+  return s->status;
+}
+
+// RTT sample from a cumulative ACK up to `ackno`: the last segment it newly
+// acknowledges is the one the receiver answered. Segments it jumps over were
+// buffered and selectively acked before, and a retransmitted segment gives
+// no sample at all (Karn).
+static void sample_rtt(rdt_sender_t *s, uint32_t ackno) {
+  uint32_t seq = ackno - 1;
+  while (seq > s->base && s->acked >> (seq - s->base) & 1) {
+    seq--;
+  }
+  uint64_t sent_at = s->sent_at[seq % MAX_WINDOW_SIZE];
+  if (sent_at) { // RFC 6298 smoothing, gain 1/8.
+    int64_t rtt8 = (int64_t)(now_ms(s->config.io) - sent_at) * 8;
+    s->srtt8 = s->srtt8 < 0 ? rtt8 : s->srtt8 + (rtt8 - s->srtt8) / 8;
+  }
+}
+
+static void handle_ack(rdt_sender_t *s, const ack_pkt_t *ack) {
+  uint32_t ackno = ntohl(ack->seq_num) & seq_mask(s->config.stream);
+  uint32_t selective = ntohl(ack->selective_acks);
+
+  if (s->config.verbose) {
+    printf("Received ACK %" PRIu32 " / %08" PRIu32 ".\n", ackno, selective);
+  }
+
+  if (ackno > s->next) { // Acknowledges something never sent.
+    return;
+  }
+
+  if (ackno > s->base) { // Cumulative ack: slide the window.
+    sample_rtt(s, ackno);
+
+    uint32_t shift = ackno - s->base;
+    s->acked = shift < 64 ? s->acked >> shift : 0;
+    s->base = ackno;
+    s->tries = 0;
+    s->deadline = s->base < s->next ? now_ms(s->config.io) + TIMEOUT : 0;
+    arm_probe(s);
+  }
+
+  // Bit i of the selective acks stands for segment ackno + 1 + i.
+  if (ackno == s->base) {
+    s->acked |= (uint64_t)selective << 1;
+  }
+
+  if (s->base == s->total_segments) {
+    s->status = RDT_DONE;
+    s->deadline = 0;
+    s->probe_deadline = 0;
+    return;
+  }
+
+  fill_window(s);
+}
+
+// One datagram per readiness: a recvfrom() that finds nothing queued would
+// show up in the log-packets.so log as a timeout.
+rdt_status_t rdt_sender_on_readable(rdt_sender_t *s) {
+  if (s->status != RDT_RUNNING) {
+    return s->status;
+  }
+  ack_pkt_t ack;
+  struct sockaddr_in src_addr;
+  ssize_t len =
+      recvfrom(s->sockfd, &ack, sizeof(ack), MSG_DONTWAIT,
+               (struct sockaddr *)&src_addr, &(socklen_t){sizeof(src_addr)});
+  if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      sender_fail(s, strerror(errno));
+    }
+    return s->status;
+  }
+  return rdt_sender_on_packet(s, &ack, len, &src_addr);
+}
+
+rdt_status_t rdt_sender_on_packet(rdt_sender_t *s, const void *pkt, size_t len,
+                                  const struct sockaddr_in *from) {
+  if (s->status != RDT_RUNNING) {
+    return s->status;
+  }
+  if (from && !same_addr(from, &s->peer)) {
+    return sender_fail(s, "ACK received from wrong address.");
+  }
+  if (len == sizeof(ack_pkt_t) && same_stream(s->config.stream, pkt)) {
+    handle_ack(s, pkt);
+  }
+  return s->status;
+}
+
+rdt_status_t rdt_sender_on_timer(rdt_sender_t *s) {
+  if (s->status != RDT_RUNNING) {
+    return s->status;
+  }
+
+  // One probe per flight: most likely the tail, or the very first segment,
+  // was lost, and its ACK tells the receiver's state within one RTT.
+  uint64_t now = now_ms(s->config.io);
+  if (s->probe_deadline && now >= s->probe_deadline) {
+    s->probe_deadline = 0;
+    if (s->config.verbose) {
+      printf("Probing.\n");
+    }
+    send_segment(s, s->base, true);
+    return s->status;
+  }
+  if (s->deadline == 0 || now < s->deadline) {
+    return s->status;
+  }
+
+  if (s->config.verbose) {
+    printf("Timed out.\n");
+  }
+  if (s->tries == MAX_RETRIES) {
+    return sender_fail(s, "Could not receive server acknowledge");
+  }
+  s->tries++;
+
+  // Go-back N receivers never send selective acks, so this resends the whole
+  // window for them and only the missing segments for Selective Repeat.
+  for (uint32_t seq = s->base; seq < s->next; seq++) {
+    if (!(s->acked & ((uint64_t)1 << (seq - s->base)))) {
+      if (!send_segment(s, seq, true)) {
+        return s->status;
+      }
+    }
+  }
+  s->deadline = now_ms(s->config.io) + TIMEOUT;
+  return s->status;
+}
+
+int rdt_sender_timeout(const rdt_sender_t *s) {
+  if (s->status != RDT_RUNNING || s->deadline == 0) {
+    return -1;
+  }
+  uint64_t deadline = s->deadline;
+  if (s->probe_deadline && s->probe_deadline < deadline) {
+    deadline = s->probe_deadline;
+  }
+  uint64_t now = now_ms(s->config.io);
+  return deadline > now ? (int)(deadline - now) : 0;
+}
+
+rdt_status_t rdt_sender_status(const rdt_sender_t *s) { return s->status; }
+
+const char *rdt_sender_error(const rdt_sender_t *s) { return s->error; }
+
+int rdt_sender_srtt(const rdt_sender_t *s) {
+  return s->srtt8 < 0 ? -1 : (int)(s->srtt8 / 8);
+}
+
+/******************************************************************************\
+* Receiver                                                                     *
+\******************************************************************************/
+
+struct rdt_receiver {
+  int sockfd;
+  struct sockaddr_in peer;
+  bool has_peer;
+  rdt_config_t config;
+  rdt_write_fn write;
+  void *ctx;
+
+  uint32_t expected;  // Next in-order segment.
+  uint32_t selective; // Bit i set if expected + 1 + i was received.
+  bool has_last;
+  uint32_t last;      // Sequence number of the short, final segment.
+
+  rdt_status_t status;
+  const char *error;
+
+  data_pkt_t pkt;
+};
+
+rdt_receiver_t *rdt_receiver_new(int sockfd, const rdt_config_t *config,
+                                 rdt_write_fn write, void *ctx) {
+  if (config->window_size < 1 || config->window_size > MAX_WINDOW_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  rdt_receiver_t *r = calloc(1, sizeof(rdt_receiver_t));
+  if (!r) {
+    return NULL;
+  }
+  r->sockfd = sockfd;
+  r->config = *config;
+  r->write = write;
+  r->ctx = ctx;
+  r->status = RDT_RUNNING;
+  return r;
+}
+
+void rdt_receiver_free(rdt_receiver_t *r) { free(r); }
+
+static void handle_segment(rdt_receiver_t *r, const data_pkt_t *pkt,
+                           size_t len) {
+  uint32_t seq = ntohl(pkt->seq_num) & seq_mask(r->config.stream);
+  size_t data_len = len - offsetof(data_pkt_t, data);
+
+  if (r->config.verbose) {
+    printf("Received segment %" PRIu32 ".\n", seq);
+  }
+
+  if (seq == r->expected) {
+    r->write(r->ctx, (uint64_t)seq * SEGMENT_SIZE, pkt->data, data_len);
+    if (data_len < SEGMENT_SIZE) {
+      r->has_last = true;
+      r->last = seq;
+    }
+    // Slide over the segments that were already buffered out of order.
+    r->expected++;
+    while (r->selective & 1) {
+      r->selective >>= 1;
+      r->expected++;
+    }
+    r->selective >>= 1;
+  } else if (r->config.window_size > 1 && seq > r->expected &&
+             seq < r->expected + r->config.window_size) {
+    uint32_t bit = 1u << (seq - r->expected - 1);
+    if (!(r->selective & bit)) {
+      r->write(r->ctx, (uint64_t)seq * SEGMENT_SIZE, pkt->data, data_len);
+      r->selective |= bit;
+    }
+    if (data_len < SEGMENT_SIZE) {
+      r->has_last = true;
+      r->last = seq;
+    }
+  } else if (r->config.verbose) {
+    printf("Segment out of window.\n");
+  }
+
+  if (r->has_last && r->expected > r->last) {
+    r->status = RDT_DONE;
+  }
+}
+
+static void send_ack(rdt_receiver_t *r) {
+  ack_pkt_t ack = {
+      .seq_num = wire_seq(r->config.stream, r->expected),
+      .selective_acks = htonl(r->selective),
+  };
+  ssize_t sent_len =
+      xmit(r->config.io, r->sockfd, &r->peer, &ack, sizeof(ack));
+  if (sent_len > 0 && r->config.verbose) {
+    printf("Sending ACK %" PRIu32 " / %08" PRIu32 ".\n", r->expected,
+           r->selective);
+  }
+}
+
+rdt_status_t rdt_receiver_on_readable(rdt_receiver_t *r) {
+  if (r->status == RDT_FAILED) {
+    return r->status;
+  }
+  struct sockaddr_in src_addr;
+  ssize_t len =
+      recvfrom(r->sockfd, &r->pkt, sizeof(r->pkt), MSG_DONTWAIT,
+               (struct sockaddr *)&src_addr, &(socklen_t){sizeof(src_addr)});
+  if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      r->status = RDT_FAILED;
+      r->error = strerror(errno);
+    }
+    return r->status;
+  }
+  return rdt_receiver_on_packet(r, &r->pkt, len, &src_addr);
+}
+
+rdt_status_t rdt_receiver_on_packet(rdt_receiver_t *r, const void *pkt,
+                                    size_t len,
+                                    const struct sockaddr_in *from) {
+  if (r->status == RDT_FAILED) {
+    return r->status;
+  }
+  if (from) {
+    if (!r->has_peer) {
+      r->peer = *from;
+      r->has_peer = true;
+    } else if (!same_addr(from, &r->peer)) {
+      r->status = RDT_FAILED;
+      r->error = "Segment received from wrong address.";
+      return r->status;
+    }
+  }
+  if (len < offsetof(data_pkt_t, data) || len > sizeof(data_pkt_t) ||
+      !same_stream(r->config.stream, pkt)) {
+    return r->status;
+  }
+
+  // A finished session keeps acknowledging retransmissions, in case its
+  // final ACK was lost.
+  if (r->status == RDT_RUNNING) {
+    handle_segment(r, pkt, len);
+  }
+  send_ack(r);
+  return r->status;
+}
+
+const struct sockaddr_in *rdt_receiver_peer(const rdt_receiver_t *r) {
+  return r->has_peer ? &r->peer : NULL;
+}
+
+rdt_status_t rdt_receiver_on_timer(rdt_receiver_t *r) { return r->status; }
+
+int rdt_receiver_timeout(const rdt_receiver_t *r) { return -1; }
+
+rdt_status_t rdt_receiver_status(const rdt_receiver_t *r) { return r->status; }
+
+const char *rdt_receiver_error(const rdt_receiver_t *r) { return r->error; }
+
+bool rdt_tune_socket(int sockfd, int busy_poll, int cpu) {
+  if (busy_poll && setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                              sizeof(busy_poll)) < 0) {
+    perror("SO_BUSY_POLL");
+  }
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
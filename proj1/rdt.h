@@ -0,0 +1,137 @@
+/*
+ * Reliable Data Transfer library (librdt)
+ *
+ * Stop-and-wait, Go-back N and Selective Repeat as non-blocking,
+ * fd-driven sessions. The caller owns the socket and the event loop:
+ * it creates a session, calls the *_on_readable handler when the socket
+ * is readable and the *_on_timer handler when the deadline returned by
+ * *_timeout expires. Payload never goes through an intermediate buffer:
+ * the sender reads each segment straight into the outgoing packet and the
+ * receiver hands out pointers into the incoming one.
+ *
+ * Sessions can also run without a socket: with an rdt_io_t the library
+ * transmits and reads the clock through the caller's hooks, and the caller
+ * hands incoming packets to the *_on_packet handlers. This is how rdt-sim
+ * drives both ends over a simulated channel on a virtual clock.
+ * */
+
+#ifndef RDT_H
+#define RDT_H
+
+#include "packet-format.h"
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SEGMENT_SIZE sizeof(((data_pkt_t *)0)->data)
+
+// Sessions other than stream 0 carry their stream id in the top byte of the
+// sequence number, so several of them can share one socket pair.
+#define RDT_SEQ_MASK 0x00FFFFFFu
+
+typedef enum rdt_status_t {
+  RDT_FAILED = -1,
+  RDT_RUNNING = 0,
+  RDT_DONE = 1,
+} rdt_status_t;
+
+// Transport and clock hooks replacing sendto() and CLOCK_MONOTONIC.
+typedef struct rdt_io_t {
+  // Transmit one packet to the peer. Returns the number of bytes sent.
+  ssize_t (*send)(void *ctx, const void *pkt, size_t len);
+  // Current time in milliseconds.
+  uint64_t (*now)(void *ctx);
+  void *ctx;
+} rdt_io_t;
+
+typedef struct rdt_config_t {
+  int window_size; // 1 selects stop-and-wait, >1 Go-back N / Selective Repeat
+  bool verbose;    // Print per-segment progress to stdout.
+  const rdt_io_t *io; // NULL to use the socket and the monotonic clock.
+  uint8_t stream;     // 0 for the plain, single session wire format.
+  // Retransmit the first unacknowledged segment once after about two
+  // round-trip times without progress, instead of waiting for TIMEOUT.
+  // Receivers should linger after RDT_DONE to acknowledge such probes.
+  bool tail_loss_probe;
+} rdt_config_t;
+
+// Stream id of a data or ACK packet, for sessions other than stream 0.
+static inline uint8_t rdt_packet_stream(const void *pkt) {
+  return ((const uint8_t *)pkt)[0];
+}
+
+// Copy up to `len` bytes of payload at `offset` into `buf`.
+// Returns the number of bytes copied.
+typedef size_t (*rdt_read_fn)(void *ctx, uint64_t offset, void *buf,
+                              size_t len);
+
+// Store `len` bytes of payload that belong at `offset`.
+typedef void (*rdt_write_fn)(void *ctx, uint64_t offset, const void *buf,
+                             size_t len);
+
+typedef struct rdt_sender rdt_sender_t;
+typedef struct rdt_receiver rdt_receiver_t;
+
+/******************************************************************************\
+* Sender                                                                       *
+\******************************************************************************/
+
+// Create a session that sends `length` bytes, fetched through `read`, to
+// `peer`. `sockfd` must be a UDP socket in non-blocking mode.
+rdt_sender_t *rdt_sender_new(int sockfd, const struct sockaddr_in *peer,
+                             const rdt_config_t *config, uint64_t length,
+                             rdt_read_fn read, void *ctx);
+void rdt_sender_free(rdt_sender_t *s);
+
+// Send the first window.
+rdt_status_t rdt_sender_start(rdt_sender_t *s);
+// Receive one ACK from the socket and refill the window.
+rdt_status_t rdt_sender_on_readable(rdt_sender_t *s);
+// Process one ACK that the caller received. `from` is checked against the
+// peer unless NULL.
+rdt_status_t rdt_sender_on_packet(rdt_sender_t *s, const void *pkt, size_t len,
+                                  const struct sockaddr_in *from);
+// Retransmit if the probe or retransmission deadline has passed.
+rdt_status_t rdt_sender_on_timer(rdt_sender_t *s);
+// Milliseconds until the next deadline, -1 if none is armed.
+int rdt_sender_timeout(const rdt_sender_t *s);
+
+rdt_status_t rdt_sender_status(const rdt_sender_t *s);
+const char *rdt_sender_error(const rdt_sender_t *s);
+// Smoothed round-trip time in milliseconds, -1 before the first sample.
+int rdt_sender_srtt(const rdt_sender_t *s);
+
+/******************************************************************************\
+* Receiver                                                                     *
+\******************************************************************************/
+
+// Create a session that receives into `write` from the first peer that
+// sends a segment on `sockfd`, a bound UDP socket in non-blocking mode.
+rdt_receiver_t *rdt_receiver_new(int sockfd, const rdt_config_t *config,
+                                 rdt_write_fn write, void *ctx);
+void rdt_receiver_free(rdt_receiver_t *r);
+
+// Receive one segment from the socket and acknowledge it. Still
+// acknowledges retransmissions once RDT_DONE, for callers that linger.
+rdt_status_t rdt_receiver_on_readable(rdt_receiver_t *r);
+// Process and acknowledge one segment that the caller received. The first
+// `from` becomes the peer; NULL when the rdt_io_t hooks do the addressing.
+rdt_status_t rdt_receiver_on_packet(rdt_receiver_t *r, const void *pkt,
+                                    size_t len, const struct sockaddr_in *from);
+rdt_status_t rdt_receiver_on_timer(rdt_receiver_t *r);
+int rdt_receiver_timeout(const rdt_receiver_t *r);
+
+rdt_status_t rdt_receiver_status(const rdt_receiver_t *r);
+const char *rdt_receiver_error(const rdt_receiver_t *r);
+// Address of the sender, NULL until the first segment arrives.
+const struct sockaddr_in *rdt_receiver_peer(const rdt_receiver_t *r);
+
+// Low latency knobs: kernel busy polling on `sockfd` for `busy_poll` usec if
+// nonzero, and pinning the process to `cpu` if >= 0. Busy polling above
+// net.core.busy_read needs CAP_NET_ADMIN, so failing that only warns.
+// Returns false, with errno set, if the process cannot be pinned.
+bool rdt_tune_socket(int sockfd, int busy_poll, int cpu);
+
+#endif
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+set -euo pipefail
+
+# Usage: benchmark.sh [nodes] [links] [seed]
+# Times every simulator on a gen-net topology, by default Barabási–Albert
+# (connected by construction, set MODEL for another) with about `links`
+# links and five link failures and recoveries, and reports message
+# allocation time and peak memory use. Extra simulator flags go in FLAGS,
+# e.g. FLAGS=--malloc-messages. Set BASELINE=<git revision> to time that
+# revision side by side. For runs over many sizes and models, see
+# scaling-benchmark.sh.
+NODES="${1:-20}"
+LINKS="${2:-40}"
+SEED="${3:-1}"
+MODEL="${MODEL:-ba}"
+ROUTERS="dv dvrpp pv ls"
+
+cd "$(dirname "$0")"
+
+TEMP_DIR="$(mktemp -d)"
+
+function cleanup {
+  rm -rf "$TEMP_DIR"
+}
+trap cleanup EXIT
+
+
+make --quiet gen-net
+./gen-net --seed "$SEED" --failures 5 --duration 50 \
+  --degree "$(awk -v n="$NODES" -v e="$LINKS" 'BEGIN { print 2 * e / n }')" \
+  "$MODEL" "$NODES" > "$TEMP_DIR/topology.net"
+
+make --quiet $(printf "%s-simulator " $ROUTERS)
+
+if [ -n "${BASELINE:-}" ]; then
+  git archive "$BASELINE" . | tar -x -C "$TEMP_DIR"
+  make --quiet -C "$TEMP_DIR" $(printf "%s-simulator " $ROUTERS)
+fi
+
+# Wall time in ms, then anything the simulator printed.
+function run {
+  local START END OUTPUT
+  START=$(date +%s%N)
+  OUTPUT="$("$@" "$TEMP_DIR/topology.net")"
+  END=$(date +%s%N)
+  echo $(( (END - START) / 1000000 )) "$OUTPUT"
+}
+
+echo "Topology: $NODES nodes, $(wc -l < "$TEMP_DIR/topology.net") link events."
+printf "%-8s %12s %12s %12s %12s\n" router "current ms" "alloc ms" \
+  "peak KB" "${BASELINE:+baseline ms}"
+for ROUTER in $ROUTERS; do
+  # shellcheck disable=SC2086
+  read -r -a CURRENT <<< "$(run "./$ROUTER-simulator" ${FLAGS:-} --alloc-stats |
+    tr '\n' ' ')"
+  ALLOC="$(echo "${CURRENT[*]}" | sed -n 's/.* in \([0-9.]*\) ms\..*/\1/p')"
+  PEAK="$(echo "${CURRENT[*]}" | sed -n 's/.*set size: \([0-9]*\) KB.*/\1/p')"
+  BASE=""
+  if [ -n "${BASELINE:-}" ]; then
+    BASE="$(run "$TEMP_DIR/$ROUTER-simulator" | head -1 | cut -d' ' -f1)"
+  fi
+  printf "%-8s %12s %12s %12s %12s\n" "$ROUTER" "${CURRENT[0]}" "$ALLOC" \
+    "$PEAK" "$BASE"
+done
@@ -4,68 +4,107 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
 
 #include "routing-simulator.h"
+#include "min-plus.h"
 
-#define min(a, b) (int) a < (int) b ? a:b
+// Message format to send between nodes: the sender's distance vector, one
+// cost per node from get_first_node() to get_last_node().
+typedef cost_t message_t;
 
-// Message format to send between nodes.
+// State format. Per node arrays are indexed by node - get_first_node().
 typedef struct {
-    cost_t vector_cost[MAX_NODES];
-} message_t;
-
-// State format.
-typedef struct {
-    cost_t distances[MAX_NODES][MAX_NODES];
+    int span;
+    int n_neighbors;
+    const node_t *neighbors;
+    cost_t *distances;  // Own distance vector.
+    cost_t *vectors;    // [neighbor index][node] -> last advertised cost.
+    cost_t *link_costs; // [neighbor index] -> current link cost.
+    cost_t *best;       // Scratch row for find_routes().
+    hold_down_t hold_down;
 } state_t;
 
 
-// Send messages from current_node to all neighbors
-void send_msg(state_t *state, node_t current_node) {
-    for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-        if (n != current_node && get_link_cost(n) != COST_INFINITY) {
-            message_t *nm = (message_t *) malloc(sizeof(message_t));
-            for (node_t x = get_first_node(); x <= get_last_node(); x++) {
-                nm->vector_cost[x] = state->distances[current_node][x];
-            }
-            send_message(n, nm);
+static int neighbor_index(const state_t *state, node_t neighbor) {
+    int low = 0, high = state->n_neighbors;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (state->neighbors[mid] < neighbor) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
+    assert(low < state->n_neighbors && state->neighbors[low] == neighbor);
+    return low;
 }
 
-// Check if there are new routes w Bellman-Ford
-void find_routes(state_t *state, node_t current_node){
-    for (node_t adj = get_first_node(); adj <= get_last_node(); adj++) {
-        if (adj != current_node) {
-
-            // Bellman-Ford
-            cost_t min_cost = get_link_cost(adj);
-            cost_t temp_min = get_link_cost(adj);
-            node_t temp_neighbor = adj;
-
-            for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-                if (n != adj && n != current_node && get_link_cost(n) != COST_INFINITY) {
-
-                    min_cost = min(get_link_cost(n) + state->distances[n][adj], min_cost);
+// Send messages from current_node to all neighbors
+void send_msg(state_t *state, node_t current_node) {
+    message_t *nm = (message_t *) alloc_message(state->span * sizeof(message_t));
+    memcpy(nm, state->distances, state->span * sizeof(message_t));
+    broadcast_message(nm, NULL, 0);
+}
 
-                    if(temp_min > min_cost) {
-                        temp_neighbor = n;
-                        temp_min = min_cost;
-                    }
-                }
-            }
+static void send_current(void *state) {
+    send_msg((state_t *) state, get_current_node());
+}
 
-            if (min_cost != state->distances[current_node][adj]) {
-                set_route(adj, temp_neighbor, min_cost);
+// Send the distance vector after the routes changed, see hold_down_send().
+void send_update(state_t *state, node_t current_node) {
+    hold_down_send(&state->hold_down, send_current, state);
+}
 
-                state->distances[current_node][adj] = min_cost;
-                state->distances[adj][current_node] = min_cost;
+// The route to node x at cost goes straight over the link if that is as
+// cheap, else through the first neighbor with a vector that gives the cost.
+static node_t best_hop(const state_t *state, int x, cost_t cost) {
+    node_t first = get_first_node();
+
+    if (cost == COST_INFINITY)
+        return first + x;
+    for (int k = 0; k < state->n_neighbors; k++)
+        if (state->neighbors[k] == first + x && state->link_costs[k] == cost)
+            return first + x;
+    for (int k = 0; k < state->n_neighbors; k++)
+        if (COST_ADD(state->link_costs[k], state->vectors[(size_t) k * state->span + x]) == cost)
+            return state->neighbors[k];
+    assert(0 && "No neighbor gives the route cost.");
+    return first + x;
+}
 
-                // Send message to neighbors when new route found
-                send_msg(state, current_node);
-            }
+// Check if there are new routes w Bellman-Ford: direct links first, then a
+// min-plus pass over the vector of each neighbor whose link is up.
+void find_routes(state_t *state, node_t current_node){
+    node_t first = get_first_node();
+    int current = current_node - first, changed = 0;
+    cost_t *best = state->best;
+
+    for (int x = 0; x < state->span; x++)
+        best[x] = COST_INFINITY;
+    for (int k = 0; k < state->n_neighbors; k++) {
+        state->link_costs[k] = get_link_cost(state->neighbors[k]);
+        best[state->neighbors[k] - first] = state->link_costs[k];
+    }
+    for (int k = 0; k < state->n_neighbors; k++)
+        if (state->link_costs[k] != COST_INFINITY)
+            min_plus(best, state->vectors + (size_t) k * state->span, state->link_costs[k],
+                     state->span);
+
+    for (int x = 0; x < state->span; x++) {
+        if (x != current && best[x] != state->distances[x]) {
+            node_t hop = best_hop(state, x, best[x]);
+            set_route(first + x, hop, best[x]);
+
+            state->distances[x] = best[x];
+            changed = 1;
         }
     }
+
+    // One update to the neighbors for all the new routes.
+    if (changed)
+        send_update(state, current_node);
 }
 
 // Notify a node that a neighboring link has changed cost.
@@ -74,15 +113,27 @@ void notify_link_change(node_t neighbor, cost_t new_cost) {
     state_t *state = (state_t *) get_state();
 
     if(!state) { // initial state
-        state = (state_t *) malloc(sizeof(state_t));
+        int span = get_last_node() - get_first_node() + 1;
+        const node_t *neighbors;
+        int n_neighbors = get_neighbors(&neighbors);
+
+        // One block: the state, then its arrays.
+        size_t costs = (size_t) span * (2 + n_neighbors) + n_neighbors;
+        state = (state_t *) malloc(sizeof(state_t) + costs * sizeof(cost_t));
         set_state(state);
-        for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-            for (node_t j = get_first_node(); j <= get_last_node(); j++) {
-                if (!(j == current_node && n == current_node)) {
-                    state->distances[n][j] = COST_INFINITY;
-                }
-            }
+        state->span = span;
+        state->n_neighbors = n_neighbors;
+        state->neighbors = neighbors;
+        state->distances = (cost_t *) (state + 1);
+        state->vectors = state->distances + span;
+        state->link_costs = state->vectors + (size_t) span * n_neighbors;
+        state->best = state->link_costs + n_neighbors;
+
+        for (size_t i = 0; i < costs; i++) {
+            state->distances[i] = COST_INFINITY;
         }
+        state->distances[current_node - get_first_node()] = 0;
+        state->hold_down.holding = state->hold_down.pending = 0;
     }
 
     find_routes(state, current_node);
@@ -93,12 +144,19 @@ void notify_receive_message(node_t sender, void *message) {
     int current_node = get_current_node();
     state_t *state = (state_t *) get_state();
     message_t *m = (message_t *) message;
+    cost_t *vector = state->vectors + (size_t) neighbor_index(state, sender) * state->span;
 
-    for (node_t j = get_first_node(); j <= get_last_node(); j++) {
-        if (j != sender) {
-            state->distances[sender][j] = m->vector_cost[j];
-        }
-    }
+    // The sender's cost to itself stays infinite: no route to it goes
+    // through itself.
+    memcpy(vector, m, state->span * sizeof(message_t));
+    vector[sender - get_first_node()] = COST_INFINITY;
 
     find_routes(state, current_node);
 }
+
+// The hold down is over: send the changes made during it, if any.
+void notify_timer() {
+    state_t *state = (state_t *) get_state();
+
+    hold_down_over(&state->hold_down, send_current, state);
+}
@@ -0,0 +1,390 @@
+/******************************************************************************\
+* Synthetic topology generator: writes a .net file for a ring, grid, fat-tree, *
+* Erdős–Rényi, Barabási–Albert or Waxman network, with random link failures    *
+* and recoveries over time, and optionally link delays, bandwidth and loss.    *
+\******************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <set>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "routing-simulator.h"
+
+// Command-line flags.
+static unsigned long seed = 1;
+static double degree = 4;   // Mean node degree, Erdős–Rényi and onwards.
+static double beta = 0.2;   // Waxman distance scale, of the square diagonal.
+static unsigned long min_cost = 1;
+static unsigned long max_cost = 20;
+static long failures = 0;
+static long duration = 100; // Failures start in epochs 1 to duration.
+static long downtime = 20;  // Failed links come back after 1 to downtime.
+static long max_delay = 1;  // Link delays from 1 to max_delay.
+static unsigned long bandwidth = 0; // Bytes per epoch, 0 for no limit.
+static double loss = 0;
+
+typedef std::pair<node_t, node_t> link_t;
+typedef struct {
+  long time;
+  link_t link;
+  unsigned long cost;
+  long delay; // 0 unless the line sets the link properties.
+} line_t;
+
+static std::mt19937_64 rng;
+static std::vector<link_t> links;
+
+static long uniform(long low, long high) {
+  return std::uniform_int_distribution<long>(low, high)(rng);
+}
+
+static void ring(int n) {
+  for (int i = 0; i + 1 < n; ++i) {
+    links.push_back(link_t(i, i + 1));
+  }
+  if (n > 2) {
+    links.push_back(link_t(0, n - 1));
+  }
+}
+
+// As square as possible, the last row possibly short.
+static void grid(int n) {
+  int width = (int)std::ceil(std::sqrt((double)n));
+  for (int i = 0; i < n; ++i) {
+    if ((i + 1) % width != 0 && i + 1 < n) {
+      links.push_back(link_t(i, i + 1));
+    }
+    if (i + width < n) {
+      links.push_back(link_t(i, i + width));
+    }
+  }
+}
+
+// The largest k-ary fat-tree with at most n nodes: (k / 2)^2 core switches,
+// then k pods of k / 2 aggregation switches, k / 2 edge switches and their
+// k^2 / 4 hosts.
+static void fat_tree(int n) {
+  int k = 2;
+  while (5 * (k + 2) * (k + 2) / 4 + (k + 2) * (k + 2) * (k + 2) / 4 <= n) {
+    k += 2;
+  }
+  if (5 * k * k / 4 + k * k * k / 4 > n) {
+    std::cerr << "No fat-tree has " << n << " nodes or fewer." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  int half = k / 2;
+  int cores = half * half;
+  int pod_size = k + half * half; // Switches and hosts.
+  for (int pod = 0; pod < k; ++pod) {
+    int aggregation = cores + pod * pod_size;
+    int edge = aggregation + half;
+    int host = edge + half;
+    for (int a = 0; a < half; ++a) {
+      for (int c = 0; c < half; ++c) {
+        links.push_back(link_t(a * half + c, aggregation + a));
+      }
+      for (int e = 0; e < half; ++e) {
+        links.push_back(link_t(aggregation + a, edge + e));
+      }
+    }
+    for (int e = 0; e < half; ++e) {
+      for (int h = 0; h < half; ++h) {
+        links.push_back(link_t(edge + e, host + e * half + h));
+      }
+    }
+  }
+}
+
+// G(n, p) with p set for the mean degree, skipping over the pairs left out.
+static void erdos_renyi(int n) {
+  double p = n > 1 ? degree / (n - 1) : 0;
+  if (p >= 1) {
+    for (int v = 1; v < n; ++v) {
+      for (int w = 0; w < v; ++w) {
+        links.push_back(link_t(w, v));
+      }
+    }
+    return;
+  }
+  if (p <= 0) {
+    return;
+  }
+
+  std::geometric_distribution<long> skip(p);
+  long v = 1, w = -1;
+  while (v < n) {
+    w += 1 + skip(rng);
+    while (w >= v && v < n) {
+      w -= v;
+      ++v;
+    }
+    if (v < n) {
+      links.push_back(link_t(w, v));
+    }
+  }
+}
+
+// Preferential attachment: each node after a starting clique links to
+// degree / 2 earlier nodes, picked in proportion to their degree.
+static void barabasi_albert(int n) {
+  int m = std::max(1, (int)std::lround(degree / 2));
+  std::vector<node_t> ends; // Each node once per link it has.
+  for (int v = 0; v < n; ++v) {
+    if (v <= m) {
+      for (int w = 0; w < v; ++w) {
+        links.push_back(link_t(w, v));
+        ends.push_back(w);
+        ends.push_back(v);
+      }
+      continue;
+    }
+    std::set<node_t> targets;
+    while ((int)targets.size() < m) {
+      targets.insert(ends[uniform(0, ends.size() - 1)]);
+    }
+    for (auto w : targets) {
+      links.push_back(link_t(w, v));
+      ends.push_back(w);
+      ends.push_back(v);
+    }
+  }
+}
+
+// Nodes at random in the unit square, linked with probability proportional
+// to exp(-distance / (beta * diagonal)), scaled for the mean degree.
+static void waxman(int n) {
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::vector<double> x(n), y(n);
+  for (int v = 0; v < n; ++v) {
+    x[v] = unit(rng);
+    y[v] = unit(rng);
+  }
+  auto weight = [&](int v, int w) {
+    return std::exp(-std::hypot(x[v] - x[w], y[v] - y[w]) /
+                    (beta * std::sqrt(2.0)));
+  };
+
+  double total = 0;
+  for (int v = 0; v < n; ++v) {
+    for (int w = 0; w < v; ++w) {
+      total += weight(v, w);
+    }
+  }
+  double alpha = total > 0 ? degree * n / 2 / total : 0;
+  for (int v = 0; v < n; ++v) {
+    for (int w = 0; w < v; ++w) {
+      if (unit(rng) < alpha * weight(v, w)) {
+        links.push_back(link_t(w, v));
+      }
+    }
+  }
+}
+
+// Links start up at time 0, with their properties if any are not the
+// default. Failures take a link that is up down for a while, then bring it
+// back at its old cost.
+static std::vector<line_t> make_lines() {
+  std::vector<line_t> lines;
+  std::vector<unsigned long> costs;
+  bool properties = max_delay > 1 || bandwidth > 0 || loss > 0;
+  for (auto link : links) {
+    costs.push_back(uniform(min_cost, max_cost));
+    lines.push_back({0, link, costs.back(),
+                     properties ? uniform(1, max_delay) : 0});
+  }
+  if (links.empty()) {
+    return lines;
+  }
+
+  std::vector<long> starts;
+  for (long f = 0; f < failures; ++f) {
+    starts.push_back(uniform(1, duration));
+  }
+  std::sort(starts.begin(), starts.end());
+  std::vector<long> up_at(links.size(), 0);
+  for (auto start : starts) {
+    for (int attempt = 0; attempt < 10; ++attempt) {
+      size_t l = uniform(0, links.size() - 1);
+      if (up_at[l] <= start) {
+        up_at[l] = start + uniform(1, downtime);
+        lines.push_back({start, links[l], COST_INFINITY, 0});
+        lines.push_back({up_at[l], links[l], costs[l], 0});
+        break;
+      }
+    }
+  }
+  std::stable_sort(lines.begin(), lines.end(),
+                   [](const line_t &a, const line_t &b) {
+                     return a.time < b.time;
+                   });
+  return lines;
+}
+
+static void show_usage(std::string command) {
+  std::cerr                                                              //
+      << "Usage: " << command                                            //
+      << " [--bandwidth <bytes>]"                                        //
+      << " [--beta <scale>]"                                             //
+      << " [--degree <mean>]"                                            //
+      << " [--downtime <epochs>]"                                        //
+      << " [--duration <epochs>]"                                        //
+      << " [--failures <count>]"                                         //
+      << " [--help]"                                                     //
+      << " [--loss <probability>]"                                       //
+      << " [--max-cost <cost>]"                                          //
+      << " [--max-delay <epochs>]"                                       //
+      << " [--min-cost <cost>]"                                          //
+      << " [--seed <seed>]"                                              //
+      << " [--] <model> <nodes>" << std::endl                            //
+      << std::endl                                                       //
+      << "Writes a topology to standard output. Models: ring, grid, "    //
+      << "fat-tree (the largest one with at most <nodes> nodes), er "    //
+      << "(Erdős–Rényi), ba (Barabási–Albert) and waxman." << std::endl //
+      << std::endl                                                       //
+      << " --bandwidth <bytes>       "                                   //
+      << "- Bytes each link sends per epoch (default: no limit)."        //
+      << std::endl                                                       //
+      << " --beta <scale>            "                                   //
+      << "- Waxman link distance scale, as a fraction of the diagonal "  //
+      << "(default: 0.2)."                                               //
+      << std::endl                                                       //
+      << " --degree <mean>           "                                   //
+      << "- Mean node degree for er, ba and waxman (default: 4)."        //
+      << std::endl                                                       //
+      << " --downtime <epochs>       "                                   //
+      << "- Longest time a failed link stays down (default: 20)."        //
+      << std::endl                                                       //
+      << " --duration <epochs>       "                                   //
+      << "- Failures start in epochs 1 to <epochs> (default: 100)."      //
+      << std::endl                                                       //
+      << " --failures <count>        "                                   //
+      << "- Random link failures, each followed by a recovery "          //
+      << "(default: 0)."                                                 //
+      << std::endl                                                       //
+      << " --help                    "                                   //
+      << "- Show this help screen."                                      //
+      << std::endl                                                       //
+      << " --loss <probability>      "                                   //
+      << "- Chance that a link loses each message (default: 0)."         //
+      << std::endl                                                       //
+      << " --max-cost <cost>         "                                   //
+      << "- Highest link cost (default: 20)."                            //
+      << std::endl                                                       //
+      << " --max-delay <epochs>      "                                   //
+      << "- Link delays are random, from 1 to <epochs> (default: 1)."    //
+      << std::endl                                                       //
+      << " --min-cost <cost>         "                                   //
+      << "- Lowest link cost (default: 1)."                              //
+      << std::endl                                                       //
+      << " --seed <seed>             "                                   //
+      << "- Random seed (default: 1)." << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments.
+  std::vector<std::string> positional;
+  bool positional_mode = false;
+
+  for (int a = 1; a < argc; ++a) {
+    std::string arg = argv[a];
+    bool has_value = arg == "--bandwidth" || arg == "--beta" ||
+                     arg == "--degree" || arg == "--downtime" ||
+                     arg == "--duration" || arg == "--failures" ||
+                     arg == "--loss" || arg == "--max-cost" ||
+                     arg == "--max-delay" || arg == "--min-cost" ||
+                     arg == "--seed";
+    if (has_value && !positional_mode) {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      std::string value = argv[++a];
+      try {
+        if (arg == "--bandwidth") {
+          bandwidth = std::stoul(value);
+        } else if (arg == "--beta") {
+          beta = std::stod(value);
+        } else if (arg == "--degree") {
+          degree = std::stod(value);
+        } else if (arg == "--downtime") {
+          downtime = std::stol(value);
+        } else if (arg == "--duration") {
+          duration = std::stol(value);
+        } else if (arg == "--failures") {
+          failures = std::stol(value);
+        } else if (arg == "--loss") {
+          loss = std::stod(value);
+        } else if (arg == "--max-cost") {
+          max_cost = std::stoul(value);
+        } else if (arg == "--max-delay") {
+          max_delay = std::stol(value);
+        } else if (arg == "--min-cost") {
+          min_cost = std::stoul(value);
+        } else {
+          seed = std::stoul(value);
+        }
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+    } else if (arg == "--help" && !positional_mode) {
+      show_usage(argv[0]);
+    } else if (arg == "--" && !positional_mode) {
+      positional_mode = true;
+    } else {
+      if ((arg.rfind("-", 0) == 0 && !positional_mode) ||
+          positional.size() == 2) {
+        std::cerr << "Unknown option: " << arg << std::endl;
+        show_usage(argv[0]);
+      }
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() != 2 || beta <= 0 || degree < 0 || downtime < 1 ||
+      duration < 1 || failures < 0 || min_cost > max_cost ||
+      max_cost >= COST_INFINITY || max_delay < 1 || !(loss >= 0) ||
+      loss > 1) {
+    show_usage(argv[0]);
+  }
+  int n = 0;
+  try {
+    n = std::stoi(positional[1]);
+  } catch (...) {
+    show_usage(argv[0]);
+  }
+
+  rng.seed(seed);
+  std::string model = positional[0];
+  if (model == "ring") {
+    ring(n);
+  } else if (model == "grid") {
+    grid(n);
+  } else if (model == "fat-tree") {
+    fat_tree(n);
+  } else if (model == "er") {
+    erdos_renyi(n);
+  } else if (model == "ba") {
+    barabasi_albert(n);
+  } else if (model == "waxman") {
+    waxman(n);
+  } else {
+    std::cerr << "Unknown model: " << model << std::endl;
+    show_usage(argv[0]);
+  }
+
+  for (const auto &line : make_lines()) {
+    printf("%ld %d %d %lu", line.time, line.link.first, line.link.second,
+           line.cost);
+    if (line.delay > 0) {
+      printf(" %ld %lu %g", line.delay, bandwidth, loss);
+    }
+    printf("\n");
+  }
+  return 0;
+}
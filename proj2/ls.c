@@ -4,149 +4,751 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
 #include "routing-simulator.h"
 
-#define min(a, b) (int) a < (int) b ? a:b
+typedef struct {
+  node_t neighbor;
+  cost_t cost;
+} link_t;
 
+// Link state of one node: the cost of each of its links. The origin bumps
+// the version on every change, so the newest copy wins.
 typedef struct {
-  cost_t link_cost[MAX_NODES];
+  node_t origin;
   int version;
+  int n_links;
+  link_t links[];
 } link_state_t;
 
-// Message format to send between nodes.
+#define LINK_STATE_SIZE(n_links) (sizeof(link_state_t) + (n_links) * sizeof(link_t))
+
+// What a link state summary lists of each link state.
+typedef struct {
+  node_t origin;
+  int version;
+} ls_header_t;
+
+// Message kinds. Floods are updates of the link states that just changed.
+// A new adjacency exchanges databases without sending them whole: the lower
+// node sends a summary, the other answers with an update of the link states
+// it has newer and a request for those it lacks, and the request gets an
+// update back.
+#define LS_UPDATE  0 // Link states, back to back.
+#define LS_SUMMARY 1 // A header for every link state known, by origin.
+#define LS_REQUEST 2 // Origins of the link states wanted.
+
+// Message format to send between nodes, its header one word.
 typedef struct {
-  link_state_t ls[MAX_NODES];
+  unsigned kind : 2;
+  unsigned n_ls : 30;
+  char ls[];
 } message_t;
 
-// State format.
+// A link into a node, from another node's stored link state. Pointing at the
+// cost keeps it current as that link state is replaced.
 typedef struct {
-    link_state_t ls[MAX_NODES];
+  int from;
+  const cost_t *cost;
+} in_link_t;
+
+typedef struct {
+  int n, capacity;
+  in_link_t *links;
+} in_links_t;
+
+typedef struct {
+  cost_t distance;
+  int node;
+} heap_entry_t;
+
+// Scratch flags of the nodes an SPF update has looked at.
+#define ORPHANED 1 // Lost its path through a link that got more expensive.
+#define TOUCHED  2 // Its distance may have changed.
+#define CHECKED  4 // Its parent has been checked.
+#define REHOPPED 8 // Its hop has been recomputed.
+
+// State format. Per node arrays are indexed by node - get_first_node().
+typedef struct {
+    int span;
+    link_state_t **ls;    // NULL until a version of the link state arrives.
+    link_state_t **fresh; // Scratch list of link states to send.
+    node_t *down;         // Scratch list of neighbors to skip, or origins.
+    cost_t *old_costs;    // Link costs of a link state before it was replaced.
+    int old_capacity;
+    int zero_links;       // Known links of cost 0, see find_routes().
+    in_links_t *in_links;
+    // Link states stored so far, when each was last stored, and how many
+    // were when each neighbor's link last came up: any stored since has
+    // been flooded to it.
+    unsigned long n_stored, *stored_at, *up_at;
+
+    // Shortest path tree. Unreachable nodes hang off the root.
+    cost_t *distances;
+    int *parent;
+    int *first_child, *next_sibling, *prev_sibling;
+    int *hop;             // See set_hop(), -1 for none.
+    cost_t *own_costs;
+    cost_t *route_costs;  // Last route given to set_route().
+    int *route_hops;
+
+    heap_entry_t *heap;
+    int heap_size, heap_capacity;
+    unsigned char *flags;
+    int *touched, *checked, *rehopped; // Scratch node lists.
 } state_t;
 
 
-// Send messages from current_node to all neighbors
-void send_msg(state_t *state, node_t current_node) {
-    for (node_t i = get_first_node(); i <= get_last_node(); i++) {
-        if (i != current_node && state->ls[current_node].link_cost[i] != COST_INFINITY) {
-            message_t *nm = (message_t *) malloc(sizeof(message_t));
+// Routers have no way to fail a simulation but to end it.
+static void out_of_memory(const char *what) {
+    fprintf(stderr, "Out of memory for %s.\n", what);
+    exit(EXIT_FAILURE);
+}
+
+static link_state_t *next_ls(const link_state_t *ls) {
+  return (link_state_t *) ((const char *) ls + LINK_STATE_SIZE(ls->n_links));
+}
+
+// Message with n link states, size bytes of them.
+static message_t *pack(link_state_t *const *ls, int n, size_t size) {
+    message_t *nm = (message_t *) alloc_message(sizeof(message_t) + size);
+    char *next = nm->ls;
 
-            for (node_t x = get_first_node(); x <= get_last_node(); x++) {
-                nm->ls[x].version = state->ls[x].version;
+    nm->kind = LS_UPDATE;
+    nm->n_ls = n;
+    for (int i = 0; i < n; i++) {
+        memcpy(next, ls[i], LINK_STATE_SIZE(ls[i]->n_links));
+        next += LINK_STATE_SIZE(ls[i]->n_links);
+    }
+    return nm;
+}
 
-                for (node_t y = get_first_node(); y <= get_last_node(); y++)
-                    nm->ls[x].link_cost[y] = state->ls[x].link_cost[y];
-            }
-            send_message(i, nm);
+// Send link states over every link this node's own link state has up,
+// except back to the neighbor skip (-1 for none).
+void flood(state_t *state, node_t current_node, link_state_t *const *ls, int n,
+           size_t size, node_t skip) {
+    const link_state_t *own = state->ls[current_node - get_first_node()];
+    int n_down = 0;
+
+    for (int l = 0; l < own->n_links; l++)
+        if (own->links[l].cost == COST_INFINITY || own->links[l].neighbor == skip)
+            state->down[n_down++] = own->links[l].neighbor;
+
+    broadcast_message(pack(ls, n, size), state->down, n_down);
+}
+
+// Start the database exchange with a neighbor whose link just came up.
+void send_summary(state_t *state, node_t neighbor) {
+    int n = 0;
+
+    for (int x = 0; x < state->span; x++)
+        n += state->ls[x] != NULL;
+
+    message_t *nm = (message_t *) alloc_message(sizeof(message_t) + n * sizeof(ls_header_t));
+    ls_header_t *headers = (ls_header_t *) nm->ls;
+    nm->kind = LS_SUMMARY;
+    nm->n_ls = n;
+    for (int x = 0; x < state->span; x++) {
+        if (state->ls[x]) {
+            headers->origin = state->ls[x]->origin;
+            headers->version = state->ls[x]->version;
+            headers++;
         }
     }
+    send_message(neighbor, nm);
 }
 
-// Check if there are new routes w Dijkstra
-void find_routes(state_t *state, node_t current_node) {
-    cost_t distances[MAX_NODES], path[MAX_NODES];
-    int visited[MAX_NODES] = {0};
+// Answer a summary, whose headers come in origin order. Link states that
+// were flooded to the neighbor are left out: own link state, every version
+// of which goes over the links up at the time, and those stored since its
+// link came up.
+static void answer_summary(state_t *state, node_t current_node, node_t sender,
+                           const message_t *m) {
+    const ls_header_t *headers = (const ls_header_t *) m->ls;
+    node_t first = get_first_node();
+    unsigned long up_at = state->up_at[sender - first];
+    int n_newer = 0, n_lacking = 0;
+    size_t newer_size = 0;
+
+    for (int x = 0, h = 0; x < state->span; x++) {
+        const link_state_t *ls = state->ls[x];
+        int version = -1; // Not in the summary.
+        if (h < m->n_ls && headers[h].origin == first + x)
+            version = headers[h++].version;
+        if (first + x == current_node)
+            continue;
+        if (ls && ls->version > version) {
+            if (state->stored_at[x] > up_at)
+                continue;
+            state->fresh[n_newer++] = state->ls[x];
+            newer_size += LINK_STATE_SIZE(ls->n_links);
+        } else if (version > (ls ? ls->version : -1)) {
+            state->down[n_lacking++] = first + x;
+        }
+    }
+
+    if (n_newer)
+        send_message(sender, pack(state->fresh, n_newer, newer_size));
+    if (n_lacking) {
+        message_t *nm = (message_t *) alloc_message(sizeof(message_t) + n_lacking * sizeof(node_t));
+        nm->kind = LS_REQUEST;
+        nm->n_ls = n_lacking;
+        memcpy(nm->ls, state->down, n_lacking * sizeof(node_t));
+        send_message(sender, nm);
+    }
+}
+
+// Send the link states a request asks for, the latest versions known.
+static void answer_request(state_t *state, node_t sender, const message_t *m) {
+    const node_t *origins = (const node_t *) m->ls;
+    size_t size = 0;
+
+    for (int i = 0; i < m->n_ls; i++) {
+        state->fresh[i] = state->ls[origins[i] - get_first_node()];
+        size += LINK_STATE_SIZE(state->fresh[i]->n_links);
+    }
+    send_message(sender, pack(state->fresh, m->n_ls, size));
+}
+
+
+// Heap order is the order the old array scan settled nodes in: nearest
+// first, ties to the higher node. Routes over equal cost paths depend on it.
+static int heap_less(heap_entry_t a, heap_entry_t b) {
+    return a.distance < b.distance || (a.distance == b.distance && a.node > b.node);
+}
+
+static void heap_push(state_t *state, int node) {
+    if (state->heap_size == state->heap_capacity) {
+        heap_entry_t *heap = (heap_entry_t *) realloc(state->heap,
+                                                      2 * state->heap_capacity * sizeof(heap_entry_t));
+        if (!heap)
+            out_of_memory("the heap");
+        state->heap = heap;
+        state->heap_capacity *= 2;
+    }
+
+    heap_entry_t entry = { state->distances[node], node };
+    int i = state->heap_size++;
+    while (i > 0 && heap_less(entry, state->heap[(i - 1) / 2])) {
+        state->heap[i] = state->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    state->heap[i] = entry;
+}
 
-    for (node_t j = get_first_node(); j <= get_last_node(); j++) {
-        distances[j] = state->ls[current_node].link_cost[j];
-        path[j] = current_node;
+static heap_entry_t heap_pop(state_t *state) {
+    heap_entry_t top = state->heap[0], last = state->heap[--state->heap_size];
+    int i = 0;
+
+    while (2 * i + 1 < state->heap_size) {
+        int child = 2 * i + 1;
+        if (child + 1 < state->heap_size && heap_less(state->heap[child + 1], state->heap[child]))
+            child++;
+        if (!heap_less(state->heap[child], last))
+            break;
+        state->heap[i] = state->heap[child];
+        i = child;
     }
+    state->heap[i] = last;
+    return top;
+}
 
-    visited[current_node] = 1;
-    int min_index;
+// Whether a is settled before b, the root before everything.
+static int settles_before(const state_t *state, int current, int a, int b) {
+    if (a == current || b == current)
+        return a == current && b != current;
+    heap_entry_t x = { state->distances[a], a }, y = { state->distances[b], b };
+    return heap_less(x, y);
+}
 
-    for (node_t n = get_first_node(); n <= get_last_node(); n++) {
+// The parent Dijkstra would pick: of the nodes settled before this one with
+// a shortest path through them, the first settled.
+static int best_parent(const state_t *state, int current, int node) {
+    const in_links_t *in = &state->in_links[node];
+    int best = -1;
+
+    if (state->distances[node] == COST_INFINITY)
+        return current;
+    for (int i = 0; i < in->n; i++) {
+        int from = in->links[i].from;
+        if (state->distances[from] != COST_INFINITY &&
+            COST_ADD(state->distances[from], *in->links[i].cost) == state->distances[node] &&
+            settles_before(state, current, from, node) &&
+            (best < 0 || settles_before(state, current, from, best)))
+            best = from;
+    }
+    return best;
+}
 
-        cost_t minimum = COST_INFINITY;
+static void link_child(state_t *state, int node, int parent) {
+    state->parent[node] = parent;
+    state->prev_sibling[node] = -1;
+    state->next_sibling[node] = state->first_child[parent];
+    if (state->first_child[parent] >= 0)
+        state->prev_sibling[state->first_child[parent]] = node;
+    state->first_child[parent] = node;
+}
 
-        for (node_t v = get_first_node(); v <= get_last_node(); v++)
-            if (!visited[v] && distances[v] <= minimum)
-                minimum = distances[v], min_index = v;
+static void unlink_child(state_t *state, int node) {
+    if (state->prev_sibling[node] >= 0)
+        state->next_sibling[state->prev_sibling[node]] = state->next_sibling[node];
+    else
+        state->first_child[state->parent[node]] = state->next_sibling[node];
+    if (state->next_sibling[node] >= 0)
+        state->prev_sibling[state->next_sibling[node]] = state->prev_sibling[node];
+}
 
-        visited[min_index] = 1;
+// The hop of a node is the neighbor with the cheapest own link on its tree
+// path, the node included, ties to the one nearest the node. Routes through
+// the node go there.
+static void set_hop(state_t *state, int current, int node) {
+    int parent = state->parent[node];
+    int inherited = parent == current ? -1 : state->hop[parent];
+    cost_t own = state->own_costs[node];
+
+    if (own != COST_INFINITY && (inherited < 0 || own <= state->own_costs[inherited]))
+        state->hop[node] = node;
+    else
+        state->hop[node] = inherited;
+}
+
+// Tell the simulator if the route to node changed: straight over the link
+// if it is as cheap as the shortest path, else through the parent's hop.
+static void update_route(state_t *state, int current, int node) {
+    node_t first = get_first_node();
+    cost_t cost = state->distances[node];
+    int parent = state->parent[node], hop;
+
+    if (node == current)
+        return;
+    if (state->own_costs[node] == cost)
+        hop = node;
+    else if (parent == current || state->hop[parent] < 0)
+        hop = current;
+    else
+        hop = state->hop[parent];
+
+    if (cost != state->route_costs[node] || (cost != COST_INFINITY && hop != state->route_hops[node])) {
+        set_route(first + node, first + hop, cost);
+        state->route_costs[node] = cost;
+        state->route_hops[node] = hop;
+    }
+}
 
-        for (node_t j = get_first_node(); j <= get_last_node(); j++)
-            if (!visited[j] && minimum + state->ls[min_index].link_cost[j] < distances[j]) {
-                distances[j] = minimum + state->ls[min_index].link_cost[j];
-                path[j] = min_index;
+// Relax the links of a node taken off the heap during an update, which
+// tells settled nodes by their distance.
+static int relax(state_t *state, int node, int n_touched) {
+    const link_state_t *ls = state->ls[node];
+    node_t first = get_first_node();
+
+    for (int l = 0; ls && l < ls->n_links; l++) {
+        int j = ls->links[l].neighbor - first;
+        cost_t cost = COST_ADD(state->distances[node], ls->links[l].cost);
+        if (cost < state->distances[j]) {
+            state->distances[j] = cost;
+            if (!(state->flags[j] & TOUCHED)) {
+                state->flags[j] |= TOUCHED;
+                state->touched[n_touched++] = j;
             }
+            heap_push(state, j);
+        }
+    }
+    return n_touched;
+}
+
+// Check the parent of a node whose links in may have changed. A new parent
+// goes on the heap, as the hops below it need recomputing.
+static int check_parent(state_t *state, int current, int node, int n_checked) {
+    if (node == current || (state->flags[node] & CHECKED))
+        return n_checked;
+    state->flags[node] |= CHECKED;
+    state->checked[n_checked++] = node;
+
+    int parent = best_parent(state, current, node);
+    if (parent != state->parent[node]) {
+        unlink_child(state, node);
+        link_child(state, node, parent);
+        heap_push(state, node);
     }
+    return n_checked;
+}
 
-    node_t j;
-    for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-        if (n != current_node) {
-            if (state->ls[current_node].link_cost[n] != distances[n]) {
+// Dijkstra from scratch, CHECKED marking the settled nodes. It is also the
+// fallback while there are links of cost 0: a node reached over one at the
+// same distance can settle after a higher node, which breaks the settling
+// order update_routes() goes by.
+void find_routes(state_t *state, node_t current_node) {
+    int span = state->span, current = current_node - get_first_node(), n_settled = 0;
+    int *order = state->touched;
 
-                node_t min_path_link;
-                cost_t min_path_cost = COST_INFINITY;
+    const link_state_t *own = state->ls[current];
 
-                j = n;
-                while (1) {
-                    j = path[j];
-                    if (j == current_node) break;
+    for (int j = 0; j < span; j++) {
+        state->distances[j] = state->own_costs[j] = COST_INFINITY;
+        state->parent[j] = current;
+        state->first_child[j] = -1;
+    }
+    for (int l = 0; l < own->n_links; l++)
+        state->own_costs[own->links[l].neighbor - get_first_node()] = own->links[l].cost;
+    state->distances[current] = state->own_costs[current] = 0;
+    heap_push(state, current);
+
+    while (state->heap_size) {
+        int node = heap_pop(state).node;
+        if (state->flags[node] & CHECKED)
+            continue;
+        state->flags[node] |= CHECKED;
+        order[n_settled++] = node;
+
+        const link_state_t *ls = state->ls[node];
+        for (int l = 0; ls && l < ls->n_links; l++) {
+            int j = ls->links[l].neighbor - get_first_node();
+            cost_t cost = COST_ADD(state->distances[node], ls->links[l].cost);
+            if (!(state->flags[j] & CHECKED) && cost < state->distances[j]) {
+                state->distances[j] = cost;
+                state->parent[j] = node;
+                heap_push(state, j);
+            }
+        }
+    }
+
+    for (int j = 0; j < span; j++) {
+        state->flags[j] = 0;
+        if (j != current)
+            link_child(state, j, state->parent[j]);
+        if (state->distances[j] == COST_INFINITY)
+            order[n_settled++] = j;
+    }
+    // Parents come first in settling order, and unreachable nodes last.
+    for (int i = 1; i < n_settled; i++)
+        set_hop(state, current, order[i]);
+    for (int j = 0; j < span; j++)
+        update_route(state, current, j);
+}
 
-                    if (state->ls[current_node].link_cost[j] < min_path_cost) {
-                        min_path_cost = state->ls[current_node].link_cost[j];
-                        min_path_link = j;
-                    }
+// Update the tree after the link state of origin changed from old_costs, and
+// recompute only the part of it below changed links: the subtrees that lost
+// their paths to links that got more expensive, nodes that got nearer over
+// links that got cheaper, and the hops below the nodes whose parent changed.
+static void update_routes(state_t *state, node_t current_node, int origin, const cost_t *old_costs) {
+    node_t first = get_first_node();
+    int current = current_node - first;
+    const link_state_t *ls = state->ls[origin];
+    int n_touched = 0, n_checked = 0, n_rehopped = 0;
+    unsigned char *flags = state->flags;
+
+    // Orphan the subtrees below tree links that got more expensive.
+    for (int l = 0; l < ls->n_links; l++) {
+        int v = ls->links[l].neighbor - first;
+        if (ls->links[l].cost > old_costs[l] && state->parent[v] == origin &&
+            state->distances[v] != COST_INFINITY && !(flags[v] & ORPHANED)) {
+            int begin = n_touched;
+            flags[v] |= ORPHANED | TOUCHED;
+            state->touched[n_touched++] = v;
+            for (int i = begin; i < n_touched; i++) {
+                int node = state->touched[i];
+                state->distances[node] = COST_INFINITY;
+                for (int c = state->first_child[node]; c >= 0; c = state->next_sibling[c]) {
+                    flags[c] |= ORPHANED | TOUCHED;
+                    state->touched[n_touched++] = c;
                 }
+            }
+        }
+    }
+
+    // Orphans start from their best link into the rest of the tree.
+    for (int i = 0; i < n_touched; i++) {
+        int node = state->touched[i];
+        const in_links_t *in = &state->in_links[node];
+        for (int k = 0; k < in->n; k++) {
+            int from = in->links[k].from;
+            cost_t cost = COST_ADD(state->distances[from], *in->links[k].cost);
+            if (!(flags[from] & ORPHANED) && cost < state->distances[node])
+                state->distances[node] = cost;
+        }
+        if (state->distances[node] != COST_INFINITY)
+            heap_push(state, node);
+    }
+
+    // Links that got cheaper. An orphaned origin relaxes its links once it
+    // is back in the tree.
+    for (int l = 0; l < ls->n_links; l++) {
+        int v = ls->links[l].neighbor - first;
+        cost_t cost = COST_ADD(state->distances[origin], ls->links[l].cost);
+        if (ls->links[l].cost < old_costs[l] && !(flags[origin] & ORPHANED) &&
+            cost < state->distances[v]) {
+            state->distances[v] = cost;
+            if (!(flags[v] & TOUCHED)) {
+                flags[v] |= TOUCHED;
+                state->touched[n_touched++] = v;
+            }
+            heap_push(state, v);
+        }
+    }
+
+    while (state->heap_size) {
+        heap_entry_t entry = heap_pop(state);
+        if (entry.distance == state->distances[entry.node])
+            n_touched = relax(state, entry.node, n_touched);
+    }
+
+    // Parents can change where distances did, on the links out of those
+    // nodes, and on the changed links themselves.
+    for (int i = 0; i < n_touched; i++) {
+        int node = state->touched[i];
+        const link_state_t *out = state->ls[node];
+        n_checked = check_parent(state, current, node, n_checked);
+        for (int l = 0; out && l < out->n_links; l++)
+            n_checked = check_parent(state, current, out->links[l].neighbor - first, n_checked);
+    }
+    for (int l = 0; l < ls->n_links; l++)
+        if (ls->links[l].cost != old_costs[l])
+            n_checked = check_parent(state, current, ls->links[l].neighbor - first, n_checked);
+
+    // Own link costs pick the hops.
+    if (origin == current) {
+        for (int l = 0; l < ls->n_links; l++) {
+            int v = ls->links[l].neighbor - first;
+            if (ls->links[l].cost != old_costs[l]) {
+                state->own_costs[v] = ls->links[l].cost;
+                heap_push(state, v);
+            }
+        }
+    }
 
-                set_route(n, min_path_link, distances[n]);
+    // Recompute the hops below the nodes left on the heap, parents first,
+    // as they settle first.
+    while (state->heap_size) {
+        int root = heap_pop(state).node;
+        if (flags[root] & REHOPPED)
+            continue;
+        int begin = n_rehopped;
+        flags[root] |= REHOPPED;
+        state->rehopped[n_rehopped++] = root;
+        for (int i = begin; i < n_rehopped; i++) {
+            int node = state->rehopped[i];
+            set_hop(state, current, node);
+            for (int c = state->first_child[node]; c >= 0; c = state->next_sibling[c]) {
+                flags[c] |= REHOPPED;
+                state->rehopped[n_rehopped++] = c;
+            }
+        }
+    }
+
+    for (int i = 0; i < n_touched; i++)
+        update_route(state, current, state->touched[i]);
+    for (int i = 0; i < n_rehopped; i++)
+        update_route(state, current, state->rehopped[i]);
+
+    for (int i = 0; i < n_touched; i++)
+        flags[state->touched[i]] = 0;
+    for (int i = 0; i < n_checked; i++)
+        flags[state->checked[i]] = 0;
+    for (int i = 0; i < n_rehopped; i++)
+        flags[state->rehopped[i]] = 0;
+}
 
-            } else {
-                set_route(n, n, distances[n]);
+// Replace the link state of a node, which keeps the same number of links.
+// Saves the old costs in old_costs, all infinite for a new origin, and
+// returns whether there were or are links of cost 0.
+static int store_ls(state_t *state, const link_state_t *ls) {
+    node_t first = get_first_node();
+    int origin = ls->origin - first;
+    link_state_t **slot = &state->ls[origin];
+    size_t size = LINK_STATE_SIZE(ls->n_links);
+
+    if (ls->n_links > state->old_capacity) {
+        cost_t *old_costs = (cost_t *) realloc(state->old_costs, ls->n_links * sizeof(cost_t));
+        if (!old_costs)
+            out_of_memory("link costs");
+        state->old_costs = old_costs;
+        state->old_capacity = ls->n_links;
+    }
+    int zero_links = state->zero_links;
+    for (int l = 0; l < ls->n_links; l++) {
+        state->old_costs[l] = *slot ? (*slot)->links[l].cost : COST_INFINITY;
+        state->zero_links += (ls->links[l].cost == 0) - (state->old_costs[l] == 0);
+    }
+
+    if (!*slot) {
+        *slot = (link_state_t *) malloc(size);
+        for (int l = 0; l < ls->n_links; l++) {
+            in_links_t *in = &state->in_links[ls->links[l].neighbor - first];
+            if (in->n == in->capacity) {
+                int capacity = in->capacity ? 2 * in->capacity : 4;
+                in_link_t *links = (in_link_t *) realloc(in->links, capacity * sizeof(in_link_t));
+                if (!links)
+                    out_of_memory("incoming links");
+                in->links = links;
+                in->capacity = capacity;
             }
+            in->links[in->n].from = origin;
+            in->links[in->n++].cost = &(*slot)->links[l].cost;
         }
     }
+    memcpy(*slot, ls, size);
+    state->stored_at[origin] = ++state->n_stored;
+    return zero_links || state->zero_links;
+}
+
+// The state block, with the link states and lists it owns.
+static void free_state(void *s) {
+    state_t *state = (state_t *) s;
+
+    for (int n = 0; n < state->span; n++) {
+        free(state->ls[n]);
+        free(state->in_links[n].links);
+    }
+    free(state->old_costs);
+    free(state->heap);
+    free(state);
 }
 
 // Notify a node that a neighboring link has changed cost.
 void notify_link_change(node_t neighbor, cost_t new_cost) {
     int current_node = get_current_node();
+    int current = current_node - get_first_node();
     state_t *state = (state_t *) get_state();
 
     if (!state) { // initial state
-        state = (state_t *) malloc(sizeof(state_t));
+        int span = get_last_node() - get_first_node() + 1;
+
+        // One block: the state, then its fixed size arrays.
+        state = (state_t *) malloc(sizeof(state_t) + 2 * span * sizeof(link_state_t *) +
+                                   span * sizeof(in_links_t) + 2 * span * sizeof(unsigned long) +
+                                   3 * span * sizeof(cost_t) +
+                                   10 * span * sizeof(int) + span);
+        set_state_destructor(free_state);
         set_state(state);
-        for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-            for (node_t j = get_first_node(); j <= get_last_node(); j++) {
-                if (!(j == current_node && n == current_node)) {
-                    state->ls[n].link_cost[j] = COST_INFINITY;
-                }
-            }
+        state->span = span;
+        state->ls = (link_state_t **) (state + 1);
+        state->fresh = state->ls + span;
+        state->in_links = (in_links_t *) (state->fresh + span);
+        state->stored_at = (unsigned long *) (state->in_links + span);
+        state->up_at = state->stored_at + span;
+        state->distances = (cost_t *) (state->up_at + span);
+        state->own_costs = state->distances + span;
+        state->route_costs = state->own_costs + span;
+        state->down = (node_t *) (state->route_costs + span);
+        state->parent = state->down + span;
+        state->first_child = state->parent + span;
+        state->next_sibling = state->first_child + span;
+        state->prev_sibling = state->next_sibling + span;
+        state->hop = state->prev_sibling + span;
+        state->route_hops = state->hop + span;
+        state->touched = state->route_hops + span;
+        state->checked = state->touched + span;
+        state->rehopped = state->checked + span;
+        state->flags = (unsigned char *) (state->rehopped + span);
+        state->old_costs = NULL;
+        state->old_capacity = 0;
+        state->zero_links = 0;
+        state->n_stored = 0;
+        state->heap_size = 0;
+        state->heap_capacity = span;
+        state->heap = (heap_entry_t *) malloc(span * sizeof(heap_entry_t));
+        for (int n = 0; n < span; n++) {
+            state->ls[n] = NULL;
+            state->in_links[n].n = state->in_links[n].capacity = 0;
+            state->in_links[n].links = NULL;
+            state->stored_at[n] = state->up_at[n] = 0;
+            state->distances[n] = state->own_costs[n] = state->route_costs[n] = COST_INFINITY;
+            state->first_child[n] = state->hop[n] = state->route_hops[n] = -1;
+            state->flags[n] = 0;
+        }
+        state->distances[current] = state->own_costs[current] = 0;
+        state->parent[current] = current;
+        for (int n = 0; n < span; n++)
+            if (n != current)
+                link_child(state, n, current);
+
+        // Own link state, every link down.
+        const node_t *neighbors;
+        int n_links = get_neighbors(&neighbors);
+        link_state_t *own = (link_state_t *) malloc(LINK_STATE_SIZE(n_links));
+        own->origin = current_node;
+        own->version = 0;
+        own->n_links = n_links;
+        for (int l = 0; l < n_links; l++) {
+            own->links[l].neighbor = neighbors[l];
+            own->links[l].cost = COST_INFINITY;
         }
-        state->ls[current_node].version = 0;
+        store_ls(state, own);
+        free(own);
     }
 
-    state->ls[current_node].version++;
-    state->ls[current_node].link_cost[neighbor] = new_cost;
+    link_state_t *own = state->ls[current];
+    cost_t old_cost = COST_INFINITY;
+    int zero_links = state->zero_links;
+    own->version++;
+    for (int l = 0; l < own->n_links; l++) {
+        state->old_costs[l] = own->links[l].cost;
+        if (own->links[l].neighbor == neighbor) {
+            old_cost = own->links[l].cost;
+            own->links[l].cost = new_cost;
+        }
+    }
+    state->zero_links += (new_cost == 0) - (old_cost == 0);
 
-    find_routes(state, current_node);
-    send_msg(state, current_node);
+    if (zero_links || state->zero_links)
+        find_routes(state, current_node);
+    else
+        update_routes(state, current_node, current, state->old_costs);
+
+    // A new neighbor gets the own link state with the flood, ahead of the
+    // summary that lists it.
+    flood(state, current_node, &own, 1, LINK_STATE_SIZE(own->n_links), -1);
+    if (old_cost == COST_INFINITY && new_cost != COST_INFINITY) {
+        state->up_at[neighbor - get_first_node()] = state->n_stored;
+        if (current_node < neighbor)
+            send_summary(state, neighbor);
+    }
 }
 
+// More link states than this in one message, as after a database exchange,
+// and a full Dijkstra is cheaper than updating for each.
+#define MAX_UPDATES 4
+
 // Receive a message sent by a neighboring node.
 void notify_receive_message(node_t sender, void *message) {
-    int current_node = get_current_node(), latest_version = 0;
+    int current_node = get_current_node(), n_fresh = 0, full = 0;
     state_t *state = (state_t *) get_state();
     message_t *m = (message_t *) message;
+    size_t fresh_size = 0;
+
+    if (m->kind != LS_UPDATE) {
+        // Sent before the link went down: the exchange starts over once it
+        // is back up.
+        if (get_link_cost(sender) == COST_INFINITY)
+            return;
+        if (m->kind == LS_SUMMARY)
+            answer_summary(state, current_node, sender, m);
+        else
+            answer_request(state, sender, m);
+        return;
+    }
 
-    for (node_t j = get_first_node(); j <= get_last_node(); j++) {
-        if (state->ls[j].version < m->ls[j].version) {
-
-            latest_version = 1;
-            state->ls[j].version = m->ls[j].version;
-
-            for (node_t n = get_first_node(); n <= get_last_node(); n++)
-                state->ls[j].link_cost[n] = m->ls[j].link_cost[n];
+    const link_state_t *ls = (const link_state_t *) m->ls;
+    for (int i = 0; i < m->n_ls; i++, ls = next_ls(ls)) {
+        const link_state_t *known = state->ls[ls->origin - get_first_node()];
+        if (!known || known->version < ls->version) {
+
+            int origin = ls->origin - get_first_node();
+            full |= store_ls(state, ls) || n_fresh == MAX_UPDATES;
+            state->fresh[n_fresh++] = state->ls[origin];
+            fresh_size += LINK_STATE_SIZE(ls->n_links);
+            if (!full)
+                update_routes(state, current_node, origin, state->old_costs);
         }
     }
 
-    if (latest_version) { // Recent version
+    if (n_fresh) { // Recent versions, passed on to the other neighbors
 
-        find_routes(state, current_node);
-        send_msg(state, current_node);
+        if (full)
+            find_routes(state, current_node);
+        flood(state, current_node, state->fresh, n_fresh, fresh_size, sender);
 
     }
 }
@@ -0,0 +1,145 @@
+/******************************************************************************\
+* Min-plus relaxation kernel for the distance vector routers.                  *
+\******************************************************************************/
+
+#include "min-plus.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIN_PLUS_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define MIN_PLUS_NEON
+#include <arm_neon.h>
+#endif
+
+static void min_plus_scalar(cost_t *best, const cost_t *row, cost_t cost, int n) {
+    for (int x = 0; x < n; x++) {
+        cost_t sum = COST_ADD(cost, row[x]);
+        if (sum < best[x])
+            best[x] = sum;
+    }
+}
+
+#ifdef MIN_PLUS_X86
+
+// Saturating adds and unsigned mins over cost_t lanes. Saturating at
+// COST_INFINITY is exactly COST_ADD(). SSE2 has no unsigned 16 or 32 bit
+// min nor 32 bit saturating add, so those are built from subtractions and
+// compares with the sign bit flipped; AVX2 lacks the 32 bit add too.
+#if COST_BITS == 8
+#define SET1_SSE2(c) _mm_set1_epi8((char) (c))
+#define ADDS_SSE2(a, b) _mm_adds_epu8(a, b)
+#define MIN_SSE2(a, b) _mm_min_epu8(a, b)
+#define SET1_AVX2(c) _mm256_set1_epi8((char) (c))
+#define ADDS_AVX2(a, b) _mm256_adds_epu8(a, b)
+#define MIN_AVX2(a, b) _mm256_min_epu8(a, b)
+#elif COST_BITS == 16
+#define SET1_SSE2(c) _mm_set1_epi16((short) (c))
+#define ADDS_SSE2(a, b) _mm_adds_epu16(a, b)
+#define MIN_SSE2(a, b) _mm_sub_epi16(a, _mm_subs_epu16(a, b))
+#define SET1_AVX2(c) _mm256_set1_epi16((short) (c))
+#define ADDS_AVX2(a, b) _mm256_adds_epu16(a, b)
+#define MIN_AVX2(a, b) _mm256_min_epu16(a, b)
+#else
+__attribute__((target("sse2")))
+static __m128i above_sse2(__m128i a, __m128i b) {
+    __m128i sign = _mm_set1_epi32((int) 0x80000000);
+    return _mm_cmpgt_epi32(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+}
+
+__attribute__((target("sse2")))
+static __m128i adds_sse2(__m128i a, __m128i b) {
+    __m128i sum = _mm_add_epi32(a, b);
+    return _mm_or_si128(sum, above_sse2(a, sum)); // All ones if it wrapped.
+}
+
+__attribute__((target("sse2")))
+static __m128i min_sse2(__m128i a, __m128i b) {
+    __m128i a_above = above_sse2(a, b);
+    return _mm_or_si128(_mm_and_si128(a_above, b), _mm_andnot_si128(a_above, a));
+}
+
+__attribute__((target("avx2")))
+static __m256i adds_avx2(__m256i a, __m256i b) {
+    __m256i sum = _mm256_add_epi32(a, b);
+    __m256i kept = _mm256_cmpeq_epi32(_mm256_max_epu32(sum, a), sum);
+    return _mm256_or_si256(sum, _mm256_xor_si256(kept, _mm256_set1_epi32(-1)));
+}
+
+#define SET1_SSE2(c) _mm_set1_epi32((int) (c))
+#define ADDS_SSE2(a, b) adds_sse2(a, b)
+#define MIN_SSE2(a, b) min_sse2(a, b)
+#define SET1_AVX2(c) _mm256_set1_epi32((int) (c))
+#define ADDS_AVX2(a, b) adds_avx2(a, b)
+#define MIN_AVX2(a, b) _mm256_min_epu32(a, b)
+#endif
+
+__attribute__((target("sse2")))
+static void min_plus_sse2(cost_t *best, const cost_t *row, cost_t cost, int n) {
+    const int lanes = sizeof(__m128i) / sizeof(cost_t);
+    __m128i costs = SET1_SSE2(cost);
+    int x = 0;
+
+    for (; x + lanes <= n; x += lanes) {
+        __m128i sum = ADDS_SSE2(costs, _mm_loadu_si128((const __m128i *) (row + x)));
+        __m128i *out = (__m128i *) (best + x);
+        _mm_storeu_si128(out, MIN_SSE2(_mm_loadu_si128(out), sum));
+    }
+    min_plus_scalar(best + x, row + x, cost, n - x);
+}
+
+__attribute__((target("avx2")))
+static void min_plus_avx2(cost_t *best, const cost_t *row, cost_t cost, int n) {
+    const int lanes = sizeof(__m256i) / sizeof(cost_t);
+    __m256i costs = SET1_AVX2(cost);
+    int x = 0;
+
+    for (; x + lanes <= n; x += lanes) {
+        __m256i sum = ADDS_AVX2(costs, _mm256_loadu_si256((const __m256i *) (row + x)));
+        __m256i *out = (__m256i *) (best + x);
+        _mm256_storeu_si256(out, MIN_AVX2(_mm256_loadu_si256(out), sum));
+    }
+    min_plus_scalar(best + x, row + x, cost, n - x);
+}
+
+#endif
+
+#ifdef MIN_PLUS_NEON
+
+// NEON has saturating adds and unsigned mins at every cost width.
+#if COST_BITS == 8
+#define NEON(op) op##_u8
+#elif COST_BITS == 16
+#define NEON(op) op##_u16
+#else
+#define NEON(op) op##_u32
+#endif
+
+static void min_plus_neon(cost_t *best, const cost_t *row, cost_t cost, int n) {
+    const int lanes = 16 / sizeof(cost_t);
+    int x = 0;
+
+    for (; x + lanes <= n; x += lanes) {
+        NEON(vst1q)(best + x, NEON(vminq)(NEON(vld1q)(best + x),
+                                          NEON(vqaddq)(NEON(vdupq_n)(cost),
+                                                       NEON(vld1q)(row + x))));
+    }
+    min_plus_scalar(best + x, row + x, cost, n - x);
+}
+
+#endif
+
+void min_plus(cost_t *best, const cost_t *row, cost_t cost, int n) {
+#if defined(MIN_PLUS_X86)
+    if (__builtin_cpu_supports("avx2"))
+        min_plus_avx2(best, row, cost, n);
+    else if (__builtin_cpu_supports("sse2"))
+        min_plus_sse2(best, row, cost, n);
+    else
+        min_plus_scalar(best, row, cost, n);
+#elif defined(MIN_PLUS_NEON)
+    min_plus_neon(best, row, cost, n);
+#else
+    min_plus_scalar(best, row, cost, n);
+#endif
+}
@@ -0,0 +1,11 @@
+/******************************************************************************\
+* Min-plus relaxation kernel for the distance vector routers.                  *
+\******************************************************************************/
+
+#include "routing-simulator.h"
+
+// Relax best over one neighbor's distance vector row, reached at cost:
+// best[x] = min(best[x], COST_ADD(cost, row[x])) for x from 0 to n - 1.
+// Runs on AVX2 or SSE2, whichever the CPU has, on x86, on NEON on ARM64, and
+// in plain C elsewhere.
+void min_plus(cost_t *best, const cost_t *row, cost_t cost, int n);
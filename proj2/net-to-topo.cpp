@@ -0,0 +1,84 @@
+/******************************************************************************\
+* Convert a text topology (.net) into the binary format the simulators also    *
+* load, sorted by time so that they can stream it.                             *
+\******************************************************************************/
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "topology-format.h"
+
+static void show_usage(std::string command) {
+  std::cerr                                                         //
+      << "Usage: " << command                                       //
+      << " [--help]"                                                //
+      << " [--] <topology-file> <binary-topology-file>" << std::endl //
+      << std::endl                                                  //
+      << " --help                    "                              //
+      << "- Show this help screen."                                 //
+      << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments.
+  std::vector<std::string> file_names;
+  bool positional_mode = false;
+
+  for (int a = 1; a < argc; ++a) {
+    std::string arg = argv[a];
+    if (arg == "--help") {
+      show_usage(argv[0]);
+    } else if (arg == "--") {
+      positional_mode = true;
+    } else {
+      if ((arg.rfind("-", 0) == 0 && !positional_mode) ||
+          file_names.size() == 2) {
+        std::cerr << "Unknown option: " << arg << std::endl;
+        show_usage(argv[0]);
+      }
+      file_names.push_back(arg);
+    }
+  }
+
+  if (file_names.size() != 2) {
+    show_usage(argv[0]);
+  }
+  topology_t topology;
+  if (!open_topology(file_names[0], topology)) {
+    std::cerr << "Error opening topology file: " << file_names[0] << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<topology_line_t> lines;
+  topology_line_t line;
+  topology_read_t read = TOPOLOGY_ERROR;
+  if (scan_topology(topology)) {
+    while ((read = read_topology_line(topology, line)) == TOPOLOGY_LINE) {
+      lines.push_back(line);
+    }
+  }
+  if (read == TOPOLOGY_ERROR) {
+    std::cerr << "Syntax error in topology file." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  // Lines with the same time keep their order, and so do their events.
+  std::stable_sort(lines.begin(), lines.end(),
+                   [](const topology_line_t &a, const topology_line_t &b) {
+                     return a.time < b.time;
+                   });
+
+  std::ofstream output(file_names[1], std::ios::binary);
+  if (!output.is_open()) {
+    std::cerr << "Error opening output file: " << file_names[1] << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  write_binary_topology(output, topology, lines);
+  output.close();
+  if (output.fail()) {
+    std::cerr << "Error writing output file: " << file_names[1] << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
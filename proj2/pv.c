@@ -4,72 +4,229 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
 
 #include "routing-simulator.h"
 
-#define min(a, b) (int) a < (int) b ? a:b
+// A route as advertised: its cost and the whole path, from the advertiser
+// to the destination. A node drops any route whose path has it already, so
+// a loop is cut after one exchange instead of counting up to infinity.
+typedef struct {
+    node_t destination;
+    cost_t cost;        // COST_INFINITY withdraws the route.
+    int length;         // Nodes on the path, 0 for a withdrawal.
+    node_t path[];
+} advert_t;
+
+#define ADVERT_SIZE(length) (sizeof(advert_t) + (length) * sizeof(node_t))
 
-// Message format to send between nodes.
+// Message format to send between nodes: adverts, back to back. Updates
+// carry the routes that changed since the last one; a new adjacency gets the
+// whole table once.
 typedef struct {
-    cost_t vector_cost[MAX_NODES];
+    int n_adverts;
+    char adverts[];
 } message_t;
 
-// State format.
+// A route a neighbor advertised, path from the neighbor.
+typedef struct {
+    cost_t cost;
+    int length, capacity;
+    node_t *path;
+} route_t;
+
+// State format. Per node arrays are indexed by node - get_first_node().
 typedef struct {
-    cost_t distances[MAX_NODES][MAX_NODES];
-    node_t next_hop[MAX_NODES];
+    int span;
+    int n_neighbors;
+    const node_t *neighbors;
+    route_t *routes;     // [neighbor index][node] -> last advertised route.
+    cost_t *link_costs;  // [neighbor index] -> current link cost.
+    cost_t *distances;   // Own cost to each node.
+    int *via;            // Neighbor index of the route, -1 for none.
+    unsigned char *changed; // Routes to advertise in the next update,
+    int n_changed;          // and their count.
+    unsigned char *resync;  // Neighbors that get the whole table next.
+    int n_resync;
+    hold_down_t hold_down;
 } state_t;
 
 
-// Send messages from current_node to all neighbors
+static int neighbor_index(const state_t *state, node_t neighbor) {
+    int low = 0, high = state->n_neighbors;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (state->neighbors[mid] < neighbor) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    assert(low < state->n_neighbors && state->neighbors[low] == neighbor);
+    return low;
+}
+
+static route_t *neighbor_route(const state_t *state, int k, int x) {
+    return &state->routes[(size_t) k * state->span + x];
+}
+
+static void set_neighbor_route(route_t *route, cost_t cost, const node_t *path,
+                               int length) {
+    if (length > route->capacity) {
+        node_t *grown = (node_t *) realloc(route->path, length * sizeof(node_t));
+        if (!grown) {
+            fprintf(stderr, "Out of memory for paths.\n");
+            exit(EXIT_FAILURE);
+        }
+        route->path = grown;
+        route->capacity = length;
+    }
+    route->cost = cost;
+    route->length = length;
+    memcpy(route->path, path, length * sizeof(node_t));
+}
+
+static void mark_changed(state_t *state, int x) {
+    if (!state->changed[x]) {
+        state->changed[x] = 1;
+        state->n_changed++;
+    }
+}
+
+// Own route to node x, through the neighbor the route goes via.
+static size_t advert_size(const state_t *state, int x) {
+    int k = state->via[x];
+    return ADVERT_SIZE(k < 0 ? 0 : 1 + neighbor_route(state, k, x)->length);
+}
+
+static char *put_advert(const state_t *state, node_t current_node, int x,
+                        char *next) {
+    advert_t *advert = (advert_t *) next;
+    int k = state->via[x];
+
+    advert->destination = get_first_node() + x;
+    advert->cost = state->distances[x];
+    advert->length = 0;
+    if (k >= 0) {
+        const route_t *route = neighbor_route(state, k, x);
+        advert->path[0] = current_node;
+        memcpy(advert->path + 1, route->path, route->length * sizeof(node_t));
+        advert->length = 1 + route->length;
+    }
+    return next + ADVERT_SIZE(advert->length);
+}
+
+// Send the changed routes to every neighbor whose link is up, and the whole
+// table to new adjacencies.
 void send_msg(state_t *state, node_t current_node) {
-    for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-        if (n != current_node && get_link_cost(n) != COST_INFINITY) {
-            message_t *nm = (message_t *) malloc(sizeof(message_t));
-            for (node_t x = get_first_node(); x <= get_last_node(); x++) {
-                if (state->next_hop[x] == n) {
-                    nm->vector_cost[x] = COST_INFINITY;
-                } else {
-                    nm->vector_cost[x] = state->distances[current_node][x];
-                }
-            }
-            send_message(n, nm);
+    int current = current_node - get_first_node();
+    size_t changed_size = 0, table_size = 0;
+    int n_table = 0;
+
+    for (int x = 0; x < state->span; x++) {
+        if (state->changed[x])
+            changed_size += advert_size(state, x);
+        if (state->via[x] >= 0) {
+            table_size += advert_size(state, x);
+            n_table++;
         }
     }
+
+    for (int k = 0; k < state->n_neighbors; k++) {
+        if (state->link_costs[k] == COST_INFINITY)
+            continue;
+        int full = state->resync[k];
+        int n_adverts = full ? n_table : state->n_changed;
+        if (n_adverts == 0)
+            continue;
+
+        message_t *nm = (message_t *) alloc_message(
+            sizeof(message_t) + (full ? table_size : changed_size));
+        char *next = nm->adverts;
+        nm->n_adverts = n_adverts;
+        for (int x = 0; x < state->span; x++)
+            if (x != current && (full ? state->via[x] >= 0 : state->changed[x]))
+                next = put_advert(state, current_node, x, next);
+        send_message(state->neighbors[k], nm);
+    }
+
+    memset(state->changed, 0, state->span);
+    memset(state->resync, 0, state->n_neighbors);
+    state->n_changed = state->n_resync = 0;
 }
 
-// Check if there are new routes w Bellman-Ford
-void find_routes(state_t *state, node_t current_node){
-    for (node_t adj = get_first_node(); adj <= get_last_node(); adj++) {
-        if (adj != current_node) {
+static void send_current(void *state) {
+    send_msg((state_t *) state, get_current_node());
+}
 
-            cost_t min_cost = get_link_cost(adj);
-            cost_t temp_min = get_link_cost(adj);
-            node_t temp_neighbor = adj;
+// Send the changed routes, see hold_down_send().
+void send_update(state_t *state, node_t current_node) {
+    hold_down_send(&state->hold_down, send_current, state);
+}
 
-            for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-                if (n != adj && n != current_node && get_link_cost(n) != COST_INFINITY) {
+// Pick the cheapest route to node x among those the neighbors advertised,
+// the direct link on a tie, else the first neighbor. Marks it for the next
+// update if it changed.
+static void find_route(state_t *state, int x) {
+    node_t first = get_first_node();
+    cost_t best = COST_INFINITY;
+    int via = -1;
 
-                    min_cost = min(get_link_cost(n) + state->distances[n][adj], min_cost);
+    for (int k = 0; k < state->n_neighbors; k++) {
+        const route_t *route = neighbor_route(state, k, x);
+        cost_t cost = COST_ADD(state->link_costs[k], route->cost);
+        if (cost < best ||
+            (cost == best && cost != COST_INFINITY && state->neighbors[k] == first + x)) {
+            best = cost;
+            via = k;
+        }
+    }
 
-                    if (temp_min > min_cost) {
-                        temp_neighbor = n;
-                        temp_min = min_cost;
-                    }
-                }
-            }
+    if (best != state->distances[x] || via != state->via[x]) {
+        set_route(first + x, via < 0 ? first + x : state->neighbors[via], best);
+        state->distances[x] = best;
+        state->via[x] = via;
+        mark_changed(state, x);
+    }
+}
 
-            if (min_cost != state->distances[current_node][adj]) {
-                set_route(adj, temp_neighbor, min_cost);
+// Check every route after the link costs changed. A link that went down
+// takes the routes of that neighbor with it, and one that came up gets the
+// whole table.
+void find_routes(state_t *state, node_t current_node) {
+    int current = current_node - get_first_node();
 
-                state->distances[current_node][adj] = min_cost;
-                state->distances[adj][current_node] = min_cost;
-                state->next_hop[adj] = temp_neighbor;
+    for (int k = 0; k < state->n_neighbors; k++) {
+        cost_t old_cost = state->link_costs[k];
+        cost_t cost = get_link_cost(state->neighbors[k]);
+        int neighbor = state->neighbors[k] - get_first_node();
 
-                send_msg(state, current_node);
-            }
+        state->link_costs[k] = cost;
+        if (cost == COST_INFINITY && old_cost != COST_INFINITY) {
+            for (int x = 0; x < state->span; x++)
+                if (x != neighbor)
+                    neighbor_route(state, k, x)->cost = COST_INFINITY;
+        } else if (cost != COST_INFINITY && old_cost == COST_INFINITY &&
+                   !state->resync[k]) {
+            state->resync[k] = 1;
+            state->n_resync++;
         }
     }
+    for (int x = 0; x < state->span; x++)
+        if (x != current)
+            find_route(state, x);
+
+    if (state->n_changed > 0 || state->n_resync > 0)
+        send_update(state, current_node);
+}
+
+static void free_state(void *s) {
+    state_t *state = (state_t *) s;
+
+    for (size_t i = 0; i < (size_t) state->span * state->n_neighbors; i++)
+        free(state->routes[i].path);
+    free(state);
 }
 
 // Notify a node that a neighboring link has changed cost.
@@ -78,16 +235,44 @@ void notify_link_change(node_t neighbor, cost_t new_cost) {
     state_t *state = (state_t *) get_state();
 
     if(!state) { // initial state
-        state = (state_t *) malloc(sizeof(state_t));
-        set_state(state);
+        node_t first = get_first_node();
+        int span = get_last_node() - first + 1;
+        const node_t *neighbors;
+        int n_neighbors = get_neighbors(&neighbors);
+        size_t n_routes = (size_t) span * n_neighbors;
 
-        for (node_t n = get_first_node(); n <= get_last_node(); n++) {
-            for (node_t j = get_first_node(); j <= get_last_node(); j++)
-                if (!(j == current_node && n == current_node))
-                    state->distances[n][j] = COST_INFINITY;
+        // One block: the state, then its arrays, widest first.
+        state = (state_t *) calloc(1, sizeof(state_t) +
+                                      n_routes * sizeof(route_t) +
+                                      span * sizeof(int) +
+                                      (span + n_neighbors) * sizeof(cost_t) +
+                                      span + n_neighbors);
+        set_state_destructor(free_state);
+        set_state(state);
+        state->span = span;
+        state->n_neighbors = n_neighbors;
+        state->neighbors = neighbors;
+        state->routes = (route_t *) (state + 1);
+        state->via = (int *) (state->routes + n_routes);
+        state->distances = (cost_t *) (state->via + span);
+        state->link_costs = state->distances + span;
+        state->changed = (unsigned char *) (state->link_costs + n_neighbors);
+        state->resync = state->changed + span;
 
-            state->next_hop[n] = COST_INFINITY;
+        for (size_t i = 0; i < n_routes; i++)
+            state->routes[i].cost = COST_INFINITY;
+        for (int n = 0; n < span; n++) {
+            state->distances[n] = COST_INFINITY;
+            state->via[n] = -1;
         }
+        for (int k = 0; k < n_neighbors; k++)
+            state->link_costs[k] = COST_INFINITY;
+        state->distances[current_node - first] = 0;
+
+        // Each neighbor is a route to itself, over the link alone.
+        for (int k = 0; k < n_neighbors; k++)
+            set_neighbor_route(neighbor_route(state, k, neighbors[k] - first), 0,
+                               &neighbors[k], 1);
     }
 
     find_routes(state, current_node);
@@ -97,11 +282,51 @@ void notify_link_change(node_t neighbor, cost_t new_cost) {
 void notify_receive_message(node_t sender, void *message) {
     int current_node = get_current_node();
     state_t *state = (state_t *) get_state();
-    message_t *m = (message_t *) message;
+    const message_t *m = (const message_t *) message;
+    int k = neighbor_index(state, sender);
+    node_t first = get_first_node();
 
-    for (node_t j = get_first_node(); j <= get_last_node(); j++)
-        if (j != sender)
-            state->distances[sender][j] = m->vector_cost[j];
+    // Sent before the link went down: the whole table comes again once it
+    // is back up.
+    if (state->link_costs[k] == COST_INFINITY)
+        return;
 
-    find_routes(state, current_node);
+    const char *next = m->adverts;
+    for (int i = 0; i < m->n_adverts; i++) {
+        const advert_t *advert = (const advert_t *) next;
+        next += ADVERT_SIZE(advert->length);
+        int x = advert->destination - first;
+        route_t *route = neighbor_route(state, k, x);
+
+        cost_t cost = advert->cost;
+        for (int p = 0; p < advert->length && cost != COST_INFINITY; p++)
+            if (advert->path[p] == current_node)
+                cost = COST_INFINITY; // A loop back through us.
+        if (cost == COST_INFINITY) {
+            if (route->cost == COST_INFINITY)
+                continue;
+            route->cost = COST_INFINITY;
+        } else if (route->cost == cost && route->length == advert->length &&
+                   memcmp(route->path, advert->path,
+                          advert->length * sizeof(node_t)) == 0) {
+            continue; // Nothing new.
+        } else {
+            set_neighbor_route(route, cost, advert->path, advert->length);
+        }
+
+        find_route(state, x);
+        // The path changed even if the cost did not.
+        if (state->via[x] == k)
+            mark_changed(state, x);
+    }
+
+    if (state->n_changed > 0)
+        send_update(state, current_node);
+}
+
+// The hold down is over: send the changes made during it, if any.
+void notify_timer() {
+    state_t *state = (state_t *) get_state();
+
+    hold_down_over(&state->hold_down, send_current, state);
 }
@@ -5,17 +5,32 @@
 * This file will be overwritten during grading.                                *
 \******************************************************************************/
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 #include <map>
-#include <set>
-#include <sstream>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include "routing-simulator.h"
+#include "topology-format.h"
+#include "trace-format.h"
 
 // Initial set of node colors. Subsequent colors chosen randomly.
-static std::map<node_t, std::string> colors = {
+static const std::map<node_t, std::string> initial_colors = {
     {0, "/set19/1"}, {1, "/set19/2"}, {2, "/set19/3"},
     {3, "/set19/4"}, {4, "/set19/5"}, {5, "/set19/6"},
     {6, "/set19/7"}, {7, "/set19/8"}, {8, "/set19/9"},
@@ -27,9 +42,24 @@ static std::map<node_t, std::string> colors = {
 static bool show_future_messages = true;
 static node_t show_routes_for = -1;
 static long max_events = -1;
+static int num_threads = 1;
+static bool pool_messages = true;
+static bool alloc_stats = false;
+static bool metrics = false; // Collect them for --metrics-json or -csv.
+static int hold_down = 0;
+static long checkpoint = -1; // Epoch where --sweep scenarios fork off.
+static unsigned long seed = 1; // Of message losses and of packets.
+static long packets = 0; // Forwarded at the end of each epoch, if any.
+static int ttl = 0;      // Hops a packet may take, 0 for the node count.
+// Flag to output each step, or only one per epoch.
+static bool epoch_steps = false;
 
 typedef int event_time_t;
-enum event_type_t { LINK_CHANGE, MESSAGE };
+enum event_type_t { LINK_CHANGE, MESSAGE, TIMER };
+// A malloc()ed broadcast payload, freed by its last delivery.
+typedef struct {
+  std::atomic<int> deliveries;
+} shared_message_t;
 typedef struct {
   event_type_t type;
 
@@ -38,123 +68,890 @@ typedef struct {
       node_t node;
       node_t neighbor;
       cost_t new_cost;
+      int properties; // Of the link from node, as in topology_line_t.
+      int delay;
+      unsigned int bandwidth;
+      unsigned int loss;
     } link_change;
 
     struct {
       node_t source;
       node_t destination;
       void *content;
+      bool pooled; // From alloc_message(), reclaimed with its epoch.
+      unsigned int size; // Bytes, if it came from alloc_message().
+      shared_message_t *shared; // NULL unless broadcast from malloc().
     } message;
+
+    struct {
+      node_t node;
+    } timer;
   };
 } event_t;
 
-// Ordered sequence of events to process.
-static std::multimap<event_time_t, event_t> events;
-// Unique set of all nodes in network.
-static std::set<node_t> nodes;
-// Network topology: map[link] -> cost.
-// Undirected graph, first node always < second.
-static std::map<std::pair<node_t, node_t>, cost_t> topology;
-// Router set routes: map[source][destination] -> <neighbor, route cost>
-static std::map<node_t, std::map<node_t, std::pair<node_t, cost_t>>> routes;
-// Node black box state.
-static std::map<node_t, void *> node_states;
-
-static std::ifstream topology_file;
-static std::ofstream steps_dot_file;
-static std::ofstream final_dot_file;
+// Ordered sequence of events to process: a calendar queue keyed by epoch,
+// the unit of simulated time. The CALENDAR_EPOCHS epochs starting at
+// calendar_epoch live in a ring of vectors that keep their capacity from one
+// lap to the next, with a bitmap of those that have events to skip straight
+// to the next one. Later epochs wait in an overflow map until the ring
+// reaches them. Within an epoch, events keep their insertion order.
+#define CALENDAR_EPOCHS 256 // Power of two.
 
-// Flag to output each step, or only one per epoch.
-static bool epoch_steps = false;
+// Messages cross a link after a delay, once the link has sent them and
+// those before, in order, at its bandwidth. Bandwidth is shared by the
+// epoch: a message arrives delay epochs after the one that sends its last
+// byte. Each direction of a link sends on its own. A lost message still
+// takes its time to send. Sizes are those given to alloc_message(), the
+// messages of malloc() take no time.
+typedef struct {
+  event_time_t delay = 1;
+  unsigned int bandwidth = 0; // Bytes per epoch, 0 for no limit.
+  unsigned int loss = 0;      // In millionths.
+  // Bytes sent in epoch busy_epoch, the last one the link sends in.
+  event_time_t busy_epoch = 0;
+  unsigned int busy_bytes = 0;
+  event_time_t last_delivery = 0;
+  unsigned long sent = 0; // Messages, to draw their losses.
+} link_model_t;
+
+// Worker threads deliver the messages of an epoch in parallel: worker w
+// handles the nodes whose slot is w modulo num_threads, in event order.
+// Messages and timers they schedule wait in per worker outboxes, tagged with
+// the index of the event that scheduled them, until the main thread merges
+// them in sequential order. The main thread is worker 0.
+//
+// Messages from alloc_message() come from the sending worker's arena for
+// the delivery epoch, one for even and one for odd epochs, and are all
+// reclaimed at once when that epoch is over.
+#define ARENA_CHUNK (1 << 20)
+typedef struct {
+  std::vector<std::pair<char *, size_t>> chunks; // Kept across resets.
+  size_t chunk = 0;                              // Chunk in use.
+  size_t used = 0;                               // Bytes used in it.
+} arena_t;
+// Protocol overhead, per epoch or per node.
+typedef struct {
+  long messages_sent = 0;
+  long messages_received = 0;
+  unsigned long long bytes_sent = 0;
+  unsigned long long bytes_received = 0;
+  long messages_lost = 0;
+  long route_installs = 0;
+  long route_changes = 0;
+  long route_withdrawals = 0;
+} counters_t;
+// What became of the --packets packets, forwarded over the routes at the end
+// of an epoch.
+typedef struct {
+  long packets = 0;
+  long delivered = 0;
+  long looped = 0;      // Out of TTL.
+  long dropped = 0;     // At a node without a route, or with its link down.
+  long unreachable = 0; // Not connected to their destination, not delivered.
+  double stretch = 0;   // Sum over those delivered of path cost / optimal.
+} forwarding_t;
+typedef struct {
+  event_time_t epoch;
+  counters_t counters;
+  long link_changes;
+  long timers;
+  // Source, destination pairs at the end of the epoch whose next hops loop,
+  // or stop short of a destination they are connected to.
+  long loops;
+  long black_holes;
+  forwarding_t forwarding;
+} epoch_metrics_t;
+// What followed each epoch with link changes, until the next one: the last
+// epoch with messages or route updates, and whether messages from before
+// were still arriving when the next link changes came.
+typedef struct {
+  event_time_t epoch;
+  long link_changes;
+  event_time_t settled;
+  bool interrupted;
+  counters_t counters;
+} convergence_t;
+
+typedef struct {
+  size_t sender; // Index of the event that scheduled it.
+  event_time_t time;
+  event_t event;
+} outbox_entry_t;
+typedef struct {
+  std::vector<outbox_entry_t> outbox;
+  arena_t arenas[2];
+  long allocations = 0;
+  unsigned long long allocated_bytes = 0;
+  std::chrono::steady_clock::duration alloc_time{0};
+  // Messages allocated by the running handler, with their sizes.
+  std::vector<std::pair<void *, size_t>> allocated;
+  counters_t counters; // This epoch.
+  // Routes set since the forwarding table was last brought up to date.
+  std::vector<size_t> routes_set;
+  // Link costs of one node, spread over a dense row for O(1) lookups. It
+  // goes stale on any topology change.
+  std::vector<cost_t> link_row;
+  node_t link_row_node;
+  bool link_row_valid = false;
+  unsigned long link_row_version;
+} worker_t;
+
+// What every simulation of a topology file shares, read only once loaded.
+typedef struct {
+  topology_t topology;
+  // The nodes of the network, numbered 0 to node_span - 1 in ID order, as
+  // routers see them: node_ids maps them back to the IDs of the topology file
+  // for every output, and sparse IDs cost no memory.
+  std::vector<node_t> nodes;
+  std::vector<node_t> node_ids;
+  int node_span = 0;
+  // Network topology in CSR form: the links of node slot i are entries
+  // link_begin[i] to link_begin[i + 1] of link_neighbor and of each
+  // simulation's link_cost, sorted by neighbor. Every link that the topology
+  // file ever mentions is present, stored once per direction; absent links
+  // cost COST_INFINITY.
+  std::vector<int> link_begin;
+  std::vector<node_t> link_neighbor;
+  std::map<node_t, std::string> colors;
+  // The --packets packets, drawn from the traffic matrix: source slots of
+  // those to destination slot d are entries packet_begin[d] to
+  // packet_begin[d + 1] of packet_source.
+  std::vector<long> packet_begin;
+  std::vector<int> packet_source;
+} base_topology_t;
+
+// A forwarding table entry: next hop slot, -1 for none, and the cost of the
+// link to it.
+typedef struct {
+  int next;
+  cost_t cost;
+} fib_entry_t;
+
+// One simulation of a base topology, plus the link changes of a scenario,
+// merged in time order after the base topology's own. Any number can run at
+// once, on different threads; router API calls go to the simulation that
+// the calling thread is running.
+class Simulator {
+public:
+  Simulator(const base_topology_t &base,
+            const std::vector<topology_line_t> &scenario =
+                std::vector<topology_line_t>());
+  ~Simulator();
+
+  // Outputs of a simulation, each closed unless given a file name.
+  void open_outputs(const std::string &steps_dot_file_name,
+                    const std::string &final_dot_file_name,
+                    const std::string &trace_file_name,
+                    const std::string &metrics_json_file_name,
+                    const std::string &metrics_csv_prefix);
+  // Process events until none are left, or up to --max-events.
+  void run();
+  // Process the events before epoch, then hold there: a checkpoint from
+  // which run() goes on, in this process or in copies that fork() makes.
+  void run_until(event_time_t epoch);
+  // Add link changes, at or after the epoch of the checkpoint, to a
+  // simulation held by run_until(). They follow any base ones at the same
+  // time.
+  void add_scenario(const std::vector<topology_line_t> &lines);
+  void report_stats();
+  // The last epoch, the event counts, and forwarding faults at the end.
+  event_time_t get_current_time() const { return current_time; }
+  long get_num_events() const { return num_events; }
+  long get_num_link_changes() const { return num_link_changes; }
+  long get_num_messages() const { return num_messages; }
+  long get_num_timers() const { return num_timers; }
+  void count_forwarding_faults(long &loops, long &black_holes);
+
+  // Router API, for the simulation on the calling thread.
+  void *get_state();
+  void set_state(void *state);
+  void set_state_destructor(void (*free_state)(void *state));
+  node_t get_first_node();
+  node_t get_last_node();
+  int get_neighbors(const node_t **neighbors);
+  cost_t get_link_cost(node_t neighbor);
+  void set_route(node_t destination, node_t next_hop, cost_t cost);
+  void *alloc_message(size_t size);
+  void send_message(node_t neighbor, void *message);
+  void broadcast_message(void *message, const node_t *except, int n_except);
+  void set_timer(int delay);
+
+private:
+  worker_t &this_worker();
+  void reclaim_messages(event_time_t epoch);
+  void discard_messages();
+  std::vector<event_t> &calendar_bucket(event_time_t time);
+  void calendar_mark(event_time_t time);
+  event_time_t calendar_next_epoch();
+  void calendar_refill();
+  void schedule_event(event_time_t time, const event_t &event);
+  void read_base_next();
+  const topology_line_t *topology_next();
+  void pop_topology_next();
+  void stream_topology();
+  event_time_t next_outside_epoch();
+  event_t *peek_event();
+  void pop_event(size_t count = 1);
+  template <typename F> void for_each_event(F visit);
+  bool is_node(node_t node);
+  node_t node_id(node_t node) { return node_ids[node]; }
+  int node_slot(node_t node);
+  int find_link(node_t node, node_t neighbor);
+  void invalidate_link_row(worker_t &worker);
+  void load_link_row(worker_t &worker, node_t node);
+  cost_t get_topology_cost(node_t first_node, node_t second_node);
+  void set_topology_cost(node_t first_node, node_t second_node, cost_t cost);
+  void dump_network_snapshot(std::ostream &dot_file);
+  void flush_trace();
+  void trace_header();
+  void trace_event(const event_t &event);
+  void deliver_message(const event_t &event);
+  int message_worker(const event_t &event);
+  void run_messages(int worker);
+  void worker_loop(int worker);
+  void start_workers();
+  void stop_workers();
+  void process_message_run();
+  void process_event(event_t event);
+  void find_optimal_costs(int destination, uint64_t *optimal);
+  void compile_route(size_t route);
+  void update_data_plane();
+  void forward_packets(forwarding_t &forwarding);
+  void close_epoch_metrics(event_time_t epoch);
+  void process_events();
+  std::vector<convergence_t> convergence_metrics();
+  void write_metrics();
+  event_t message_event(void *message);
+  void post_event(event_time_t time, const event_t &event);
+  bool model_link(int link, event_t &event, event_time_t &time);
+  void post_message(event_t event, int link);
+
+  const base_topology_t &base;
+  const std::vector<node_t> &nodes = base.nodes;
+  // Copied out of base, for the many lookups of the router API.
+  const node_t first_node = nodes.empty() ? 0 : nodes.front();
+  const node_t last_node = nodes.empty() ? -1 : nodes.back();
+  const int node_span = base.node_span;
+  const std::vector<node_t> &node_ids = base.node_ids;
+  const std::vector<int> &link_begin = base.link_begin;
+  const std::vector<node_t> &link_neighbor = base.link_neighbor;
+  const std::map<node_t, std::string> &colors = base.colors;
+
+  std::vector<event_t> calendar[CALENDAR_EPOCHS];
+  uint64_t calendar_occupied[CALENDAR_EPOCHS / 64] = {};
+  std::map<event_time_t, std::vector<event_t>> overflow_events;
+  event_time_t calendar_epoch = 0;
+  bool calendar_started = false;
+  size_t calendar_cursor = 0; // Next event in the current epoch.
+  size_t calendar_events = 0; // Events left in the ring.
+  std::vector<cost_t> link_cost;
+  unsigned long topology_version = 0;
+  // By link, as link_cost. Empty unless the topology sets link properties:
+  // every message then takes one epoch.
+  std::vector<link_model_t> link_models;
+  // Router set routes: slot [source][destination] -> <neighbor, route cost>,
+  // cost COST_INFINITY when there is no route.
+  std::vector<node_t> route_next_hop;
+  std::vector<cost_t> route_cost;
+  // Data plane, with --packets: the routes compiled into a forwarding table
+  // and the costs of the shortest paths, UINT64_MAX for none, both slot
+  // [destination][node], as of the link costs the last packets went over.
+  std::vector<fib_entry_t> fib;
+  std::vector<uint64_t> optimal;
+  std::vector<cost_t> forward_link_cost;
+  long forward_runs = 0;
+  unsigned long long forward_hops = 0;
+  std::chrono::steady_clock::duration forward_time{0};
+  // Node black box state.
+  std::vector<void *> node_states;
+  std::atomic<void (*)(void *)> state_destructor{NULL};
+
+  // Next line of the base topology, and the scenario's lines, in time order.
+  // Their link changes join the queue when the simulation reaches their
+  // epoch, instead of all up front.
+  topology_t reader;
+  bool base_pending = false;
+  topology_line_t base_next;
+  std::vector<topology_line_t> scenario;
+  size_t scenario_line = 0;
+  std::vector<event_t> stream_events;
+  // The calendar stops before this epoch, see run_until().
+  event_time_t hold_epoch = INT_MAX;
+  bool started = false;
+  // Dot files stay closed, and snapshots are skipped, unless requested.
+  std::ofstream steps_dot_file;
+  std::ofstream final_dot_file;
+  event_time_t last_snapshot_epoch = -1;
+  // Binary trace of every event, closed unless requested.
+  std::ofstream trace_file;
+  std::string trace_buffer;
+  event_time_t trace_time = 0; // Epoch of the last traced event.
+  // Whether every single event gets a snapshot or a trace record.
+  bool event_steps = false;
+
+  event_time_t current_time = 0;
 
-// Current event context.
-static node_t current_node;
-static event_time_t current_time;
+  std::vector<epoch_metrics_t> epoch_metrics; // Idle epochs left out.
+  std::vector<counters_t> node_metrics;       // By node slot.
+  long epoch_link_changes = 0;
+  long epoch_timers = 0;
+  std::ofstream metrics_json_file;
+  std::ofstream epochs_csv_file, nodes_csv_file, convergence_csv_file;
 
-// Simulation stats
-static long num_events = 0;
-static long num_link_changes = 0;
-static long num_messages = 0;
+  std::vector<worker_t> workers;
+  std::vector<std::thread> worker_threads;
+  std::mutex workers_mutex;
+  std::condition_variable workers_start, workers_done;
+  unsigned long workers_generation = 0;
+  int workers_pending = 0;
+  bool workers_stop = false;
+  // Messages [run_begin, run_end) of the current epoch, the current run.
+  size_t run_begin, run_end;
 
-static cost_t get_topology_cost(node_t first_node, node_t second_node) {
-  // Avoid data duplication in undirected network graph.
-  if (first_node > second_node) {
-    std::swap(first_node, second_node);
+  // Simulation stats
+  long num_events = 0;
+  long num_link_changes = 0;
+  long num_messages = 0;
+  long num_timers = 0;
+};
+
+// Current event context, per thread. Worker threads each handle their own
+// nodes.
+static thread_local Simulator *current_simulator = NULL;
+static thread_local node_t current_node;
+static thread_local worker_t *current_worker = NULL;
+static thread_local size_t current_event;
+
+static void *arena_alloc(arena_t &arena, size_t size) {
+  size = (std::max(size, (size_t)1) + 15) & ~(size_t)15;
+  while (arena.chunk < arena.chunks.size() &&
+         arena.used + size > arena.chunks[arena.chunk].second) {
+    ++arena.chunk;
+    arena.used = 0;
+  }
+  if (arena.chunk == arena.chunks.size()) {
+    size_t chunk_size = std::max((size_t)ARENA_CHUNK, size);
+    char *chunk = (char *)malloc(chunk_size);
+    if (!chunk) {
+      std::cerr << "Out of memory for messages." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    arena.chunks.push_back(std::make_pair(chunk, chunk_size));
   }
+  void *memory = arena.chunks[arena.chunk].first + arena.used;
+  arena.used += size;
+  return memory;
+}
 
-  if (first_node == second_node) {
-    return 0;
-  } else if (topology.count(std::make_pair(first_node, second_node))) {
-    return topology[std::make_pair(first_node, second_node)];
+static bool arena_owns(const arena_t &arena, const void *memory) {
+  for (size_t c = 0; c <= arena.chunk && c < arena.chunks.size(); ++c) {
+    const char *chunk = arena.chunks[c].first;
+    if (memory >= chunk && memory < chunk + arena.chunks[c].second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Zero unless --alloc-stats asks for allocation timings.
+static std::chrono::steady_clock::time_point alloc_clock() {
+  return alloc_stats ? std::chrono::steady_clock::now()
+                     : std::chrono::steady_clock::time_point();
+}
+
+worker_t &Simulator::this_worker() {
+  return current_worker ? *current_worker : workers[0];
+}
+
+// Every message delivered in epoch has been processed.
+void Simulator::reclaim_messages(event_time_t epoch) {
+  auto start = alloc_clock();
+  for (auto &worker : workers) {
+    worker.arenas[epoch & 1].chunk = 0;
+    worker.arenas[epoch & 1].used = 0;
+  }
+  workers[0].alloc_time += alloc_clock() - start;
+}
+
+std::vector<event_t> &Simulator::calendar_bucket(event_time_t time) {
+  return calendar[time & (CALENDAR_EPOCHS - 1)];
+}
+
+void Simulator::calendar_mark(event_time_t time) {
+  int bucket = time & (CALENDAR_EPOCHS - 1);
+  calendar_occupied[bucket / 64] |= (uint64_t)1 << (bucket % 64);
+}
+
+// First epoch after calendar_epoch with events in the ring, which has some.
+event_time_t Simulator::calendar_next_epoch() {
+  int bucket = (calendar_epoch + 1) & (CALENDAR_EPOCHS - 1);
+  for (int scanned = 0; scanned < CALENDAR_EPOCHS + 64;) {
+    uint64_t word = calendar_occupied[bucket / 64] >> (bucket % 64);
+    if (word) {
+      return calendar_epoch + 1 + scanned + __builtin_ctzll(word);
+    }
+    scanned += 64 - bucket % 64;
+    bucket = (bucket + 64 - bucket % 64) & (CALENDAR_EPOCHS - 1);
+  }
+  assert(false && "No events in the ring.");
+  return calendar_epoch + 1;
+}
+
+// Move the epochs that entered the ring out of the overflow map.
+void Simulator::calendar_refill() {
+  while (!overflow_events.empty() &&
+         overflow_events.begin()->first < calendar_epoch + CALENDAR_EPOCHS) {
+    std::vector<event_t> &from = overflow_events.begin()->second;
+    std::vector<event_t> &to = calendar_bucket(overflow_events.begin()->first);
+    assert(to.empty() && "Epoch entered the ring twice.");
+    to.insert(to.end(), from.begin(), from.end());
+    calendar_mark(overflow_events.begin()->first);
+    calendar_events += from.size();
+    overflow_events.erase(overflow_events.begin());
+  }
+}
+
+void Simulator::schedule_event(event_time_t time, const event_t &event) {
+  assert((!calendar_started || time >= calendar_epoch) &&
+         "Scheduling an event in the past.");
+  if (calendar_started && time < calendar_epoch + CALENDAR_EPOCHS) {
+    calendar_bucket(time).push_back(event);
+    calendar_mark(time);
+    ++calendar_events;
   } else {
-    return COST_INFINITY;
+    overflow_events[time].push_back(event);
   }
 }
 
-static void set_topology_cost(node_t first_node, node_t second_node,
-                              cost_t cost) {
-  assert(first_node != second_node && "Setting cost of self-edge.");
-  // Avoid data duplication in undirected network graph.
-  if (first_node > second_node) {
-    std::swap(first_node, second_node);
+static void topology_error() {
+  std::cerr << "Syntax error in topology file." << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+// Number of the node with an ID of the topology, which must have it.
+static node_t node_rank(const base_topology_t &base, node_t id) {
+  return std::lower_bound(base.node_ids.begin(), base.node_ids.end(), id) -
+         base.node_ids.begin();
+}
+
+void Simulator::read_base_next() {
+  switch (read_topology_line(reader, base_next)) {
+  case TOPOLOGY_LINE: {
+    // Binary lines were not checked against the header yet.
+    const auto &links = base.topology.links;
+    if (!std::binary_search(
+            links.begin(), links.end(),
+            std::make_pair(base_next.first_node, base_next.second_node))) {
+      topology_error();
+    }
+    base_next.first_node = node_rank(base, base_next.first_node);
+    base_next.second_node = node_rank(base, base_next.second_node);
+    base_pending = true;
+  } break;
+
+  case TOPOLOGY_END: {
+    base_pending = false;
+  } break;
+
+  default: {
+    topology_error();
+  }
+  }
+}
+
+// The earlier of the next base and scenario lines, the base one on a tie,
+// NULL if neither is left.
+const topology_line_t *Simulator::topology_next() {
+  bool scenario_pending = scenario_line < scenario.size();
+  if (base_pending &&
+      (!scenario_pending || base_next.time <= scenario[scenario_line].time)) {
+    return &base_next;
+  }
+  return scenario_pending ? &scenario[scenario_line] : NULL;
+}
+
+void Simulator::pop_topology_next() {
+  if (topology_next() == &base_next) {
+    read_base_next();
+  } else {
+    ++scenario_line;
+  }
+}
+
+// Link change events for both sides of the link.
+static void add_link_changes(const topology_line_t &line,
+                             std::vector<event_t> &events) {
+  event_t event;
+  event.type = LINK_CHANGE;
+  event.link_change.node = line.first_node;
+  event.link_change.neighbor = line.second_node;
+  event.link_change.new_cost =
+      line.cost > COST_INFINITY ? COST_INFINITY : line.cost;
+  event.link_change.properties = line.properties;
+  event.link_change.delay = line.delay;
+  event.link_change.bandwidth = std::min(line.bandwidth, (unsigned long)UINT_MAX);
+  event.link_change.loss = line.loss;
+  events.push_back(event);
+  event.link_change.node = line.second_node;
+  event.link_change.neighbor = line.first_node;
+  events.push_back(event);
+}
+
+// Put the link changes for the epoch just reached ahead of the events
+// scheduled for it meanwhile, the order they would have had if all were
+// queued up front: after those that were, from an unsorted topology.
+void Simulator::stream_topology() {
+  stream_events.clear();
+  const topology_line_t *line;
+  while ((line = topology_next()) && line->time == calendar_epoch) {
+    add_link_changes(*line, stream_events);
+    pop_topology_next();
+  }
+  if (!stream_events.empty()) {
+    std::vector<event_t> &bucket = calendar_bucket(calendar_epoch);
+    auto position = bucket.begin() + calendar_cursor;
+    while (position != bucket.end() && position->type == LINK_CHANGE) {
+      ++position;
+    }
+    bucket.insert(position, stream_events.begin(), stream_events.end());
+    calendar_mark(calendar_epoch);
+    calendar_events += stream_events.size();
+  }
+}
+
+// Earliest epoch with events that are not in the ring yet.
+event_time_t Simulator::next_outside_epoch() {
+  const topology_line_t *line = topology_next();
+  if (!line) {
+    return overflow_events.begin()->first;
+  }
+  if (overflow_events.empty()) {
+    return line->time;
+  }
+  return std::min<event_time_t>(overflow_events.begin()->first, line->time);
+}
+
+// Next event to process, NULL if none is left.
+event_t *Simulator::peek_event() {
+  if (!calendar_started) {
+    if (overflow_events.empty() && !topology_next()) {
+      return NULL;
+    }
+    calendar_started = true;
+    calendar_epoch = std::min(next_outside_epoch(), hold_epoch);
+    calendar_refill();
+    stream_topology();
+  }
+
+  for (;;) {
+    if (calendar_epoch == hold_epoch) {
+      return NULL; // Its events wait for the next run().
+    }
+    std::vector<event_t> &bucket = calendar_bucket(calendar_epoch);
+    if (calendar_cursor < bucket.size()) {
+      return &bucket[calendar_cursor];
+    }
+
+    // Epoch over, its vector is reused when the ring comes around.
+    bucket.clear();
+    int slot = calendar_epoch & (CALENDAR_EPOCHS - 1);
+    calendar_occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    reclaim_messages(calendar_epoch);
+    calendar_cursor = 0;
+    // Skip idle epochs, up to the one to hold at.
+    event_time_t next;
+    if (calendar_events > 0) {
+      next = calendar_next_epoch();
+      if (const topology_line_t *line = topology_next()) {
+        next = std::min<event_time_t>(next, line->time);
+      }
+    } else if (!overflow_events.empty() || topology_next()) {
+      next = next_outside_epoch();
+    } else {
+      return NULL;
+    }
+    calendar_epoch = std::min(next, std::max(hold_epoch, calendar_epoch + 1));
+    calendar_refill();
+    stream_topology();
+  }
+}
+
+void Simulator::pop_event(size_t count) {
+  calendar_cursor += count;
+  calendar_events -= count;
+}
+
+// Visit pending events in processing order.
+template <typename F> void Simulator::for_each_event(F visit) {
+  if (!peek_event()) {
+    return;
+  }
+  const std::vector<event_t> &current = calendar_bucket(calendar_epoch);
+  for (size_t i = calendar_cursor; i < current.size(); ++i) {
+    visit(current[i]);
+  }
+  for (event_time_t time = calendar_epoch + 1;
+       time < calendar_epoch + CALENDAR_EPOCHS; ++time) {
+    for (const event_t &event : calendar_bucket(time)) {
+      visit(event);
+    }
+  }
+  for (const auto &epoch : overflow_events) {
+    for (const event_t &event : epoch.second) {
+      visit(event);
+    }
+  }
+}
+
+// Free the messages from malloc() that are still queued, when the
+// simulation stops early.
+void Simulator::discard_messages() {
+  for_each_event([&](const event_t &event) {
+    if (event.type == MESSAGE && !event.message.pooled) {
+      shared_message_t *shared = event.message.shared;
+      if (!shared || shared->deliveries.fetch_sub(1) == 1) {
+        free(event.message.content);
+        delete shared;
+      }
+    }
+  });
+}
+
+bool Simulator::is_node(node_t node) {
+  return node >= first_node && node <= last_node;
+}
+
+int Simulator::node_slot(node_t node) { return node - first_node; }
+
+// Position of the link from node to neighbor in the CSR arrays, -1 if none.
+int Simulator::find_link(node_t node, node_t neighbor) {
+  int slot = node_slot(node);
+  auto begin = link_neighbor.begin() + link_begin[slot];
+  auto end = link_neighbor.begin() + link_begin[slot + 1];
+  auto it = std::lower_bound(begin, end, neighbor);
+  return it != end && *it == neighbor ? it - link_neighbor.begin() : -1;
+}
+
+void Simulator::invalidate_link_row(worker_t &worker) {
+  if (worker.link_row_valid) {
+    int slot = node_slot(worker.link_row_node);
+    for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+      worker.link_row[node_slot(link_neighbor[l])] = COST_INFINITY;
+    }
+    worker.link_row[slot] = COST_INFINITY;
+    worker.link_row_valid = false;
+  }
+}
+
+void Simulator::load_link_row(worker_t &worker, node_t node) {
+  if (worker.link_row_valid && worker.link_row_node == node &&
+      worker.link_row_version == topology_version) {
+    return;
+  }
+  invalidate_link_row(worker);
+  if (worker.link_row.empty()) {
+    worker.link_row.assign(node_span, COST_INFINITY);
+  }
+  int slot = node_slot(node);
+  for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+    worker.link_row[node_slot(link_neighbor[l])] = link_cost[l];
   }
+  worker.link_row[slot] = 0;
+  worker.link_row_node = node;
+  worker.link_row_valid = true;
+  worker.link_row_version = topology_version;
+}
 
-  topology[std::make_pair(first_node, second_node)] = cost;
+cost_t Simulator::get_topology_cost(node_t first_node, node_t second_node) {
+  if (!is_node(first_node) || !is_node(second_node)) {
+    return first_node == second_node ? 0 : COST_INFINITY;
+  }
+  worker_t &worker = this_worker();
+  load_link_row(worker, first_node);
+  return worker.link_row[node_slot(second_node)];
 }
 
-static void make_color(node_t node) {
+void Simulator::set_topology_cost(node_t first_node, node_t second_node,
+                                  cost_t cost) {
+  assert(first_node != second_node && "Setting cost of self-edge.");
+  // Undirected network graph: both directions share the cost.
+  ++topology_version;
+  link_cost[find_link(first_node, second_node)] = cost;
+  link_cost[find_link(second_node, first_node)] = cost;
+}
+
+static void make_color(std::map<node_t, std::string> &colors, node_t node) {
   if (!colors.count(node)) { // Generate new color if not already defined.
     // Random hue, full saturation and value.
     colors[node] = std::to_string((float)rand() / RAND_MAX) + " 1.0 1.0";
   }
 }
 
-static void load_topology_events() {
-  std::string line;
-  // Iterate file lines.
-  while (std::getline(topology_file, line)) {
-    std::istringstream iss(line);
-    event_time_t time;
-    node_t first_node, second_node;
-    unsigned cost_int; // Used to read cost as a number and not a char.
-    // Parse line.
-    if (!(iss >> time >> first_node >> second_node >> cost_int)) {
-      std::cerr << "Syntax error in topology file." << std::endl;
+// Scan an open topology for its nodes and links.
+static void load_base_topology(base_topology_t &base) {
+  topology_t &topology = base.topology;
+  if (!scan_topology(topology)) {
+    topology_error();
+  }
+
+  // Generate colors for the nodes, in order of first appearance.
+  base.colors = initial_colors;
+  for (auto node : topology.nodes) {
+    make_color(base.colors, node);
+  }
+
+  std::vector<node_t> &ids = base.node_ids;
+  ids = topology.nodes;
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  base.node_span = ids.size();
+  base.nodes.resize(ids.size());
+  std::iota(base.nodes.begin(), base.nodes.end(), 0);
+
+  // Links sorted by node, then neighbor. Links that never come up are
+  // simply absent.
+  base.link_begin.assign(base.node_span + 1, 0);
+  for (auto link : topology.links) {
+    if (!std::binary_search(ids.begin(), ids.end(), link.first) ||
+        !std::binary_search(ids.begin(), ids.end(), link.second)) {
+      topology_error();
+    }
+    ++base.link_begin[node_rank(base, link.first) + 1];
+    base.link_neighbor.push_back(node_rank(base, link.second));
+  }
+  for (int slot = 0; slot < base.node_span; ++slot) {
+    base.link_begin[slot + 1] += base.link_begin[slot];
+  }
+}
+
+// Draw the --packets packets from the traffic matrix file, of
+// "<source> <destination> <weight>" lines, or from all pairs of distinct nodes
+// alike if there is none, and group them by destination.
+static void load_traffic(base_topology_t &base, const std::string &file_name) {
+  const std::vector<node_t> &ids = base.node_ids;
+  std::vector<std::pair<int, int>> pairs; // Destination, source slots.
+  std::vector<double> weights;
+  if (!file_name.empty()) {
+    std::ifstream file(file_name);
+    if (!file.is_open()) {
+      std::cerr << "Error opening traffic file: " << file_name << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    node_t source, destination;
+    double weight;
+    while (file >> source >> destination >> weight) {
+      if (!std::binary_search(ids.begin(), ids.end(), source) ||
+          !std::binary_search(ids.begin(), ids.end(), destination) ||
+          source == destination || !(weight >= 0)) {
+        std::cerr << "Invalid traffic: " << source << " " << destination
+                  << " " << weight << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      pairs.push_back(std::make_pair(node_rank(base, destination),
+                                     node_rank(base, source)));
+      weights.push_back(weight);
+    }
+    if (!file.eof()) {
+      std::cerr << "Syntax error in traffic file." << std::endl;
       exit(EXIT_FAILURE);
     }
-    cost_t cost = cost_int > COST_INFINITY ? COST_INFINITY : cost_int;
+    if (std::all_of(weights.begin(), weights.end(),
+                    [](double weight) { return weight == 0; })) {
+      std::cerr << "No traffic in traffic file." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
 
-    // Insert two link change events, one for each side of the link.
-    event_t event;
-    event.type = LINK_CHANGE;
-    event.link_change.node = first_node;
-    event.link_change.neighbor = second_node;
-    event.link_change.new_cost = cost;
-    events.insert(std::make_pair(time, event));
-    event.link_change.node = second_node;
-    event.link_change.neighbor = first_node;
-    events.insert(std::make_pair(time, event));
+  std::mt19937_64 random(seed);
+  std::discrete_distribution<size_t> pick_pair(weights.begin(),
+                                               weights.end());
+  std::uniform_int_distribution<size_t> pick_node(
+      0, ids.size() < 2 ? 0 : ids.size() - 1);
+  std::vector<std::pair<int, int>> drawn;
+  if (!pairs.empty()) {
+    for (long p = 0; p < packets; ++p) {
+      drawn.push_back(pairs[pick_pair(random)]);
+    }
+  } else if (ids.size() >= 2) {
+    for (long p = 0; p < packets; ++p) {
+      size_t source = pick_node(random), destination;
+      while ((destination = pick_node(random)) == source) {
+      }
+      drawn.push_back(std::make_pair(destination, source));
+    }
+  }
 
-    // Keep track of known nodes.
-    nodes.insert(first_node);
-    nodes.insert(second_node);
+  base.packet_begin.assign(base.node_span + 1, 0);
+  for (const auto &packet : drawn) {
+    ++base.packet_begin[packet.first + 1];
+  }
+  for (int slot = 0; slot < base.node_span; ++slot) {
+    base.packet_begin[slot + 1] += base.packet_begin[slot];
+  }
+  std::vector<long> next(base.packet_begin.begin(), base.packet_begin.end());
+  base.packet_source.resize(drawn.size());
+  for (const auto &packet : drawn) {
+    base.packet_source[next[packet.first]++] = packet.second;
+  }
+}
 
-    // Generate colors for the nodes, as needed.
-    make_color(first_node);
-    make_color(second_node);
+Simulator::Simulator(const base_topology_t &base,
+                     const std::vector<topology_line_t> &scenario)
+    : base(base), scenario(scenario) {
+  workers.resize(num_threads);
+  if (nodes.empty()) {
+    return;
   }
 
-  // Initialize network costs.
-  for (auto first_node : nodes) {
-    for (auto second_node : nodes) {
-      if (first_node < second_node) {
-        set_topology_cost(first_node, second_node, COST_INFINITY);
+  // Initialize network costs, every link down.
+  link_cost.assign(link_neighbor.size(), COST_INFINITY);
+  if (base.topology.properties) {
+    link_models.resize(link_neighbor.size());
+  }
+  route_next_hop.assign((size_t)node_span * node_span, 0);
+  route_cost.assign((size_t)node_span * node_span, COST_INFINITY);
+  node_states.assign(node_span, NULL);
+  if (metrics) {
+    node_metrics.assign(node_span, counters_t());
+  }
+
+  // Stream a topology in time order into the queue as the simulation goes.
+  // Any other has all of its link changes queued now. Scenarios stream.
+  reader = topology_reader(base.topology);
+  read_base_next();
+  if (!base.topology.sorted) {
+    std::vector<event_t> events;
+    while (base_pending) {
+      events.clear();
+      add_link_changes(base_next, events);
+      for (const auto &event : events) {
+        schedule_event(base_next.time, event);
       }
+      read_base_next();
     }
   }
 }
 
-static void dump_network_snapshot(std::ostream &dot_file) {
+Simulator::~Simulator() {
+  discard_messages();
+  for (void *state : node_states) {
+    if (state) {
+      (state_destructor ? state_destructor.load() : free)(state);
+    }
+  }
+  for (auto &worker : workers) {
+    for (auto &arena : worker.arenas) {
+      for (auto &chunk : arena.chunks) {
+        free(chunk.first);
+      }
+    }
+  }
+}
+
+void Simulator::dump_network_snapshot(std::ostream &dot_file) {
+  // Recipient of the next event, if any.
+  const event_t *next = peek_event();
+
   // Graphviz header and timestamp.
   dot_file << "digraph N {" << std::endl                             //
            << "  label = \"t=" << current_time << "\";" << std::endl //
@@ -163,70 +960,76 @@ static void dump_network_snapshot(std::ostream &dot_file) {
 
   // Dump colored nodes. Highlight recipient of next event in bold.
   for (auto node : nodes) {
-    dot_file << "  node" << node                 //
-             << " [ label = \"" << node << "\" " //
-             << "style = \"filled"               //
-             << (((!events.empty()) &&
-                  ((events.begin()->second.type == LINK_CHANGE &&
-                    events.begin()->second.link_change.node == node) ||
-                   (events.begin()->second.type == MESSAGE &&
-                    events.begin()->second.message.destination == node)))
+    dot_file << "  node" << node_id(node)                 //
+             << " [ label = \"" << node_id(node) << "\" " //
+             << "style = \"filled"                         //
+             << ((next && ((next->type == LINK_CHANGE &&
+                            next->link_change.node == node) ||
+                           (next->type == MESSAGE &&
+                            next->message.destination == node) ||
+                           (next->type == TIMER && next->timer.node == node)))
                      ? ",bold"
                      : "")
              << "\" " //
-             << "fillcolor = \"" << colors[node] << "\" ];" << std::endl;
+             << "fillcolor = \"" << colors.at(node_id(node)) << "\" ];"
+             << std::endl;
   }
 
   // Bold black lines for undirected topology.
   // Add dot for interface that is being notified of change.
-  for (auto edge : topology) {
-    if (edge.second < COST_INFINITY ||
-        ((!events.empty()) && events.begin()->second.type == LINK_CHANGE &&
-         ((events.begin()->second.link_change.node == edge.first.first &&
-           events.begin()->second.link_change.neighbor == edge.first.second) ||
-          (events.begin()->second.link_change.node == edge.first.second &&
-           events.begin()->second.link_change.neighbor == edge.first.first)))) {
-      dot_file << "  node" << edge.first.first    //
-               << " -> node" << edge.first.second //
-               << " [ dir = \"both\" "            //
-               << "label = \""
-               << (edge.second < COST_INFINITY
-                       ? std::to_string((int)edge.second)
-                       : "∞")
-               << "\" "               //
-               << "style = \"bold\" " //
-               << "arrowtail = \""
-               << ((!events.empty()) &&
-                           events.begin()->second.type == LINK_CHANGE &&
-                           events.begin()->second.link_change.node ==
-                               edge.first.first &&
-                           events.begin()->second.link_change.neighbor ==
-                               edge.first.second
-                       ? "dot"
-                       : "none")
-               << "\" " //
-               << "arrowhead = \""
-               << ((!events.empty()) &&
-                           events.begin()->second.type == LINK_CHANGE &&
-                           events.begin()->second.link_change.node ==
-                               edge.first.second &&
-                           events.begin()->second.link_change.neighbor ==
-                               edge.first.first
-                       ? "dot"
-                       : "none")
-               << "\"];" << std::endl;
+  for (auto first_node : nodes) {
+    int slot = node_slot(first_node);
+    for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+      node_t second_node = link_neighbor[l];
+      cost_t cost = link_cost[l];
+      if (second_node < first_node) { // Undirected, list each link once.
+        continue;
+      }
+      if (cost < COST_INFINITY ||
+          (next && next->type == LINK_CHANGE &&
+           ((next->link_change.node == first_node &&
+             next->link_change.neighbor == second_node) ||
+            (next->link_change.node == second_node &&
+             next->link_change.neighbor == first_node)))) {
+        dot_file << "  node" << node_id(first_node)    //
+                 << " -> node" << node_id(second_node) //
+                 << " [ dir = \"both\" "              //
+                 << "label = \""
+                 << (cost < COST_INFINITY ? std::to_string((unsigned long)cost)
+                                          : "∞")
+                 << "\" "               //
+                 << "style = \"bold\" " //
+                 << "arrowtail = \""
+                 << (next && next->type == LINK_CHANGE &&
+                             next->link_change.node == first_node &&
+                             next->link_change.neighbor == second_node
+                         ? "dot"
+                         : "none")
+                 << "\" " //
+                 << "arrowhead = \""
+                 << (next && next->type == LINK_CHANGE &&
+                             next->link_change.node == second_node &&
+                             next->link_change.neighbor == first_node
+                         ? "dot"
+                         : "none")
+                 << "\"];" << std::endl;
+      }
     }
   }
 
   // Colored arrows for directed routes.
-  for (auto node : routes) {
-    for (auto destination : node.second) {
-      if ((show_routes_for < 0 || show_routes_for == destination.first)) {
-        dot_file << "  node" << node.first                              //
-                 << " -> node" << destination.second.first              //
-                 << " [ color = \"" << colors[destination.first]        //
-                 << "\" fontcolor = \"" << colors[destination.first]    //
-                 << "\" label = \"" << ((int)destination.second.second) //
+  for (auto node : nodes) {
+    size_t row = (size_t)node_slot(node) * node_span;
+    for (auto destination : nodes) {
+      size_t route = row + node_slot(destination);
+      if (route_cost[route] < COST_INFINITY &&
+          (show_routes_for < 0 || show_routes_for == node_id(destination))) {
+        const std::string &color = colors.at(node_id(destination));
+        dot_file << "  node" << node_id(node)                    //
+                 << " -> node" << node_id(route_next_hop[route]) //
+                 << " [ color = \"" << color                     //
+                 << "\" fontcolor = \"" << color                 //
+                 << "\" label = \"" << ((unsigned long)route_cost[route])
                  << "\" ];" << std::endl;
       }
     }
@@ -234,128 +1037,1192 @@ static void dump_network_snapshot(std::ostream &dot_file) {
 
   // Dashed arrow for messages. Black if being delivered, gray for future
   // delivery.
-  for (auto event = events.begin(); event != events.end(); event++) {
-    if (event->second.type == MESSAGE) {
-      if (show_future_messages || event == events.begin()) {
-        dot_file << "  node" << event->second.message.source        //
-                 << " -> node" << event->second.message.destination //
+  for_each_event([&](const event_t &event) {
+    if (event.type == MESSAGE) {
+      if (show_future_messages || &event == next) {
+        dot_file << "  node" << node_id(event.message.source)        //
+                 << " -> node" << node_id(event.message.destination) //
                  << " [ color = \""
-                 << (event == events.begin() ? COLOR_CURRENT_MESSAGE
-                                             : COLOR_FUTURE_MESSAGE) //
+                 << (&event == next ? COLOR_CURRENT_MESSAGE
+                                    : COLOR_FUTURE_MESSAGE) //
                  << "\" style = \"dashed\" ];" << std::endl;
       }
     }
+  });
+
+  // Footer.
+  dot_file << "}" << std::endl << std::endl;
+}
+
+void Simulator::flush_trace() {
+  trace_file.write(trace_buffer.data(), trace_buffer.size());
+  trace_buffer.clear();
+}
+
+// Nodes and their colors, which the trace records never repeat.
+void Simulator::trace_header() {
+  trace_buffer += TRACE_MAGIC;
+  trace_put(trace_buffer, COST_INFINITY);
+  trace_put(trace_buffer, nodes.size());
+  for (auto node : nodes) {
+    const std::string &color = colors.at(node_id(node));
+    trace_put_signed(trace_buffer, node_id(node));
+    trace_put(trace_buffer, color.size());
+    trace_buffer += color;
+  }
+}
+
+void Simulator::trace_event(const event_t &event) {
+  if (current_time != trace_time) {
+    trace_buffer += (char)TRACE_TIME;
+    trace_put_signed(trace_buffer, (int64_t)current_time - trace_time);
+    trace_time = current_time;
+  }
+  switch (event.type) {
+  case LINK_CHANGE: {
+    trace_buffer += (char)TRACE_LINK_CHANGE;
+    trace_put_signed(trace_buffer, node_id(event.link_change.node));
+    trace_put_signed(trace_buffer, node_id(event.link_change.neighbor));
+    trace_put(trace_buffer, event.link_change.new_cost);
+  } break;
+
+  case MESSAGE: { // Messages are delivered in the order they were sent.
+    trace_buffer += (char)TRACE_DELIVER;
+  } break;
+
+  case TIMER: {
+    trace_buffer += (char)TRACE_TIMER;
+    trace_put_signed(trace_buffer, node_id(event.timer.node));
+  } break;
+  }
+  if (trace_buffer.size() >= (1 << 16)) {
+    flush_trace();
+  }
+}
+
+// Deliver message to node and free the message buffer.
+void Simulator::deliver_message(const event_t &event) {
+  current_node = event.message.destination;
+  notify_receive_message(event.message.source, event.message.content);
+  this_worker().allocated.clear();
+  if (metrics) {
+    for (counters_t *counters :
+         {&this_worker().counters, &node_metrics[node_slot(current_node)]}) {
+      ++counters->messages_received;
+      counters->bytes_received += event.message.size;
+    }
+  }
+  if (!event.message.pooled) {
+    auto start = alloc_clock();
+    shared_message_t *shared = event.message.shared;
+    if (!shared || shared->deliveries.fetch_sub(1) == 1) {
+      free(event.message.content);
+      delete shared;
+    }
+    this_worker().alloc_time += alloc_clock() - start;
+  }
+}
+
+int Simulator::message_worker(const event_t &event) {
+  return node_slot(event.message.destination) % num_threads;
+}
+
+void Simulator::run_messages(int worker) {
+  const std::vector<event_t> &bucket = calendar_bucket(calendar_epoch);
+  current_worker = &workers[worker];
+  for (size_t i = run_begin; i < run_end; ++i) {
+    if (message_worker(bucket[i]) == worker) {
+      current_event = i;
+      deliver_message(bucket[i]);
+    }
+  }
+  current_worker = NULL;
+}
+
+void Simulator::worker_loop(int worker) {
+  unsigned long generation = 0;
+  current_simulator = this;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(workers_mutex);
+      workers_start.wait(lock,
+                         [&] { return workers_generation != generation; });
+      generation = workers_generation;
+      if (workers_stop) {
+        return;
+      }
+    }
+    run_messages(worker);
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    if (--workers_pending == 0) {
+      workers_done.notify_one();
+    }
+  }
+}
+
+void Simulator::start_workers() {
+  for (int worker = 1; worker < num_threads; ++worker) {
+    worker_threads.emplace_back(&Simulator::worker_loop, this, worker);
+  }
+}
+
+void Simulator::stop_workers() {
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    workers_stop = true;
+    ++workers_generation;
+  }
+  workers_start.notify_all();
+  for (auto &thread : worker_threads) {
+    thread.join();
+  }
+  worker_threads.clear();
+  workers_stop = false;
+}
+
+// Deliver the messages at the cursor, up to the next link change, the end
+// of the epoch or the event limit, on all workers at once. Messages only
+// reach their destination in a later epoch, and links do not change in
+// between, so nodes are independent of each other for the whole run.
+void Simulator::process_message_run() {
+  const std::vector<event_t> &bucket = calendar_bucket(calendar_epoch);
+  run_begin = calendar_cursor;
+  run_end = run_begin;
+  while (run_end < bucket.size() && bucket[run_end].type == MESSAGE &&
+         (max_events < 0 ||
+          num_events + (long)(run_end - run_begin) < max_events)) {
+    ++run_end;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    workers_pending = num_threads - 1;
+    ++workers_generation;
+  }
+  workers_start.notify_all();
+  run_messages(0);
+  {
+    std::unique_lock<std::mutex> lock(workers_mutex);
+    workers_done.wait(lock, [this] { return workers_pending == 0; });
+  }
+
+  // Schedule sent messages and timers in the order a single thread would
+  // have.
+  std::vector<size_t> merged(num_threads, 0);
+  for (size_t i = run_begin; i < run_end; ++i) {
+    int worker = message_worker(bucket[i]);
+    const auto &outbox = workers[worker].outbox;
+    size_t &next = merged[worker];
+    for (; next < outbox.size() && outbox[next].sender == i; ++next) {
+      schedule_event(outbox[next].time, outbox[next].event);
+    }
+  }
+  for (auto &worker : workers) {
+    worker.outbox.clear();
+  }
+
+  size_t count = run_end - run_begin;
+  pop_event(count);
+  num_events += count;
+  num_messages += count;
+}
+
+void Simulator::process_event(event_t event) {
+  switch (event.type) {
+  case LINK_CHANGE: { // Update topology and notify node.
+    set_topology_cost(event.link_change.node, event.link_change.neighbor,
+                      event.link_change.new_cost);
+    if (event.link_change.properties) {
+      link_model_t &model = link_models[find_link(
+          event.link_change.node, event.link_change.neighbor)];
+      if (event.link_change.properties & LINK_DELAY) {
+        model.delay = event.link_change.delay;
+      }
+      if (event.link_change.properties & LINK_BANDWIDTH) {
+        model.bandwidth = event.link_change.bandwidth;
+        model.busy_bytes = 0; // What it sent still arrives as planned.
+      }
+      if (event.link_change.properties & LINK_LOSS) {
+        model.loss = event.link_change.loss;
+      }
+    }
+
+    current_node = event.link_change.node;
+    notify_link_change(event.link_change.neighbor, event.link_change.new_cost);
+    workers[0].allocated.clear();
+    ++num_link_changes;
+    ++epoch_link_changes;
+  } break;
+
+  case MESSAGE: {
+    deliver_message(event);
+    ++num_messages;
+  } break;
+
+  case TIMER: {
+    current_node = event.timer.node;
+    notify_timer();
+    workers[0].allocated.clear();
+    ++num_timers;
+    ++epoch_timers;
+  } break;
+
+  default: {
+    assert(false && "Unknown event type.");
+  }
+  }
+}
+
+static void add_counters(counters_t &to, const counters_t &from) {
+  to.messages_sent += from.messages_sent;
+  to.messages_received += from.messages_received;
+  to.bytes_sent += from.bytes_sent;
+  to.bytes_received += from.bytes_received;
+  to.messages_lost += from.messages_lost;
+  to.route_installs += from.route_installs;
+  to.route_changes += from.route_changes;
+  to.route_withdrawals += from.route_withdrawals;
+}
+
+static void add_forwarding(forwarding_t &to, const forwarding_t &from) {
+  to.packets += from.packets;
+  to.delivered += from.delivered;
+  to.looped += from.looped;
+  to.dropped += from.dropped;
+  to.unreachable += from.unreachable;
+  to.stretch += from.stretch;
+}
+
+// Count the source, destination pairs whose next hops loop, and those whose
+// next hops stop at a node without a route, or at a link that is down, while
+// the destination is connected to the source.
+void Simulator::count_forwarding_faults(long &loops, long &black_holes) {
+  enum { UNKNOWN, ON_PATH, REACHES, LOOPS, STOPS };
+  std::vector<int> component(node_span, -1);
+  std::vector<char> fate(node_span);
+  std::vector<int> path;
+  loops = black_holes = 0;
+
+  // Connected components of the links that are up.
+  for (auto node : nodes) {
+    int root = node_slot(node);
+    if (component[root] >= 0) {
+      continue;
+    }
+    component[root] = root;
+    path.assign(1, root);
+    while (!path.empty()) {
+      int slot = path.back();
+      path.pop_back();
+      for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+        int neighbor = node_slot(link_neighbor[l]);
+        if (link_cost[l] < COST_INFINITY && component[neighbor] < 0) {
+          component[neighbor] = root;
+          path.push_back(neighbor);
+        }
+      }
+    }
+  }
+
+  // Next hops towards a destination form a functional graph: follow each
+  // node's until a node whose fate is known.
+  for (auto destination : nodes) {
+    int d = node_slot(destination);
+    std::fill(fate.begin(), fate.end(), UNKNOWN);
+    fate[d] = REACHES;
+    for (auto source : nodes) {
+      int slot = node_slot(source);
+      char end = UNKNOWN;
+      path.clear();
+      while (fate[slot] == UNKNOWN) {
+        fate[slot] = ON_PATH;
+        path.push_back(slot);
+        size_t route = (size_t)slot * node_span + d;
+        node_t next_hop = route_next_hop[route];
+        int link = route_cost[route] < COST_INFINITY && is_node(next_hop)
+                       ? find_link(first_node + slot, next_hop)
+                       : -1;
+        if (link < 0 || link_cost[link] == COST_INFINITY) {
+          end = STOPS;
+          break;
+        }
+        slot = node_slot(next_hop);
+      }
+      if (end == UNKNOWN) {
+        end = fate[slot] == ON_PATH ? LOOPS : fate[slot];
+      }
+      for (int p : path) {
+        fate[p] = end;
+        loops += end == LOOPS;
+        black_holes += end == STOPS && component[p] == component[d];
+      }
+    }
+  }
+}
+
+// Costs of the shortest paths to a destination slot from every node, by
+// Dijkstra's algorithm, links costing the same both ways.
+void Simulator::find_optimal_costs(int destination, uint64_t *optimal) {
+  typedef std::pair<uint64_t, int> entry_t; // Cost, slot.
+  std::priority_queue<entry_t, std::vector<entry_t>, std::greater<entry_t>>
+      queue;
+  std::fill(optimal, optimal + node_span, UINT64_MAX);
+  optimal[destination] = 0;
+  queue.push(std::make_pair(0, destination));
+  while (!queue.empty()) {
+    entry_t entry = queue.top();
+    queue.pop();
+    int slot = entry.second;
+    if (entry.first > optimal[slot]) {
+      continue;
+    }
+    for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+      int neighbor = node_slot(link_neighbor[l]);
+      uint64_t cost = entry.first + link_cost[l];
+      if (link_cost[l] < COST_INFINITY && cost < optimal[neighbor]) {
+        optimal[neighbor] = cost;
+        queue.push(std::make_pair(cost, neighbor));
+      }
+    }
+  }
+}
+
+// Forwarding table entry of a route, on the links as they are now.
+void Simulator::compile_route(size_t route) {
+  int slot = route / node_span;
+  node_t next_hop = route_next_hop[route];
+  int link = route_cost[route] < COST_INFINITY && is_node(next_hop)
+                 ? find_link(first_node + slot, next_hop)
+                 : -1;
+  fib_entry_t &entry = fib[(size_t)(route % node_span) * node_span + slot];
+  if (link >= 0 && link_cost[link] < COST_INFINITY) {
+    entry.next = node_slot(next_hop);
+    entry.cost = link_cost[link];
+  } else {
+    entry.next = -1;
+  }
+}
+
+// Bring the forwarding table and the shortest paths up to date, for the
+// destinations of packets. Table entries change with their route or their
+// link. Shortest paths to a destination change only if a link that got
+// worse was on one of them, or one that got better makes one shorter.
+void Simulator::update_data_plane() {
+  const std::vector<long> &packet_begin = base.packet_begin;
+  if (forward_link_cost.empty()) { // Every link down, no routes.
+    fib.assign((size_t)node_span * node_span, fib_entry_t{-1, 0});
+    optimal.assign((size_t)node_span * node_span, UINT64_MAX);
+    for (int d = 0; d < node_span; ++d) {
+      optimal[(size_t)d * node_span + d] = 0;
+    }
+    forward_link_cost.assign(link_cost.size(), COST_INFINITY);
+  }
+
+  std::vector<std::pair<int, int>> changed_links; // Slot, link.
+  for (int slot = 0; slot < node_span; ++slot) {
+    for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+      if (link_cost[l] != forward_link_cost[l]) {
+        changed_links.push_back(std::make_pair(slot, l));
+      }
+    }
+  }
+
+  for (auto &worker : workers) {
+    for (size_t route : worker.routes_set) {
+      int d = route % node_span;
+      if (packet_begin[d] < packet_begin[d + 1]) {
+        compile_route(route);
+      }
+    }
+    worker.routes_set.clear();
+  }
+  for (int d = 0; d < node_span; ++d) {
+    if (packet_begin[d] == packet_begin[d + 1]) {
+      continue;
+    }
+    uint64_t *row = &optimal[(size_t)d * node_span];
+    bool stale = false;
+    for (auto changed : changed_links) {
+      int slot = changed.first, l = changed.second;
+      int neighbor = node_slot(link_neighbor[l]);
+      cost_t old_cost = forward_link_cost[l], cost = link_cost[l];
+      compile_route((size_t)slot * node_span + d);
+      stale = stale || (row[neighbor] < UINT64_MAX &&
+                        (cost > old_cost
+                             ? old_cost < COST_INFINITY &&
+                                   row[slot] == row[neighbor] + old_cost
+                             : row[neighbor] + cost < row[slot]));
+    }
+    if (stale) {
+      find_optimal_costs(d, row);
+    }
+  }
+  for (auto changed : changed_links) {
+    forward_link_cost[changed.second] = link_cost[changed.second];
+  }
+}
+
+// Forward every packet over the routes as they stand, hop by hop until it
+// is delivered, dropped or out of TTL. The packets to a destination share
+// its table row, and go FORWARD_BATCH at a time in lockstep: their lookups
+// do not wait on each other.
+#define FORWARD_BATCH 64
+void Simulator::forward_packets(forwarding_t &forwarding) {
+  auto start = std::chrono::steady_clock::now();
+  const std::vector<long> &packet_begin = base.packet_begin;
+  const std::vector<int> &packet_source = base.packet_source;
+  update_data_plane();
+  int max_hops = ttl > 0 ? ttl : nodes.size();
+
+  forwarding = forwarding_t();
+  forwarding.packets = packet_source.size();
+  int source[FORWARD_BATCH], at[FORWARD_BATCH];
+  uint64_t cost[FORWARD_BATCH];
+  for (int d = 0; d < node_span; ++d) {
+    const fib_entry_t *row = &fib[(size_t)d * node_span];
+    const uint64_t *optimal_row = &optimal[(size_t)d * node_span];
+    for (long p0 = packet_begin[d]; p0 < packet_begin[d + 1];
+         p0 += FORWARD_BATCH) {
+      int batch = std::min<long>(FORWARD_BATCH, packet_begin[d + 1] - p0);
+      for (int i = 0; i < batch; ++i) {
+        source[i] = at[i] = packet_source[p0 + i];
+        cost[i] = 0;
+        forwarding.unreachable += optimal_row[source[i]] == UINT64_MAX;
+      }
+      for (int hops = 0; batch > 0; ++hops) {
+        int live = 0;
+        for (int i = 0; i < batch; ++i) {
+          if (at[i] == d) {
+            uint64_t optimal = optimal_row[source[i]];
+            forwarding.delivered++;
+            forwarding.stretch += optimal ? (double)cost[i] / optimal : 1;
+            continue;
+          }
+          fib_entry_t entry = row[at[i]];
+          if (entry.next < 0) {
+            forwarding.dropped++;
+          } else if (hops == max_hops) {
+            forwarding.looped++;
+          } else {
+            source[live] = source[i];
+            at[live] = entry.next;
+            cost[live++] = cost[i] + entry.cost;
+          }
+        }
+        forward_hops += live;
+        batch = live;
+      }
+    }
+  }
+  ++forward_runs;
+  forward_time += std::chrono::steady_clock::now() - start;
+}
+
+// Record the metrics of an epoch that is over.
+void Simulator::close_epoch_metrics(event_time_t epoch) {
+  epoch_metrics_t record = {};
+  record.epoch = epoch;
+  for (auto &worker : workers) {
+    add_counters(record.counters, worker.counters);
+    worker.counters = counters_t();
+  }
+  record.link_changes = epoch_link_changes;
+  record.timers = epoch_timers;
+  const counters_t &counters = record.counters;
+  if (epoch_metrics.empty() || record.link_changes > 0 ||
+      counters.route_installs + counters.route_changes +
+              counters.route_withdrawals >
+          0) {
+    count_forwarding_faults(record.loops, record.black_holes);
+    if (packets > 0) {
+      forward_packets(record.forwarding);
+    }
+  } else { // Same routes on the same topology.
+    record.loops = epoch_metrics.back().loops;
+    record.black_holes = epoch_metrics.back().black_holes;
+    record.forwarding = epoch_metrics.back().forwarding;
+  }
+  epoch_metrics.push_back(record);
+  epoch_link_changes = epoch_timers = 0;
+}
+
+void Simulator::process_events() {
+  // Continue until no more events.
+  while (peek_event() && (max_events < 0 || num_events < max_events)) {
+    if (metrics && num_events > 0 && calendar_epoch != current_time) {
+      close_epoch_metrics(current_time);
+    }
+    current_time = calendar_epoch;
+
+    if (steps_dot_file.is_open() &&
+        (!epoch_steps || current_time > last_snapshot_epoch)) {
+      dump_network_snapshot(steps_dot_file);
+      last_snapshot_epoch = current_time;
+    }
+
+    if (num_threads > 1 && !event_steps && peek_event()->type == MESSAGE) {
+      process_message_run();
+      continue;
+    }
+
+    // Remove event from queue and process it.
+    event_t event = *peek_event();
+    pop_event();
+
+    if (trace_file.is_open()) {
+      trace_event(event);
+    }
+    process_event(event);
+    ++num_events;
+  }
+  if (hold_epoch != INT_MAX) {
+    return; // More to come after the checkpoint.
+  }
+  if (metrics && num_events > 0) {
+    close_epoch_metrics(current_time);
+  }
+  if (steps_dot_file.is_open()) {
+    dump_network_snapshot(steps_dot_file);
+  }
+  if (final_dot_file.is_open()) {
+    dump_network_snapshot(final_dot_file);
+  }
+  if (trace_file.is_open()) {
+    trace_buffer += (char)TRACE_END;
+    if (const event_t *next = peek_event()) { // Stopped by --max-events.
+      trace_event(*next);
+    }
+    flush_trace();
+  }
+}
+
+static void show_usage(std::string command) {
+  std::cerr                                                             //
+      << "Usage: " << command                                           //
+      << " [--alloc-stats]"                                             //
+      << " [--checkpoint <epoch>]"                                      //
+      << " [--epoch-steps]"                                             //
+      << " [--final-dot <dot-file>]"                                    //
+      << " [--help]"                                                    //
+      << " [--hide-future-messages]"                                    //
+      << " [--hold-down <epochs>]"                                      //
+      << " [--malloc-messages]"                                         //
+      << " [--max-events <limit>]"                                      //
+      << " [--metrics-csv <prefix>]"                                    //
+      << " [--metrics-json <file>]"                                     //
+      << " [--packets <count>]"                                         //
+      << " [--seed <seed>]"                                             //
+      << " [--show-routes-for <node>]"                                  //
+      << " [--steps-dot <dot-file>]"                                    //
+      << " [--sweep <scenario-file>]"                                   //
+      << " [--threads <count>]"                                         //
+      << " [--trace <trace-file>]"                                      //
+      << " [--traffic <traffic-file>]"                                  //
+      << " [--ttl <hops>]"                                              //
+      << " [--] <topology-file>" << std::endl                           //
+      << std::endl                                                      //
+      << " --alloc-stats             "                                  //
+      << "- Report message allocation time and peak memory use."        //
+      << std::endl                                                      //
+      << " --checkpoint <epoch>      "                                  //
+      << "- With --sweep, simulate the topology up to <epoch> once, "   //
+      << "then fork each scenario from there. Scenarios must start at " //
+      << "or after <epoch>."                                            //
+      << std::endl                                                      //
+      << " --epoch-steps             "                                  //
+      << "- Only show one step per epoch in the steps dot file."        //
+      << std::endl                                                      //
+      << " --final-dot <dot-file>    "                                  //
+      << "- Generate a dot file showing the final result."              //
+      << std::endl                                                      //
+      << " --help                    "                                  //
+      << "- Show this help screen."                                     //
+      << std::endl                                                      //
+      << " --hide-future-messages    "                                  //
+      << "- Declutter dot files by only showing the current message "   //
+      << "(default: show)."                                             //
+      << std::endl                                                      //
+      << " --hold-down <epochs>      "                                  //
+      << "- Have routers wait <epochs> after each triggered update, "   //
+      << "merging the changes made meanwhile into the next one "        //
+      << "(default: 0)."                                                //
+      << std::endl                                                      //
+      << " --malloc-messages         "                                  //
+      << "- Back alloc_message() with malloc() instead of per epoch "   //
+      << "arenas."                                                      //
+      << std::endl                                                      //
+      << " --max-events <limit>      "                                  //
+      << "- Put a limit on the number of simulation events to process " //
+      << "(default: no limit)."                                         //
+      << std::endl                                                      //
+      << " --metrics-csv <prefix>    "                                  //
+      << "- Write per epoch, per node and convergence metrics to "      //
+      << "<prefix>-epochs.csv, <prefix>-nodes.csv and "                 //
+      << "<prefix>-convergence.csv."                                    //
+      << std::endl                                                      //
+      << " --metrics-json <file>     "                                  //
+      << "- Write the same metrics, and totals, as JSON."               //
+      << std::endl                                                      //
+      << " --packets <count>         "                                  //
+      << "- At the end of each epoch, forward <count> packets over "    //
+      << "the routes hop by hop, and report how many arrive, how much " //
+      << "longer their paths are than the shortest, and how many loop " //
+      << "or are dropped. Not with --sweep."                            //
+      << std::endl                                                      //
+      << " --seed <seed>             "                                  //
+      << "- Random seed of the message losses of links with a loss "    //
+      << "probability, and of the packets of --packets (default: 1)."   //
+      << std::endl                                                      //
+      << " --show-routes-for <node>  "                                  //
+      << "- Declutter dot files by only showing routes for <node> "     //
+      << "(default: show all)."                                         //
+      << std::endl                                                      //
+      << " --steps-dot <dot-file>    "                                  //
+      << "- Generate a dot file showing each simulation step."          //
+      << std::endl                                                      //
+      << " --sweep <scenario-file>   "                                  //
+      << "- Simulate each scenario of \"<scenario> <time> <node> "      //
+      << "<node> <cost>\" link changes on top of the topology, and "    //
+      << "write a CSV line of results for each instead of any other "   //
+      << "output."                                                      //
+      << std::endl                                                      //
+      << " --threads <count>         "                                  //
+      << "- Deliver the messages of each epoch on several threads, "    //
+      << "unless every step goes to the steps dot file or the trace, "  //
+      << "or with --sweep run that many scenarios at once "             //
+      << "(default: 1)."                                                //
+      << std::endl                                                      //
+      << " --trace <trace-file>      "                                  //
+      << "- Record each simulation step in a compact binary trace, "    //
+      << "which trace-to-dot turns into dot files."                     //
+      << std::endl                                                      //
+      << " --traffic <traffic-file>  "                                  //
+      << "- Draw the packets of --packets from a traffic matrix of "    //
+      << "\"<source> <destination> <weight>\" lines (default: all "     //
+      << "pairs of nodes alike)."                                       //
+      << std::endl                                                      //
+      << " --ttl <hops>              "                                  //
+      << "- Hops a packet may take before it counts as looped "         //
+      << "(default: the node count)."                                   //
+      << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+std::vector<convergence_t> Simulator::convergence_metrics() {
+  std::vector<convergence_t> periods;
+  for (const auto &record : epoch_metrics) {
+    const counters_t &counters = record.counters;
+    if (record.link_changes > 0) {
+      if (!periods.empty()) {
+        periods.back().interrupted = counters.messages_received > 0;
+      }
+      periods.push_back({record.epoch, record.link_changes, record.epoch,
+                         false, counters_t()});
+    }
+    if (periods.empty()) {
+      continue;
+    }
+    convergence_t &period = periods.back();
+    add_counters(period.counters, counters);
+    if (counters.messages_sent + counters.messages_received +
+            counters.route_installs + counters.route_changes +
+            counters.route_withdrawals >
+        0) {
+      period.settled = record.epoch;
+    }
+  }
+  return periods;
+}
+
+#define COUNTERS_CSV_HEADER                                                    \
+  "messages_sent,messages_received,bytes_sent,bytes_received,messages_lost,"   \
+  "route_installs,route_changes,route_withdrawals"
+
+static void write_counters_csv(std::ostream &file, const counters_t &c) {
+  file << c.messages_sent << "," << c.messages_received << ","
+       << c.bytes_sent << "," << c.bytes_received << "," << c.messages_lost
+       << "," << c.route_installs << "," << c.route_changes << ","
+       << c.route_withdrawals;
+}
+
+static void write_counters_json(std::ostream &file, const counters_t &c) {
+  file << "\"messages_sent\": " << c.messages_sent
+       << ", \"messages_received\": " << c.messages_received
+       << ", \"bytes_sent\": " << c.bytes_sent
+       << ", \"bytes_received\": " << c.bytes_received
+       << ", \"messages_lost\": " << c.messages_lost
+       << ", \"route_installs\": " << c.route_installs
+       << ", \"route_changes\": " << c.route_changes
+       << ", \"route_withdrawals\": " << c.route_withdrawals;
+}
+
+// Delivered out of the packets that could be, and mean stretch, as empty
+// strings if there are none.
+static std::string delivery_ratio(const forwarding_t &f) {
+  long reachable = f.packets - f.unreachable;
+  return reachable ? std::to_string((double)f.delivered / reachable) : "";
+}
+
+static std::string mean_stretch(const forwarding_t &f) {
+  return f.delivered ? std::to_string(f.stretch / f.delivered) : "";
+}
+
+#define FORWARDING_CSV_HEADER                                                  \
+  "packets,delivered,looped,dropped,unreachable,delivery_ratio,stretch"
+
+static void write_forwarding_csv(std::ostream &file, const forwarding_t &f) {
+  file << f.packets << "," << f.delivered << "," << f.looped << ","
+       << f.dropped << "," << f.unreachable << "," << delivery_ratio(f) << ","
+       << mean_stretch(f);
+}
+
+static void write_forwarding_json(std::ostream &file, const forwarding_t &f) {
+  std::string ratio = delivery_ratio(f), stretch = mean_stretch(f);
+  file << ", \"packets\": " << f.packets << ", \"delivered\": " << f.delivered
+       << ", \"looped\": " << f.looped << ", \"dropped\": " << f.dropped
+       << ", \"unreachable\": " << f.unreachable
+       << ", \"delivery_ratio\": " << (ratio.empty() ? "null" : ratio)
+       << ", \"stretch\": " << (stretch.empty() ? "null" : stretch);
+}
+
+void Simulator::write_metrics() {
+  std::vector<convergence_t> periods = convergence_metrics();
+  counters_t totals;
+  forwarding_t forwarding;
+  for (const auto &record : epoch_metrics) {
+    add_counters(totals, record.counters);
+    add_forwarding(forwarding, record.forwarding);
+  }
+
+  if (metrics_json_file.is_open()) {
+    std::ostream &file = metrics_json_file;
+    file << "{" << std::endl
+         << "  \"summary\": {\"nodes\": " << nodes.size()
+         << ", \"events\": " << num_events
+         << ", \"link_changes\": " << num_link_changes
+         << ", \"timers\": " << num_timers
+         << ", \"epochs\": " << current_time << ", ";
+    write_counters_json(file, totals);
+    if (packets > 0) {
+      write_forwarding_json(file, forwarding);
+    }
+    file << "}," << std::endl << "  \"convergence\": [";
+    for (size_t i = 0; i < periods.size(); ++i) {
+      const convergence_t &period = periods[i];
+      file << (i ? "," : "") << std::endl
+           << "    {\"epoch\": " << period.epoch
+           << ", \"link_changes\": " << period.link_changes
+           << ", \"settled\": " << period.settled
+           << ", \"epochs\": " << period.settled - period.epoch
+           << ", \"interrupted\": "
+           << (period.interrupted ? "true" : "false") << ", ";
+      write_counters_json(file, period.counters);
+      file << "}";
+    }
+    file << std::endl << "  ]," << std::endl << "  \"epochs\": [";
+    for (size_t i = 0; i < epoch_metrics.size(); ++i) {
+      const epoch_metrics_t &record = epoch_metrics[i];
+      file << (i ? "," : "") << std::endl
+           << "    {\"epoch\": " << record.epoch
+           << ", \"link_changes\": " << record.link_changes
+           << ", \"timers\": " << record.timers << ", ";
+      write_counters_json(file, record.counters);
+      file << ", \"loops\": " << record.loops
+           << ", \"black_holes\": " << record.black_holes;
+      if (packets > 0) {
+        write_forwarding_json(file, record.forwarding);
+      }
+      file << "}";
+    }
+    file << std::endl << "  ]," << std::endl << "  \"nodes\": [";
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      file << (i ? "," : "") << std::endl
+           << "    {\"node\": " << node_id(nodes[i]) << ", ";
+      write_counters_json(file, node_metrics[node_slot(nodes[i])]);
+      file << "}";
+    }
+    file << std::endl << "  ]" << std::endl << "}" << std::endl;
+  }
+
+  if (epochs_csv_file.is_open()) {
+    epochs_csv_file << "epoch,link_changes,timers," COUNTERS_CSV_HEADER
+                       ",loops,black_holes"
+                    << (packets > 0 ? "," FORWARDING_CSV_HEADER : "")
+                    << std::endl;
+    for (const auto &record : epoch_metrics) {
+      epochs_csv_file << record.epoch << "," << record.link_changes << ","
+                      << record.timers << ",";
+      write_counters_csv(epochs_csv_file, record.counters);
+      epochs_csv_file << "," << record.loops << "," << record.black_holes;
+      if (packets > 0) {
+        epochs_csv_file << ",";
+        write_forwarding_csv(epochs_csv_file, record.forwarding);
+      }
+      epochs_csv_file << std::endl;
+    }
+
+    nodes_csv_file << "node," COUNTERS_CSV_HEADER << std::endl;
+    for (auto node : nodes) {
+      nodes_csv_file << node_id(node) << ",";
+      write_counters_csv(nodes_csv_file, node_metrics[node_slot(node)]);
+      nodes_csv_file << std::endl;
+    }
+
+    convergence_csv_file << "epoch,link_changes,settled,epochs,interrupted,"
+                            COUNTERS_CSV_HEADER
+                         << std::endl;
+    for (const auto &period : periods) {
+      convergence_csv_file << period.epoch << "," << period.link_changes
+                           << "," << period.settled << ","
+                           << period.settled - period.epoch << ","
+                           << period.interrupted << ",";
+      write_counters_csv(convergence_csv_file, period.counters);
+      convergence_csv_file << std::endl;
+    }
+  }
+}
+
+void Simulator::report_stats() {
+  std::cout << "Simulated network of " << nodes.size() << " nodes with "
+            << num_events << " events." << std::endl
+            << "Processed " << num_link_changes << " link change events."
+            << std::endl
+            << "Processed " << num_messages << " messages." << std::endl
+            << (num_timers ? "Processed " + std::to_string(num_timers) +
+                                 " timer events.\n"
+                           : "")
+            << "Simulation converged after " << current_time << " time epochs."
+            << std::endl;
+
+  if (packets > 0) {
+    forwarding_t forwarding;
+    for (const auto &record : epoch_metrics) {
+      add_forwarding(forwarding, record.forwarding);
+    }
+    std::string ratio = delivery_ratio(forwarding);
+    std::string stretch = mean_stretch(forwarding);
+    double seconds = std::chrono::duration<double>(forward_time).count();
+    std::cout << "Forwarded " << forwarding.packets << " packets, "
+              << packets << " at the end of each of " << epoch_metrics.size()
+              << " epochs: delivered " << forwarding.delivered
+              << (ratio.empty() ? "" : " (ratio " + ratio + ")")
+              << (stretch.empty() ? "" : " with mean stretch " + stretch)
+              << ", looped " << forwarding.looped << ", dropped "
+              << forwarding.dropped << ", " << forwarding.unreachable
+              << " unreachable." << std::endl
+              << "Forwarding took " << forward_hops << " hops on "
+              << forward_runs << " route changes in " << seconds * 1000
+              << " ms, "
+              << (seconds > 0 ? forward_hops / seconds / 1e6 : 0)
+              << " million hops per second." << std::endl;
+  }
+
+  if (alloc_stats) {
+    long allocations = 0;
+    unsigned long long allocated_bytes = 0;
+    std::chrono::steady_clock::duration alloc_time{0};
+    for (const auto &worker : workers) {
+      allocations += worker.allocations;
+      allocated_bytes += worker.allocated_bytes;
+      alloc_time += worker.alloc_time;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Allocated " << allocations << " messages, "
+              << allocated_bytes << " bytes, with "
+              << (pool_messages ? "arenas" : "malloc") << " in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(
+                     alloc_time)
+                         .count() /
+                     1000.0
+              << " ms." << std::endl
+              << "Peak resident set size: " << usage.ru_maxrss << " KB."
+              << std::endl;
+  }
+}
+
+static void open_output(std::ofstream &file, const std::string &file_name,
+                        std::ios::openmode mode = std::ios::out) {
+  file.open(file_name, mode);
+  if (!file.is_open()) {
+    std::cerr << "Error opening output file: " << file_name << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void Simulator::open_outputs(const std::string &steps_dot_file_name,
+                             const std::string &final_dot_file_name,
+                             const std::string &trace_file_name,
+                             const std::string &metrics_json_file_name,
+                             const std::string &metrics_csv_prefix) {
+  if (!steps_dot_file_name.empty()) {
+    open_output(steps_dot_file, steps_dot_file_name);
+  }
+  if (!final_dot_file_name.empty()) {
+    open_output(final_dot_file, final_dot_file_name);
+  }
+  if (!trace_file_name.empty()) {
+    open_output(trace_file, trace_file_name, std::ios::binary);
+  }
+  if (!metrics_json_file_name.empty()) {
+    open_output(metrics_json_file, metrics_json_file_name);
+  }
+  if (!metrics_csv_prefix.empty()) {
+    open_output(epochs_csv_file, metrics_csv_prefix + "-epochs.csv");
+    open_output(nodes_csv_file, metrics_csv_prefix + "-nodes.csv");
+    open_output(convergence_csv_file,
+                metrics_csv_prefix + "-convergence.csv");
+  }
+}
+
+void Simulator::run() {
+  current_simulator = this;
+  if (!started) {
+    started = true;
+    if (trace_file.is_open()) {
+      trace_header();
+    }
+    event_steps =
+        (steps_dot_file.is_open() && !epoch_steps) || trace_file.is_open();
+  }
+  start_workers();
+  process_events();
+  stop_workers();
+  if (metrics && hold_epoch == INT_MAX) {
+    write_metrics();
+  }
+  current_simulator = NULL;
+}
+
+void Simulator::run_until(event_time_t epoch) {
+  hold_epoch = epoch;
+  run();
+  hold_epoch = INT_MAX;
+}
+
+void Simulator::add_scenario(const std::vector<topology_line_t> &lines) {
+  scenario.erase(scenario.begin(), scenario.begin() + scenario_line);
+  scenario_line = 0;
+  scenario.insert(scenario.end(), lines.begin(), lines.end());
+  std::stable_sort(scenario.begin(), scenario.end(),
+                   [](const topology_line_t &a, const topology_line_t &b) {
+                     return a.time < b.time;
+                   });
+  if (calendar_started) {
+    assert(calendar_cursor == 0 &&
+           (scenario.empty() || scenario[0].time >= calendar_epoch) &&
+           "Link changes before the checkpoint.");
+    stream_topology(); // Those of the epoch held at.
+  }
+}
+
+// A scenario file has one "<scenario> <time> <node> <node> <cost>" line per
+// link change, on links of the base topology. Scenarios keep the order in
+// which they first appear, their lines the order of the file.
+typedef struct {
+  std::string name;
+  std::vector<topology_line_t> lines;
+} scenario_t;
+
+static std::vector<scenario_t> load_scenarios(const std::string &file_name,
+                                              const base_topology_t &base) {
+  std::ifstream file(file_name);
+  if (!file.is_open()) {
+    std::cerr << "Error opening scenario file: " << file_name << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<scenario_t> scenarios;
+  std::map<std::string, size_t> index;
+  std::string name;
+  topology_line_t line;
+  while (file >> name >> line.time >> line.first_node >> line.second_node >>
+         line.cost) {
+    const auto &links = base.topology.links;
+    if (!std::binary_search(
+            links.begin(), links.end(),
+            std::make_pair(line.first_node, line.second_node))) {
+      std::cerr << "Scenario link not in topology: " << line.first_node
+                << " " << line.second_node << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (line.time < checkpoint) {
+      std::cerr << "Scenario link change before the checkpoint: "
+                << line.time << " " << line.first_node << " "
+                << line.second_node << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    line.first_node = node_rank(base, line.first_node);
+    line.second_node = node_rank(base, line.second_node);
+    auto found = index.insert(std::make_pair(name, scenarios.size()));
+    if (found.second) {
+      scenarios.push_back({name, {}});
+    }
+    scenarios[found.first->second].lines.push_back(line);
+  }
+  if (!file.eof()) {
+    std::cerr << "Syntax error in scenario file." << std::endl;
+    exit(EXIT_FAILURE);
   }
 
-  // Footer.
-  dot_file << "}" << std::endl << std::endl;
+  for (auto &scenario : scenarios) {
+    std::stable_sort(scenario.lines.begin(), scenario.lines.end(),
+                     [](const topology_line_t &a, const topology_line_t &b) {
+                       return a.time < b.time;
+                     });
+  }
+  return scenarios;
 }
 
-static void process_event(event_t event) {
-  switch (event.type) {
-  case LINK_CHANGE: { // Update topology and notify node.
-    set_topology_cost(event.link_change.node, event.link_change.neighbor,
-                      event.link_change.new_cost);
-
-    current_node = event.link_change.node;
-    notify_link_change(event.link_change.neighbor, event.link_change.new_cost);
-    ++num_link_changes;
-  } break;
-
-  case MESSAGE: { // Deliver message to node and free the message buffer.
-    current_node = event.message.destination;
-    notify_receive_message(event.message.source, event.message.content);
-    free(event.message.content);
-    ++num_messages;
-  } break;
+typedef struct {
+  long events, link_changes, messages, timers;
+  event_time_t epochs;
+  long loops, black_holes;
+} sweep_result_t;
 
-  default: {
-    assert(false && "Unknown event type.");
-  }
-  }
+static void get_sweep_result(Simulator &simulator, sweep_result_t &result) {
+  result.events = simulator.get_num_events();
+  result.link_changes = simulator.get_num_link_changes();
+  result.messages = simulator.get_num_messages();
+  result.timers = simulator.get_num_timers();
+  result.epochs = simulator.get_current_time();
+  simulator.count_forwarding_faults(result.loops, result.black_holes);
 }
 
-static void process_events() {
-  // Continue until no more events.
-  while (!events.empty() && (max_events < 0 || num_events < max_events)) {
-    current_time = events.begin()->first;
+// Simulate the base topology up to the checkpoint once, then each scenario
+// from there in a fork() of it, which shares the converged state copy on
+// write. Results come back through a pipe.
+static void fork_sweep(const base_topology_t &base,
+                       const std::vector<scenario_t> &scenarios,
+                       int pool_size, std::vector<sweep_result_t> &results) {
+  Simulator simulator(base);
+  simulator.run_until(checkpoint);
+  std::cout.flush(); // Or each child writes it again.
 
-    static event_time_t last_snapshot_epoch = -1;
-    if (!epoch_steps || current_time > last_snapshot_epoch) {
-      dump_network_snapshot(steps_dot_file);
-      last_snapshot_epoch = current_time;
+  typedef struct {
+    pid_t pid;
+    int fd;
+    size_t scenario;
+  } child_t;
+  std::vector<child_t> children;
+  size_t next_scenario = 0;
+  while (next_scenario < scenarios.size() || !children.empty()) {
+    if (next_scenario < scenarios.size() &&
+        children.size() < (size_t)pool_size) {
+      int fds[2];
+      pid_t pid = -1;
+      if (pipe(fds) == 0 && (pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+      if (pid < 0) {
+        perror("Error forking scenario");
+        exit(EXIT_FAILURE);
+      }
+      if (pid == 0) {
+        close(fds[0]);
+        simulator.add_scenario(scenarios[next_scenario].lines);
+        simulator.run();
+        sweep_result_t result;
+        get_sweep_result(simulator, result);
+        bool sent = write(fds[1], &result, sizeof(result)) == sizeof(result);
+        _exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+      close(fds[1]);
+      children.push_back({pid, fds[0], next_scenario++});
+      continue;
     }
 
-    // Remove event from queue and process it.
-    event_t event = events.begin()->second;
-    events.erase(events.begin());
-
-    process_event(event);
-    ++num_events;
+    // A result fits in the pipe, so children exit without being read.
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    auto child = std::find_if(children.begin(), children.end(),
+                              [&](const child_t &c) { return c.pid == pid; });
+    if (child == children.end()) {
+      continue;
+    }
+    sweep_result_t &result = results[child->scenario];
+    bool received =
+        read(child->fd, &result, sizeof(result)) == sizeof(result);
+    close(child->fd);
+    if (!received || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) {
+      std::cerr << "Scenario failed: " << scenarios[child->scenario].name
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    children.erase(child);
   }
-  dump_network_snapshot(steps_dot_file);
-  dump_network_snapshot(final_dot_file);
 }
 
-static void show_usage(std::string command) {
-  std::cerr                                                             //
-      << "Usage: " << command                                           //
-      << " [--epoch-steps]"                                             //
-      << " [--final-dot <dot-file>]"                                    //
-      << " [--help]"                                                    //
-      << " [--hide-future-messages]"                                    //
-      << " [--max-events <limit>]"                                      //
-      << " [--show-routes-for <node>]"                                  //
-      << " [--steps-dot <dot-file>]"                                    //
-      << " [--] <topology-file>" << std::endl                           //
-      << std::endl                                                      //
-      << " --epoch-steps             "                                  //
-      << "- Only show one step per epoch in the steps dot file."        //
-      << std::endl                                                      //
-      << " --final-dot <dot-file>    "                                  //
-      << "- Generate a dot file showing the final result."              //
-      << std::endl                                                      //
-      << " --help                    "                                  //
-      << "- Show this help screen."                                     //
-      << std::endl                                                      //
-      << " --hide-future-messages    "                                  //
-      << "- Declutter dot files by only showing the current message "   //
-      << "(default: show)."                                             //
-      << std::endl                                                      //
-      << " --max-events <limit>      "                                  //
-      << "- Put a limit on the number of simulation events to process " //
-      << "(default: no limit)."                                         //
-      << std::endl                                                      //
-      << " --show-routes-for <node>  "                                  //
-      << "- Declutter dot files by only showing routes for <node> "     //
-      << "(default: show all)."                                         //
-      << std::endl                                                      //
-      << " --steps-dot <dot-file>    "                                  //
-      << "- Generate a dot file showing each simulation step."          //
-      << std::endl;
-  exit(EXIT_FAILURE);
-}
+// Simulate every scenario on the base topology, pool_size at a time, and
+// write one CSV line of results for each, in scenario order.
+static void run_sweep(const base_topology_t &base,
+                      const std::vector<scenario_t> &scenarios,
+                      int pool_size) {
+  std::vector<sweep_result_t> results(scenarios.size());
+  if (checkpoint >= 0) {
+    fork_sweep(base, scenarios, pool_size, results);
+  } else {
+    std::atomic<size_t> next_scenario{0};
+    auto sweep_worker = [&]() {
+      for (size_t s; (s = next_scenario++) < scenarios.size();) {
+        Simulator simulator(base, scenarios[s].lines);
+        simulator.run();
+        get_sweep_result(simulator, results[s]);
+      }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < pool_size; ++t) {
+      pool.emplace_back(sweep_worker);
+    }
+    sweep_worker();
+    for (auto &thread : pool) {
+      thread.join();
+    }
+  }
 
-static void report_stats() {
-  std::cout << "Simulated network of " << nodes.size() << " nodes with "
-            << num_events << " events." << std::endl
-            << "Processed " << num_link_changes << " link change events."
-            << std::endl
-            << "Processed " << num_messages << " messages." << std::endl
-            << "Simulation converged after " << current_time << " time epochs."
+  std::cout << "scenario,events,link_changes,messages,timers,epochs,loops,"
+               "black_holes"
             << std::endl;
+  for (size_t s = 0; s < scenarios.size(); ++s) {
+    const sweep_result_t &result = results[s];
+    std::cout << scenarios[s].name << "," << result.events << ","
+              << result.link_changes << "," << result.messages << ","
+              << result.timers << "," << result.epochs << "," << result.loops
+              << "," << result.black_holes << std::endl;
+  }
 }
 
 int main(int argc, char *argv[]) {
   // Parse command-line arguments.
   std::string topology_file_name;
-  std::string steps_dot_file_name = "/dev/null";
-  std::string final_dot_file_name = "/dev/null";
+  std::string steps_dot_file_name;
+  std::string final_dot_file_name;
+  std::string trace_file_name;
+  std::string metrics_csv_prefix;
+  std::string metrics_json_file_name;
+  std::string sweep_file_name;
+  std::string traffic_file_name;
   bool positional_mode = false;
 
   for (int a = 1; a < argc; ++a) {
     std::string arg = argv[a];
-    if (arg == "--epoch-steps") {
+    if (arg == "--alloc-stats") {
+      alloc_stats = true;
+    } else if (arg == "--checkpoint") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        checkpoint = std::stoi(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+      if (checkpoint < 0) {
+        show_usage(argv[0]);
+      }
+    } else if (arg == "--epoch-steps") {
       epoch_steps = true;
     } else if (arg == "--final-dot") {
       if (argc <= a + 1) {
@@ -366,6 +2233,20 @@ int main(int argc, char *argv[]) {
       show_usage(argv[0]);
     } else if (arg == "--hide-future-messages") {
       show_future_messages = false;
+    } else if (arg == "--hold-down") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        hold_down = std::stoi(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+      if (hold_down < 0) {
+        show_usage(argv[0]);
+      }
+    } else if (arg == "--malloc-messages") {
+      pool_messages = false;
     } else if (arg == "--max-events") {
       if (argc <= a + 1) {
         show_usage(argv[0]);
@@ -375,6 +2256,37 @@ int main(int argc, char *argv[]) {
       } catch (...) {
         show_usage(argv[0]);
       }
+    } else if (arg == "--metrics-csv") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      metrics_csv_prefix = argv[++a];
+    } else if (arg == "--metrics-json") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      metrics_json_file_name = argv[++a];
+    } else if (arg == "--packets") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        packets = std::stol(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+      if (packets < 1) {
+        show_usage(argv[0]);
+      }
+    } else if (arg == "--seed") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        seed = std::stoul(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
     } else if (arg == "--show-routes-for") {
       if (argc <= a + 1) {
         show_usage(argv[0]);
@@ -389,6 +2301,45 @@ int main(int argc, char *argv[]) {
         show_usage(argv[0]);
       }
       steps_dot_file_name = argv[++a];
+    } else if (arg == "--sweep") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      sweep_file_name = argv[++a];
+    } else if (arg == "--threads") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        num_threads = std::stoi(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+      if (num_threads < 1) {
+        show_usage(argv[0]);
+      }
+    } else if (arg == "--trace") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      trace_file_name = argv[++a];
+    } else if (arg == "--traffic") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      traffic_file_name = argv[++a];
+    } else if (arg == "--ttl") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        ttl = std::stoi(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+      if (ttl < 1) {
+        show_usage(argv[0]);
+      }
     } else if (arg == "--") {
       positional_mode = true;
     } else {
@@ -404,33 +2355,45 @@ int main(int argc, char *argv[]) {
   if (topology_file_name.empty()) {
     show_usage(argv[0]);
   }
-  topology_file.open(topology_file_name);
-  if (!topology_file.is_open()) {
+  bool outputs = !steps_dot_file_name.empty() ||
+                 !final_dot_file_name.empty() || !trace_file_name.empty() ||
+                 !metrics_json_file_name.empty() || !metrics_csv_prefix.empty();
+  if ((!sweep_file_name.empty() && (outputs || packets > 0)) ||
+      (sweep_file_name.empty() && checkpoint >= 0) ||
+      (packets == 0 && (!traffic_file_name.empty() || ttl > 0))) {
+    show_usage(argv[0]);
+  }
+  base_topology_t base;
+  if (!open_topology(topology_file_name, base.topology)) {
     std::cerr << "Error opening topology file: " << topology_file_name
               << std::endl;
     exit(EXIT_FAILURE);
   }
+  // The data plane goes by the epochs of the metrics.
+  metrics = !metrics_json_file_name.empty() || !metrics_csv_prefix.empty() ||
+            packets > 0;
 
-  steps_dot_file.open(steps_dot_file_name);
-  if (!steps_dot_file.is_open()) {
-    std::cerr << "Error opening output file: " << steps_dot_file_name
-              << std::endl;
-    exit(EXIT_FAILURE);
+  // Load network topology, shared by every simulation of it.
+  load_base_topology(base);
+  if (packets > 0) {
+    load_traffic(base, traffic_file_name);
   }
-
-  final_dot_file.open(final_dot_file_name);
-  if (!final_dot_file.is_open()) {
-    std::cerr << "Error opening output file: " << final_dot_file_name
-              << std::endl;
-    exit(EXIT_FAILURE);
+  if (!sweep_file_name.empty()) {
+    std::vector<scenario_t> scenarios = load_scenarios(sweep_file_name, base);
+    int pool_size = num_threads;
+    num_threads = 1; // Each scenario runs on a single thread.
+    run_sweep(base, scenarios, pool_size);
+    return 0;
   }
 
-  // Load network topology and create the initial set of link change events.
-  load_topology_events();
   // Process events until none are left.
-  process_events();
+  Simulator simulator(base);
+  simulator.open_outputs(steps_dot_file_name, final_dot_file_name,
+                         trace_file_name, metrics_json_file_name,
+                         metrics_csv_prefix);
+  simulator.run();
   // Show final report.
-  report_stats();
+  simulator.report_stats();
   return 0;
 }
 
@@ -440,50 +2403,317 @@ int main(int argc, char *argv[]) {
 
 node_t get_current_node() { return current_node; }
 
-void *get_state() { return node_states[current_node]; }
+void *Simulator::get_state() { return node_states[node_slot(current_node)]; }
 
-void set_state(void *state) {
-  if (node_states[current_node] && node_states[current_node] != state) {
-    free(node_states[current_node]);
+void Simulator::set_state(void *state) {
+  void *&current_state = node_states[node_slot(current_node)];
+  if (current_state && current_state != state) {
+    (state_destructor ? state_destructor.load() : free)(current_state);
   }
 
-  node_states[current_node] = state;
+  current_state = state;
+}
+
+void Simulator::set_state_destructor(void (*free_state)(void *state)) {
+  state_destructor = free_state;
 }
 
-node_t get_first_node() { return *nodes.begin(); }
+node_t Simulator::get_first_node() { return first_node; }
 
-node_t get_last_node() { return *nodes.rbegin(); }
+node_t Simulator::get_last_node() { return last_node; }
 
-cost_t get_link_cost(node_t neighbor) {
+int Simulator::get_neighbors(const node_t **neighbors) {
+  int slot = node_slot(current_node);
+  *neighbors = link_neighbor.data() + link_begin[slot];
+  return link_begin[slot + 1] - link_begin[slot];
+}
+
+cost_t Simulator::get_link_cost(node_t neighbor) {
   return get_topology_cost(current_node, neighbor);
 }
 
-void set_route(node_t destination, node_t next_hop, cost_t cost) {
-  assert(nodes.count(current_node) && "Current node unknown.");
-  assert((nodes.count(destination) || cost == COST_INFINITY) &&
+void Simulator::set_route(node_t destination, node_t next_hop, cost_t cost) {
+  assert(is_node(current_node) && "Current node unknown.");
+  assert((is_node(destination) || cost == COST_INFINITY) &&
          "Route destination unknown.");
-  assert((nodes.count(next_hop) || cost == COST_INFINITY) &&
+  assert((is_node(next_hop) || cost == COST_INFINITY) &&
          "Route next hop unknown.");
   assert((get_link_cost(next_hop) < COST_INFINITY || cost == COST_INFINITY) &&
          "Route next hop not a neighbor.");
 
-  if (cost < COST_INFINITY) {
-    routes[current_node][destination] = std::make_pair(next_hop, cost);
+  if (!is_node(destination)) {
+    return; // Removing a route that cannot exist.
+  }
+  size_t route =
+      (size_t)node_slot(current_node) * node_span + node_slot(destination);
+  if (metrics) {
+    long counters_t::*counter =
+        route_cost[route] == COST_INFINITY
+            ? (cost < COST_INFINITY ? &counters_t::route_installs : NULL)
+        : cost == COST_INFINITY ? &counters_t::route_withdrawals
+        : route_cost[route] != cost || route_next_hop[route] != next_hop
+            ? &counters_t::route_changes
+            : NULL;
+    if (counter) {
+      ++(this_worker().counters.*counter);
+      ++(node_metrics[node_slot(current_node)].*counter);
+      if (packets > 0) {
+        this_worker().routes_set.push_back(route);
+      }
+    }
+  }
+  if (trace_file.is_open() &&
+      (route_cost[route] != cost ||
+       (cost < COST_INFINITY && route_next_hop[route] != next_hop))) {
+    if (cost < COST_INFINITY) {
+      trace_buffer += (char)TRACE_ROUTE;
+      trace_put_signed(trace_buffer, node_id(destination));
+      trace_put_signed(trace_buffer, node_id(next_hop));
+      trace_put(trace_buffer, cost);
+    } else {
+      trace_buffer += (char)TRACE_ROUTE_ERASE;
+      trace_put_signed(trace_buffer, node_id(destination));
+    }
+  }
+  route_next_hop[route] = next_hop;
+  route_cost[route] = cost;
+}
+
+event_t Simulator::message_event(void *message) {
+  event_t event;
+  event.type = MESSAGE;
+  event.message.source = current_node;
+  event.message.content = message;
+  event.message.pooled =
+      pool_messages &&
+      arena_owns(this_worker().arenas[(current_time + 1) & 1], message);
+  event.message.shared = NULL;
+  event.message.size = 0;
+  for (const auto &allocation : this_worker().allocated) {
+    if (allocation.first == message) {
+      event.message.size = std::min(allocation.second, (size_t)UINT_MAX);
+    }
+  }
+  return event;
+}
+
+// Schedule an event from a router, through the outbox on worker threads.
+void Simulator::post_event(event_time_t time, const event_t &event) {
+  if (current_worker) {
+    current_worker->outbox.push_back({current_event, time, event});
   } else {
-    routes[current_node].erase(destination);
+    schedule_event(time, event);
   }
 }
 
-void send_message(node_t neighbor, void *message) {
+// 64 random bits, the same for the same input.
+static uint64_t mix_bits(uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// When the message gets across the link, false if it gets lost. Only the
+// sending node uses a direction of a link, so its workers agree on the
+// order of the messages, and losses depend only on the seed.
+bool Simulator::model_link(int link, event_t &event, event_time_t &time) {
+  link_model_t &model = link_models[link];
+  event_time_t sent = current_time;
+  if (model.bandwidth > 0) {
+    if (model.busy_epoch < current_time) {
+      model.busy_epoch = current_time;
+      model.busy_bytes = 0;
+    }
+    uint64_t bytes = (uint64_t)model.busy_bytes + event.message.size;
+    uint64_t epochs = bytes / model.bandwidth;
+    model.busy_bytes = bytes % model.bandwidth;
+    model.busy_epoch += epochs;
+    sent = model.busy_epoch - (model.busy_bytes == 0 && epochs > 0);
+  }
+  time = std::max<event_time_t>(sent + model.delay, model.last_delivery);
+  model.last_delivery = time;
+
+  uint64_t draw = mix_bits(seed ^ mix_bits((uint64_t)link << 32 ^ model.sent++));
+  if (draw % 1000000 >= model.loss) {
+    return true;
+  }
+  if (!event.message.pooled) {
+    shared_message_t *shared = event.message.shared;
+    if (!shared || shared->deliveries.fetch_sub(1) == 1) {
+      free(event.message.content);
+      delete shared;
+    }
+  }
+  return false;
+}
+
+// Send message over the link, during the next epoch unless the link model
+// says otherwise.
+void Simulator::post_message(event_t event, int link) {
+  if (metrics) {
+    for (counters_t *counters :
+         {&this_worker().counters, &node_metrics[node_slot(current_node)]}) {
+      ++counters->messages_sent;
+      counters->bytes_sent += event.message.size;
+    }
+  }
+  event_time_t time = current_time + 1;
+  if (!link_models.empty()) {
+    if (!model_link(link, event, time)) {
+      if (metrics) {
+        ++this_worker().counters.messages_lost;
+        ++node_metrics[node_slot(current_node)].messages_lost;
+      }
+      return;
+    }
+    if (time != current_time + 1 && event.message.pooled) {
+      // Its arena is reclaimed after the next epoch.
+      void *content = malloc(std::max(event.message.size, 1u));
+      memcpy(content, event.message.content, event.message.size);
+      event.message.content = content;
+      event.message.pooled = false;
+    }
+  }
+  if (trace_file.is_open()) {
+    if (time == current_time + 1) {
+      trace_buffer += (char)TRACE_SEND;
+      trace_put_signed(trace_buffer, node_id(event.message.destination));
+    } else {
+      trace_buffer += (char)TRACE_SEND_LATE;
+      trace_put_signed(trace_buffer, node_id(event.message.destination));
+      trace_put(trace_buffer, time - current_time);
+    }
+  }
+  post_event(time, event);
+}
+
+void Simulator::send_message(node_t neighbor, void *message) {
   assert(neighbor != current_node && "Sending message to self.");
   assert(get_link_cost(neighbor) < COST_INFINITY &&
          "Message destination not a neighbor.");
 
-  // Send message during the next epoch.
-  event_t event;
-  event.type = MESSAGE;
-  event.message.source = current_node;
+  event_t event = message_event(message);
   event.message.destination = neighbor;
-  event.message.content = message;
-  events.insert(std::make_pair(current_time + 1, event));
+  post_message(event,
+               link_models.empty() ? -1 : find_link(current_node, neighbor));
+}
+
+void Simulator::broadcast_message(void *message, const node_t *except, int n_except) {
+  event_t event = message_event(message);
+  int slot = node_slot(current_node);
+  auto receives = [&](int l) {
+    return link_cost[l] < COST_INFINITY &&
+           std::find(except, except + n_except, link_neighbor[l]) ==
+               except + n_except;
+  };
+
+  int deliveries = 0;
+  for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+    deliveries += receives(l);
+  }
+  if (deliveries == 0) {
+    if (!event.message.pooled) {
+      free(message);
+    }
+    return;
+  }
+  if (!event.message.pooled && deliveries > 1) {
+    event.message.shared = new shared_message_t{{deliveries}};
+  }
+
+  // Same order as a send_message() loop over the neighbors.
+  for (int l = link_begin[slot]; l < link_begin[slot + 1]; ++l) {
+    if (receives(l)) {
+      event.message.destination = link_neighbor[l];
+      post_message(event, l);
+    }
+  }
+}
+
+void *Simulator::alloc_message(size_t size) {
+  worker_t &worker = this_worker();
+  auto start = alloc_clock();
+  void *message = pool_messages
+                      ? arena_alloc(worker.arenas[(current_time + 1) & 1], size)
+                      : malloc(size);
+  worker.alloc_time += alloc_clock() - start;
+  ++worker.allocations;
+  worker.allocated_bytes += size;
+  if (metrics || !link_models.empty()) {
+    worker.allocated.push_back(std::make_pair(message, size));
+  }
+  return message;
+}
+
+int get_hold_down() { return hold_down; }
+
+void hold_down_send(hold_down_t *hold, void (*send)(void *state), void *state) {
+  if (hold->holding) {
+    hold->pending = 1;
+    return;
+  }
+  send(state);
+  if (hold_down > 0) {
+    hold->holding = 1;
+    set_timer(hold_down);
+  }
+}
+
+void hold_down_over(hold_down_t *hold, void (*send)(void *state), void *state) {
+  hold->holding = 0;
+  if (hold->pending) {
+    hold->pending = 0;
+    hold_down_send(hold, send, state);
+  }
+}
+
+// Routers without timers need not define notify_timer().
+__attribute__((weak)) void notify_timer() {}
+
+void Simulator::set_timer(int delay) {
+  assert(delay > 0 && "Timer not in the future.");
+  event_t event;
+  event.type = TIMER;
+  event.timer.node = current_node;
+  post_event(current_time + delay, event);
+}
+
+// The router API proper, for the simulation running on this thread.
+void *get_state() { return current_simulator->get_state(); }
+
+void set_state(void *state) { current_simulator->set_state(state); }
+
+void set_state_destructor(void (*free_state)(void *state)) {
+  current_simulator->set_state_destructor(free_state);
+}
+
+node_t get_first_node() { return current_simulator->get_first_node(); }
+
+node_t get_last_node() { return current_simulator->get_last_node(); }
+
+int get_neighbors(const node_t **neighbors) {
+  return current_simulator->get_neighbors(neighbors);
+}
+
+cost_t get_link_cost(node_t neighbor) {
+  return current_simulator->get_link_cost(neighbor);
+}
+
+void set_route(node_t destination, node_t next_hop, cost_t cost) {
+  current_simulator->set_route(destination, next_hop, cost);
 }
+
+void *alloc_message(size_t size) {
+  return current_simulator->alloc_message(size);
+}
+
+void send_message(node_t neighbor, void *message) {
+  current_simulator->send_message(neighbor, message);
+}
+
+void broadcast_message(void *message, const node_t *except, int n_except) {
+  current_simulator->broadcast_message(message, except, n_except);
+}
+
+void set_timer(int delay) { current_simulator->set_timer(delay); }
@@ -1,18 +1,39 @@
+#ifndef ROUTING_SIMULATOR_H
+#define ROUTING_SIMULATOR_H
+
+#include <stddef.h>
 #include <stdint.h>
 
 typedef int node_t;
-#define MAX_NODES 100
+
+// Cost width is a build option: make COST_BITS=16 or COST_BITS=32 (after a
+// make clean) for costs past 254. The largest cost is COST_INFINITY.
+#ifndef COST_BITS
+#define COST_BITS 8
+#endif
+#if COST_BITS == 8
 typedef uint8_t cost_t;
-#define COST_INFINITY 255
+#elif COST_BITS == 16
+typedef uint16_t cost_t;
+#elif COST_BITS == 32
+typedef uint32_t cost_t;
+#else
+#error "COST_BITS must be 8, 16 or 32."
+#endif
+#define COST_INFINITY ((cost_t)-1)
 
 #define COST_ADD(a, b)                                                         \
-  (((int)(a)) + ((int)(b)) < COST_INFINITY ? (a) + (b) : COST_INFINITY)
+  ((uint64_t)(a) + (uint64_t)(b) < COST_INFINITY ? (cost_t)((a) + (b))         \
+                                                 : COST_INFINITY)
 
 extern "C" {
 /******************************************************************************\
 * Router API                                                                   *
 * Router module must include implementations for the handler functions         *
 * and may use the command functions as needed.                                 *
+* With --threads, handlers run concurrently for different nodes, and with     *
+* --sweep for different simulations: keep all router data in the node state,   *
+* not in globals.                                                              *
 \******************************************************************************/
 
 // Handlers to implement in router module.
@@ -22,6 +43,10 @@ void notify_link_change(node_t neighbor, cost_t new_cost);
 // Receive a message sent by a neighboring node.
 void notify_receive_message(node_t sender, void *message);
 
+// Called when a timer from set_timer() goes off. Optional: the simulator
+// has a default that does nothing, for routers without timers.
+void notify_timer();
+
 // Commands to use.
 // Get the current node ID.
 node_t get_current_node();
@@ -33,16 +58,60 @@ void *get_state();
 // Buffer may subsequently be updated or changed in place.
 void set_state(void *state);
 
-// Functions to help with iterating over nodes.
+// Free node states with free_state() instead of free(), for states that own
+// other buffers: they are freed when replaced and when the simulation ends.
+void set_state_destructor(void (*free_state)(void *state));
+
+// Functions to help with iterating over nodes. Routers see the nodes
+// numbered get_first_node() to get_last_node() in ID order, whatever IDs the
+// topology file uses; traces, dot files and metrics show those IDs.
 node_t get_first_node();
 node_t get_last_node();
 
+// Get the nodes the current node has a link to at any time in the topology,
+// sorted by ID, and return their count. A link may currently cost
+// COST_INFINITY. The array stays valid for the whole simulation.
+int get_neighbors(const node_t **neighbors);
+
 // Get the cost of a neighboring link. returns COST_INFINITY if not a neighbor.
 cost_t get_link_cost(node_t neighbor);
 
 // Set or update the rout to destination, via the next_hop.
 void set_route(node_t destination, node_t next_hop, cost_t cost);
 
+// Allocate a message for send_message() or broadcast_message(). Its memory
+// is reclaimed in bulk once the epoch that delivers it is over: send it from
+// the same handler and keep no pointer to it. Messages from malloc() work
+// too, and are freed after delivery.
+void *alloc_message(size_t size);
+
 // Send a message to a neighboring node.
 void send_message(node_t neighbor, void *message);
+
+// Send a message to every neighbor whose link is up, in neighbor order,
+// except the n_except nodes listed in except (NULL if none). They all get the
+// same buffer, so receivers must not modify it. It is freed after the last
+// delivery, or right away if nobody receives it.
+void broadcast_message(void *message, const node_t *except, int n_except);
+
+// Get the number of epochs the --hold-down option asks routers to wait after
+// a triggered update before sending the next one, 0 for no wait.
+int get_hold_down();
+
+// Call notify_timer() for the current node delay epochs from now, delay > 0.
+void set_timer(int delay);
+
+// Triggered updates under --hold-down, in a zeroed hold_down_t of the node
+// state. hold_down_send() calls send(state) right away and then holds down
+// for get_hold_down() epochs: updates asked for meanwhile go out as one when
+// notify_timer() calls hold_down_over().
+typedef struct {
+  int holding; // Holding down after a triggered update,
+  int pending; // with route changes waiting for the next.
+} hold_down_t;
+
+void hold_down_send(hold_down_t *hold, void (*send)(void *state), void *state);
+void hold_down_over(hold_down_t *hold, void (*send)(void *state), void *state);
 }
+
+#endif
@@ -0,0 +1,104 @@
+#!/bin/bash
+
+set -euo pipefail
+
+# Usage: scaling-benchmark.sh [sizes...]
+# Runs every simulator on each gen-net topology model at growing numbers of
+# nodes, with one random link failure and recovery per four nodes, and
+# writes one CSV row per run to standard output. Uses the optimised builds
+# from make opt. Set MODELS, ROUTERS, SEED or TIMEOUT (seconds per run) to
+# change the defaults, and FLAGS for extra simulator flags.
+#
+# convergence_epochs is the longest time from link changes to the last
+# message or route update, among the periods no later change interrupted,
+# from a second run with --metrics-json so that collecting the metrics does
+# not count in the timings. interrupted counts the other periods.
+SIZES="${*:-16 32 64 128 256}"
+MODELS="${MODELS:-ring grid fat-tree er ba waxman}"
+ROUTERS="${ROUTERS:-dv dvrpp pv ls}"
+SEED="${SEED:-1}"
+TIMEOUT="${TIMEOUT:-300}"
+
+cd "$(dirname "$0")"
+
+TEMP_DIR="$(mktemp -d)"
+
+function cleanup {
+  rm -rf "$TEMP_DIR"
+}
+trap cleanup EXIT
+
+
+make --quiet opt >&2
+
+# Field of the simulator output, by the text around it.
+function field {
+  sed -n "s/.*$1 \\([0-9]*\\) $2.*/\\1/p" "$TEMP_DIR/output" | head -1
+}
+
+# Longest uninterrupted convergence period and the number of interrupted
+# ones, from the convergence list of the metrics, one period per line.
+function convergence {
+  awk '/"convergence": \[/ { periods = 1; next }
+       periods && /^  \]/ { exit }
+       periods {
+         epochs = $0
+         sub(/.*"epochs": /, "", epochs)
+         sub(/,.*/, "", epochs)
+         if ($0 ~ /"interrupted": true/) {
+           interrupted++
+         } else if (epochs + 0 > longest) {
+           longest = epochs + 0
+         }
+       }
+       END { printf "%d,%d", longest, interrupted }' "$TEMP_DIR/metrics.json"
+}
+
+echo "router,model,nodes,links,link_events,wall_ms,events,events_per_s,"`
+     `"messages,peak_kb,convergence_epochs,interrupted,status"
+for SIZE in $SIZES; do
+  for MODEL in $MODELS; do
+    TOPOLOGY="$TEMP_DIR/$MODEL-$SIZE.net"
+    if ! opt/gen-net --seed "$SEED" --failures $((SIZE / 4)) "$MODEL" \
+      "$SIZE" > "$TOPOLOGY"; then
+      continue # No such topology at this size.
+    fi
+    NODES="$(awk '{ print $2; print $3 }' "$TOPOLOGY" | sort -u | wc -l)"
+    LINKS="$(awk '$1 == 0' "$TOPOLOGY" | wc -l)"
+    LINK_EVENTS="$(wc -l < "$TOPOLOGY")"
+
+    for ROUTER in $ROUTERS; do
+      STATUS=ok
+      START=$(date +%s%N)
+      # shellcheck disable=SC2086
+      timeout "$TIMEOUT" "opt/$ROUTER-simulator" ${FLAGS:-} --alloc-stats \
+        "$TOPOLOGY" > "$TEMP_DIR/output" 2>&1 || STATUS=$?
+      END=$(date +%s%N)
+      case "$STATUS" in
+        ok) ;;
+        124) STATUS=timeout ;;
+        *) STATUS="failed ($STATUS)" ;;
+      esac
+
+      CONVERGENCE=,
+      if [ "$STATUS" = ok ]; then
+        # shellcheck disable=SC2086
+        if timeout "$TIMEOUT" "opt/$ROUTER-simulator" ${FLAGS:-} \
+          --metrics-json "$TEMP_DIR/metrics.json" "$TOPOLOGY" > /dev/null 2>&1
+        then
+          CONVERGENCE="$(convergence)"
+        fi
+      fi
+
+      WALL_US=$(( (END - START) / 1000 ))
+      EVENTS="$(field "with" "events")"
+      echo "$ROUTER,$MODEL,$NODES,$LINKS,$LINK_EVENTS,"`
+           `"$(awk -v us="$WALL_US" 'BEGIN { printf "%.1f", us / 1000 }'),"`
+           `"$EVENTS,"`
+           `"$(awk -v us="$WALL_US" -v e="$EVENTS" \
+                 'BEGIN { if (e != "") printf "%.0f", e * 1e6 / (us ? us : 1) }'),"`
+           `"$(field "Processed" "messages"),$(field "size:" "KB"),"`
+           `"$CONVERGENCE,$STATUS"
+    done
+  done
+done
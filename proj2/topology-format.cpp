@@ -0,0 +1,343 @@
+/******************************************************************************\
+* Topology files, text (.net) or binary, mapped in memory and read one line    *
+* at a time.                                                                   *
+\******************************************************************************/
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "topology-format.h"
+#include "trace-format.h"
+
+bool open_topology(const std::string &file_name, topology_t &topology) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) < 0) {
+    close(fd);
+    return false;
+  }
+
+  topology.size = status.st_size;
+  if (topology.size > 0) {
+    void *data = mmap(NULL, topology.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(data, topology.size, MADV_SEQUENTIAL);
+    topology.data = (const char *)data;
+  }
+  close(fd); // The mapping stays.
+
+  const size_t magic = sizeof(TOPOLOGY_MAGIC) - 1;
+  static_assert(sizeof(TOPOLOGY_PROPERTIES_MAGIC) - 1 == magic,
+                "Binary topology magics differ in length.");
+  topology.properties =
+      topology.size >= magic &&
+      memcmp(topology.data, TOPOLOGY_PROPERTIES_MAGIC, magic) == 0;
+  topology.binary = topology.properties ||
+                    (topology.size >= magic &&
+                     memcmp(topology.data, TOPOLOGY_MAGIC, magic) == 0);
+  topology.cursor = topology.data;
+  return true;
+}
+
+static bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// One field of a text line: leading blanks, then a number.
+template <typename T>
+static bool parse_field(const char *&cursor, const char *end, T &value) {
+  while (cursor < end && is_blank(*cursor)) {
+    ++cursor;
+  }
+  auto result = std::from_chars(cursor, end, value);
+  if (result.ec != std::errc()) {
+    return false;
+  }
+  cursor = result.ptr;
+  return true;
+}
+
+// The link properties after the cost, as many as there are numbers.
+static bool parse_properties(const char *&cursor, const char *end,
+                             topology_line_t &line) {
+  auto number_follows = [&]() {
+    while (cursor < end && is_blank(*cursor)) {
+      ++cursor;
+    }
+    return cursor < end && *cursor >= '0' && *cursor <= '9';
+  };
+  line.properties = 0;
+  if (!number_follows()) {
+    return true;
+  }
+  if (!parse_field(cursor, end, line.delay) || line.delay < 1) {
+    return false;
+  }
+  line.properties |= LINK_DELAY;
+  if (!number_follows()) {
+    return true;
+  }
+  if (!parse_field(cursor, end, line.bandwidth)) {
+    return false;
+  }
+  line.properties |= LINK_BANDWIDTH;
+  if (!number_follows()) {
+    return true;
+  }
+  double loss;
+  if (!parse_field(cursor, end, loss) || loss > 1) {
+    return false;
+  }
+  line.loss = std::lround(loss * 1000000);
+  line.properties |= LINK_LOSS;
+  return true;
+}
+
+static topology_read_t read_text_line(topology_t &topology,
+                                      topology_line_t &line) {
+  const char *end = topology.data + topology.size;
+  const char *&cursor = topology.cursor;
+  if (cursor == end) {
+    return TOPOLOGY_END;
+  }
+
+  if (!parse_field(cursor, end, line.time) ||
+      !parse_field(cursor, end, line.first_node) ||
+      !parse_field(cursor, end, line.second_node)) {
+    return TOPOLOGY_ERROR;
+  }
+  // Like operator>>, take a negative cost modulo ULONG_MAX + 1.
+  while (cursor < end && is_blank(*cursor)) {
+    ++cursor;
+  }
+  bool negative = cursor < end && *cursor == '-';
+  cursor += negative;
+  if (!parse_field(cursor, end, line.cost)) {
+    return TOPOLOGY_ERROR;
+  }
+  if (negative) {
+    line.cost = -line.cost;
+  }
+  if (!parse_properties(cursor, end, line)) {
+    return TOPOLOGY_ERROR;
+  }
+
+  // Anything else on the line is ignored.
+  const char *newline = (const char *)memchr(cursor, '\n', end - cursor);
+  cursor = newline ? newline + 1 : end;
+  topology.time = line.time;
+  return TOPOLOGY_LINE;
+}
+
+static topology_read_t read_binary_line(topology_t &topology,
+                                        topology_line_t &line) {
+  const char *end = topology.data + topology.size;
+  const char *&cursor = topology.cursor;
+  if (cursor == end) {
+    return TOPOLOGY_END;
+  }
+
+  int64_t delta, first_node, second_node;
+  uint64_t cost;
+  if (!trace_get_signed(cursor, end, delta) ||
+      !trace_get_signed(cursor, end, first_node) ||
+      !trace_get_signed(cursor, end, second_node) ||
+      !trace_get(cursor, end, cost)) {
+    return TOPOLOGY_ERROR;
+  }
+  line.time = topology.time + delta;
+  line.first_node = first_node;
+  line.second_node = second_node;
+  line.cost = cost;
+  line.properties = 0;
+  if (topology.properties) {
+    uint64_t properties, delay = 1, bandwidth = 0, loss = 0;
+    if (!trace_get(cursor, end, properties) ||
+        properties > (LINK_DELAY | LINK_BANDWIDTH | LINK_LOSS) ||
+        ((properties & LINK_DELAY) && !trace_get(cursor, end, delay)) ||
+        ((properties & LINK_BANDWIDTH) &&
+         !trace_get(cursor, end, bandwidth)) ||
+        ((properties & LINK_LOSS) && !trace_get(cursor, end, loss)) ||
+        delay < 1 || delay > INT_MAX || loss > 1000000) {
+      return TOPOLOGY_ERROR;
+    }
+    line.properties = properties;
+    line.delay = delay;
+    line.bandwidth = bandwidth;
+    line.loss = loss;
+  }
+  topology.time = line.time;
+  return TOPOLOGY_LINE;
+}
+
+static void sort_links(topology_t &topology) {
+  auto &links = topology.links;
+  std::sort(links.begin(), links.end());
+  links.erase(std::unique(links.begin(), links.end()), links.end());
+}
+
+static bool scan_binary_topology(topology_t &topology) {
+  const char *end = topology.data + topology.size;
+  const char *cursor = topology.data + sizeof(TOPOLOGY_MAGIC) - 1;
+
+  uint64_t count;
+  if (!trace_get(cursor, end, count)) {
+    return false;
+  }
+  for (uint64_t n = 0; n < count; ++n) {
+    int64_t node;
+    if (!trace_get_signed(cursor, end, node)) {
+      return false;
+    }
+    topology.nodes.push_back(node);
+  }
+
+  if (!trace_get(cursor, end, count)) {
+    return false;
+  }
+  for (uint64_t l = 0; l < count; ++l) {
+    int64_t first_node, second_node;
+    if (!trace_get_signed(cursor, end, first_node) ||
+        !trace_get_signed(cursor, end, second_node)) {
+      return false;
+    }
+    topology.links.push_back(std::make_pair(first_node, second_node));
+    topology.links.push_back(std::make_pair(second_node, first_node));
+  }
+  sort_links(topology);
+
+  topology.lines = topology.cursor = cursor;
+  topology.time = 0;
+  topology.sorted = true; // As written by write_binary_topology().
+  return true;
+}
+
+static bool scan_text_topology(topology_t &topology) {
+  std::unordered_set<node_t> known;
+  std::unordered_set<uint64_t> known_links; // Lower node, higher node.
+  topology_line_t line;
+  topology_read_t read;
+  long last_time = 0;
+  bool first_line = true;
+
+  while ((read = read_text_line(topology, line)) == TOPOLOGY_LINE) {
+    for (node_t node : {line.first_node, line.second_node}) {
+      if (known.insert(node).second) {
+        topology.nodes.push_back(node);
+      }
+    }
+    node_t low = std::min(line.first_node, line.second_node);
+    node_t high = std::max(line.first_node, line.second_node);
+    if (known_links.insert((uint64_t)(uint32_t)low << 32 | (uint32_t)high)
+            .second) {
+      topology.links.push_back(std::make_pair(low, high));
+      topology.links.push_back(std::make_pair(high, low));
+    }
+    if (!first_line && line.time < last_time) {
+      topology.sorted = false;
+    }
+    if (line.properties) {
+      topology.properties = true;
+    }
+    last_time = line.time;
+    first_line = false;
+  }
+  if (read == TOPOLOGY_ERROR) {
+    return false;
+  }
+  sort_links(topology);
+
+  topology.lines = topology.cursor = topology.data;
+  topology.time = 0;
+  return true;
+}
+
+bool scan_topology(topology_t &topology) {
+  return topology.binary ? scan_binary_topology(topology)
+                         : scan_text_topology(topology);
+}
+
+topology_read_t read_topology_line(topology_t &topology,
+                                   topology_line_t &line) {
+  if (!topology.binary) {
+    return read_text_line(topology, line);
+  }
+  bool first_line = topology.cursor == topology.lines;
+  long last_time = topology.time;
+  topology_read_t read = read_binary_line(topology, line);
+  if (read == TOPOLOGY_LINE && !first_line && line.time < last_time) {
+    return TOPOLOGY_ERROR; // Out of order.
+  }
+  return read;
+}
+
+topology_t topology_reader(const topology_t &topology) {
+  topology_t reader;
+  reader.data = topology.data;
+  reader.size = topology.size;
+  reader.binary = topology.binary;
+  reader.lines = reader.cursor = topology.lines;
+  reader.sorted = topology.sorted;
+  reader.properties = topology.properties;
+  return reader;
+}
+
+void write_binary_topology(std::ostream &output, const topology_t &topology,
+                           const std::vector<topology_line_t> &lines) {
+  std::string buffer =
+      topology.properties ? TOPOLOGY_PROPERTIES_MAGIC : TOPOLOGY_MAGIC;
+  trace_put(buffer, topology.nodes.size());
+  for (auto node : topology.nodes) {
+    trace_put_signed(buffer, node);
+  }
+  size_t links = std::count_if(
+      topology.links.begin(), topology.links.end(),
+      [](std::pair<node_t, node_t> link) { return link.first <= link.second; });
+  trace_put(buffer, links);
+  for (auto link : topology.links) {
+    if (link.first <= link.second) {
+      trace_put_signed(buffer, link.first);
+      trace_put_signed(buffer, link.second);
+    }
+  }
+
+  long time = 0;
+  for (const auto &line : lines) {
+    trace_put_signed(buffer, line.time - time);
+    trace_put_signed(buffer, line.first_node);
+    trace_put_signed(buffer, line.second_node);
+    trace_put(buffer, line.cost);
+    if (topology.properties) {
+      trace_put(buffer, line.properties);
+      if (line.properties & LINK_DELAY) {
+        trace_put(buffer, line.delay);
+      }
+      if (line.properties & LINK_BANDWIDTH) {
+        trace_put(buffer, line.bandwidth);
+      }
+      if (line.properties & LINK_LOSS) {
+        trace_put(buffer, line.loss);
+      }
+    }
+    time = line.time;
+    if (buffer.size() >= (1 << 16)) {
+      output.write(buffer.data(), buffer.size());
+      buffer.clear();
+    }
+  }
+  output.write(buffer.data(), buffer.size());
+}
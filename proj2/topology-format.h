@@ -0,0 +1,84 @@
+/******************************************************************************\
+* Topology files, text (.net) or binary, mapped in memory and read one line    *
+* at a time.                                                                   *
+\******************************************************************************/
+
+#ifndef TOPOLOGY_FORMAT_H
+#define TOPOLOGY_FORMAT_H
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "routing-simulator.h"
+
+// A text topology has one "<time> <node> <node> <cost>" line per link change,
+// optionally followed by "<delay> <bandwidth> <loss>" or a prefix of them:
+// the link properties, see topology_line_t.
+// A binary one starts with TOPOLOGY_MAGIC, the node count and the nodes in
+// order of first appearance, then the link count and each link once, lower
+// node first. Lines follow in time order: time as a difference from the
+// previous line, both nodes and the cost. Numbers are varints as in traces,
+// node IDs and times zigzag encoded. After TOPOLOGY_PROPERTIES_MAGIC, each
+// line goes on with its properties mask and the properties it has.
+#define TOPOLOGY_MAGIC "RTOPO1"
+#define TOPOLOGY_PROPERTIES_MAGIC "RTOPO2"
+
+// Link properties a line sets.
+#define LINK_DELAY 1
+#define LINK_BANDWIDTH 2
+#define LINK_LOSS 4
+
+// A link change. The properties it does not set keep their last values,
+// for a link that is new: a delay of 1, no bandwidth limit and no loss.
+typedef struct {
+  long time;
+  node_t first_node;
+  node_t second_node;
+  unsigned long cost; // As written, not yet capped at COST_INFINITY.
+  int properties = 0; // LINK_DELAY, LINK_BANDWIDTH and LINK_LOSS set.
+  int delay;          // Epochs from the end of sending to delivery, >= 1.
+  unsigned long bandwidth; // Bytes sent per epoch, 0 for no limit.
+  unsigned long loss;      // Chance of losing a message, in millionths.
+} topology_line_t;
+
+enum topology_read_t { TOPOLOGY_LINE, TOPOLOGY_END, TOPOLOGY_ERROR };
+
+typedef struct {
+  const char *data = NULL; // Whole file, mapped read only.
+  size_t size = 0;
+  bool binary = false;
+  const char *lines = NULL;  // First line.
+  const char *cursor = NULL; // Next line.
+  long time = 0;             // Time of the last line read.
+  // Header of a binary topology, or what a scan of a text one found.
+  std::vector<node_t> nodes; // In order of first appearance.
+  std::vector<std::pair<node_t, node_t>> links; // Both directions, sorted.
+  bool sorted = true;                           // Lines in time order.
+  bool properties = false; // Some line sets link properties.
+} topology_t;
+
+// Map the file. False, with errno set, if it cannot be read.
+bool open_topology(const std::string &file_name, topology_t &topology);
+
+// Fill in nodes, links, sorted and properties, from the header of a binary
+// topology or a pass over every line of a text one, and rewind to the first
+// line. False on a syntax error.
+bool scan_topology(topology_t &topology);
+
+topology_read_t read_topology_line(topology_t &topology,
+                                   topology_line_t &line);
+
+// Another reader of the lines of a scanned topology, from the first. It
+// shares the mapping but not the header, and reading from it leaves
+// topology alone, so that any number of readers can go at once.
+topology_t topology_reader(const topology_t &topology);
+
+// Binary topology with the nodes and links of topology and these lines,
+// which must be in time order. Their properties need
+// TOPOLOGY_PROPERTIES_MAGIC, used only if topology.properties is set.
+void write_binary_topology(std::ostream &output, const topology_t &topology,
+                           const std::vector<topology_line_t> &lines);
+
+#endif
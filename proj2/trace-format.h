@@ -0,0 +1,100 @@
+/******************************************************************************\
+* Binary trace format, written by the simulator with --trace and turned back   *
+* into dot files by trace-to-dot.                                              *
+\******************************************************************************/
+
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <istream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// A trace starts with TRACE_MAGIC, COST_INFINITY and the node count, then
+// every node in ascending order with its color string. Records follow, each
+// a tag byte and its fields. Numbers are LEB128 varints, node IDs and times
+// zigzag encoded first. Only deltas are recorded: events carry what the
+// snapshot before them needs, and the router calls made while handling one
+// are attributed to its node.
+#define TRACE_MAGIC "RTRACE1"
+
+enum trace_tag_t {
+  // Events, in processing order. A snapshot precedes each one.
+  TRACE_LINK_CHANGE = 1, // node, neighbor, new cost.
+  TRACE_DELIVER,         // The earliest message sent is delivered.
+  TRACE_TIMER,           // node.
+  // What the node of the current event does.
+  TRACE_SEND,        // destination. Delivered in the next epoch.
+  TRACE_ROUTE,       // destination, next hop, cost.
+  TRACE_ROUTE_ERASE, // destination.
+  // Epoch of the events that follow, as a difference from the last one.
+  TRACE_TIME,
+  // Last record, optionally followed by the next event left unprocessed.
+  TRACE_END,
+  // destination, epochs until delivery. A send with a link delay.
+  TRACE_SEND_LATE,
+};
+
+static inline void trace_put(std::string &buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer += (char)(value | 0x80);
+    value >>= 7;
+  }
+  buffer += (char)value;
+}
+
+static inline void trace_put_signed(std::string &buffer, int64_t value) {
+  trace_put(buffer, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// False at the end of the input or on a truncated varint.
+static inline bool trace_get(std::istream &input, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = input.get();
+    if (byte == EOF) {
+      return false;
+    }
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline bool trace_get_signed(std::istream &input, int64_t &value) {
+  uint64_t zigzag;
+  if (!trace_get(input, zigzag)) {
+    return false;
+  }
+  value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+  return true;
+}
+
+// The same from memory, moving input on, never past end.
+static inline bool trace_get(const char *&input, const char *end,
+                             uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && input < end; shift += 7) {
+    unsigned char byte = *input++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline bool trace_get_signed(const char *&input, const char *end,
+                                    int64_t &value) {
+  uint64_t zigzag;
+  if (!trace_get(input, end, zigzag)) {
+    return false;
+  }
+  value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+  return true;
+}
+
+#endif
@@ -0,0 +1,445 @@
+/******************************************************************************\
+* Rebuild the dot files of a simulation from its --trace output.               *
+\******************************************************************************/
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "routing-simulator.h"
+#include "trace-format.h"
+
+#define COLOR_CURRENT_MESSAGE "black"
+#define COLOR_FUTURE_MESSAGE "gray"
+
+// Command-line flags, as in the simulator.
+static bool epoch_steps = false;
+static bool show_future_messages = true;
+static node_t show_routes_for = -1;
+
+typedef long event_time_t;
+typedef struct {
+  trace_tag_t tag; // TRACE_LINK_CHANGE, TRACE_DELIVER or TRACE_TIMER.
+  node_t node;
+  node_t neighbor;
+  cost_t new_cost;
+} trace_event_t;
+
+static std::ifstream trace_file;
+static std::ofstream steps_dot_file;
+static std::ofstream final_dot_file;
+
+// Network state, rebuilt one delta at a time.
+static std::vector<node_t> nodes; // Sorted.
+static std::map<node_t, std::string> colors;
+// Links seen so far, <lower node, higher node> -> cost.
+static std::map<std::pair<node_t, node_t>, cost_t> links;
+// Routes: slot [source][destination], as in the simulator.
+static int node_span = 0;
+static std::vector<node_t> route_next_hop;
+static std::vector<cost_t> route_cost;
+// Messages in flight, <source, destination> in delivery order per epoch.
+static std::map<event_time_t, std::deque<std::pair<node_t, node_t>>> messages;
+static event_time_t current_time = 0;
+static node_t current_node;
+
+static int node_slot(node_t node) { return node - nodes.front(); }
+
+static void syntax_error() {
+  std::cerr << "Syntax error in trace file." << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t read_number() {
+  uint64_t value;
+  if (!trace_get(trace_file, value)) {
+    syntax_error();
+  }
+  return value;
+}
+
+static node_t read_node() {
+  int64_t node;
+  if (!trace_get_signed(trace_file, node)) {
+    syntax_error();
+  }
+  if (nodes.empty() || node < nodes.front() || node > nodes.back()) {
+    syntax_error();
+  }
+  return node;
+}
+
+static void read_header() {
+  std::string magic(sizeof(TRACE_MAGIC) - 1, '\0');
+  if (!trace_file.read(&magic[0], magic.size()) || magic != TRACE_MAGIC) {
+    std::cerr << "Not a trace file." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (read_number() != COST_INFINITY) {
+    std::cerr << "Trace recorded with another COST_BITS." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t count = read_number();
+  for (uint64_t n = 0; n < count; ++n) {
+    int64_t node;
+    if (!trace_get_signed(trace_file, node)) {
+      syntax_error();
+    }
+    std::string color(read_number(), '\0');
+    if (!trace_file.read(&color[0], color.size())) {
+      syntax_error();
+    }
+    nodes.push_back(node);
+    colors[node] = color;
+  }
+  if (nodes.empty()) {
+    return;
+  }
+  node_span = nodes.back() - nodes.front() + 1;
+  route_next_hop.assign((size_t)node_span * node_span, 0);
+  route_cost.assign((size_t)node_span * node_span, COST_INFINITY);
+}
+
+static bool read_event(trace_tag_t tag, trace_event_t &event) {
+  event.tag = tag;
+  switch (tag) {
+  case TRACE_LINK_CHANGE: {
+    event.node = read_node();
+    event.neighbor = read_node();
+    event.new_cost = read_number();
+    // Show the link even if this is the first time it is up.
+    links.insert(std::make_pair(
+        std::make_pair(std::min(event.node, event.neighbor),
+                       std::max(event.node, event.neighbor)),
+        COST_INFINITY));
+  } break;
+
+  case TRACE_DELIVER: {
+    if (messages.empty()) {
+      syntax_error();
+    }
+    event.node = messages.begin()->second.front().second;
+  } break;
+
+  case TRACE_TIMER: {
+    event.node = read_node();
+  } break;
+
+  default: {
+    return false;
+  }
+  }
+  return true;
+}
+
+// Same output as the simulator, for the state before event next.
+static void dump_network_snapshot(std::ostream &dot_file,
+                                  const trace_event_t *next) {
+  // Graphviz header and timestamp.
+  dot_file << "digraph N {" << std::endl                             //
+           << "  label = \"t=" << current_time << "\";" << std::endl //
+           << "  labelloc = \"top\";" << std::endl                   //
+           << "  labeljust = \"left\";" << std::endl;
+
+  // Dump colored nodes. Highlight recipient of next event in bold.
+  for (auto node : nodes) {
+    dot_file << "  node" << node                 //
+             << " [ label = \"" << node << "\" " //
+             << "style = \"filled"               //
+             << (next && next->node == node ? ",bold" : "") << "\" " //
+             << "fillcolor = \"" << colors[node] << "\" ];" << std::endl;
+  }
+
+  // Bold black lines for undirected topology.
+  // Add dot for interface that is being notified of change.
+  for (const auto &link : links) {
+    node_t first_node = link.first.first;
+    node_t second_node = link.first.second;
+    cost_t cost = link.second;
+    bool first_changes = next && next->tag == TRACE_LINK_CHANGE &&
+                         next->node == first_node &&
+                         next->neighbor == second_node;
+    bool second_changes = next && next->tag == TRACE_LINK_CHANGE &&
+                          next->node == second_node &&
+                          next->neighbor == first_node;
+    if (cost < COST_INFINITY || first_changes || second_changes) {
+      dot_file << "  node" << first_node    //
+               << " -> node" << second_node //
+               << " [ dir = \"both\" "      //
+               << "label = \""
+               << (cost < COST_INFINITY ? std::to_string((unsigned long)cost)
+                                        : "∞")
+               << "\" "                                                 //
+               << "style = \"bold\" "                                   //
+               << "arrowtail = \"" << (first_changes ? "dot" : "none") //
+               << "\" "                                                 //
+               << "arrowhead = \"" << (second_changes ? "dot" : "none")
+               << "\"];" << std::endl;
+    }
+  }
+
+  // Colored arrows for directed routes.
+  for (auto node : nodes) {
+    size_t row = (size_t)node_slot(node) * node_span;
+    for (auto destination : nodes) {
+      size_t route = row + node_slot(destination);
+      if (route_cost[route] < COST_INFINITY &&
+          (show_routes_for < 0 || show_routes_for == destination)) {
+        dot_file << "  node" << node                           //
+                 << " -> node" << route_next_hop[route]        //
+                 << " [ color = \"" << colors[destination]     //
+                 << "\" fontcolor = \"" << colors[destination] //
+                 << "\" label = \"" << ((unsigned long)route_cost[route])
+                 << "\" ];" << std::endl;
+      }
+    }
+  }
+
+  // Dashed arrow for messages. Black if being delivered, gray for future
+  // delivery.
+  bool first = true;
+  for (const auto &epoch : messages) {
+    for (const auto &message : epoch.second) {
+      bool current = first && next && next->tag == TRACE_DELIVER;
+      first = false;
+      if (show_future_messages || current) {
+        dot_file << "  node" << message.first         //
+                 << " -> node" << message.second      //
+                 << " [ color = \""
+                 << (current ? COLOR_CURRENT_MESSAGE
+                             : COLOR_FUTURE_MESSAGE) //
+                 << "\" style = \"dashed\" ];" << std::endl;
+      }
+    }
+  }
+
+  // Footer.
+  dot_file << "}" << std::endl << std::endl;
+}
+
+static void replay_event(const trace_event_t &event) {
+  current_node = event.node;
+  switch (event.tag) {
+  case TRACE_LINK_CHANGE: {
+    links[std::make_pair(std::min(event.node, event.neighbor),
+                         std::max(event.node, event.neighbor))] =
+        event.new_cost;
+  } break;
+
+  case TRACE_DELIVER: {
+    messages.begin()->second.pop_front();
+    if (messages.begin()->second.empty()) {
+      messages.erase(messages.begin());
+    }
+  } break;
+
+  default:
+    break;
+  }
+}
+
+static void replay_trace() {
+  event_time_t last_snapshot_epoch = -1;
+  bool started = false;
+  for (;;) {
+    int tag = trace_file.get();
+    if (tag == EOF) {
+      syntax_error(); // No TRACE_END.
+    }
+
+    trace_event_t event;
+    if (read_event((trace_tag_t)tag, event)) {
+      if (steps_dot_file.is_open() &&
+          (!epoch_steps || current_time > last_snapshot_epoch)) {
+        dump_network_snapshot(steps_dot_file, &event);
+        last_snapshot_epoch = current_time;
+      }
+      replay_event(event);
+      started = true;
+      continue;
+    }
+
+    switch (tag) {
+    case TRACE_SEND: {
+      node_t destination = read_node();
+      if (!started) {
+        syntax_error();
+      }
+      messages[current_time + 1].push_back(
+          std::make_pair(current_node, destination));
+    } break;
+
+    case TRACE_SEND_LATE: {
+      node_t destination = read_node();
+      uint64_t delay = read_number();
+      if (!started || delay < 1) {
+        syntax_error();
+      }
+      messages[current_time + delay].push_back(
+          std::make_pair(current_node, destination));
+    } break;
+
+    case TRACE_ROUTE:
+    case TRACE_ROUTE_ERASE: {
+      node_t destination = read_node();
+      node_t next_hop = tag == TRACE_ROUTE ? read_node() : 0;
+      cost_t cost = tag == TRACE_ROUTE ? read_number() : COST_INFINITY;
+      if (!started) {
+        syntax_error();
+      }
+      size_t route =
+          (size_t)node_slot(current_node) * node_span + node_slot(destination);
+      if (tag == TRACE_ROUTE) {
+        route_next_hop[route] = next_hop;
+      }
+      route_cost[route] = cost;
+    } break;
+
+    case TRACE_TIME: {
+      int64_t delta;
+      if (!trace_get_signed(trace_file, delta)) {
+        syntax_error();
+      }
+      current_time += delta;
+    } break;
+
+    case TRACE_END: {
+      // The next event, if --max-events left one unprocessed.
+      trace_event_t next;
+      tag = trace_file.get();
+      bool pending = tag != EOF && read_event((trace_tag_t)tag, next);
+      if (tag != EOF && !pending) {
+        syntax_error();
+      }
+      if (steps_dot_file.is_open()) {
+        dump_network_snapshot(steps_dot_file, pending ? &next : NULL);
+      }
+      if (final_dot_file.is_open()) {
+        dump_network_snapshot(final_dot_file, pending ? &next : NULL);
+      }
+      return;
+    }
+
+    default: {
+      syntax_error();
+    }
+    }
+  }
+}
+
+static void show_usage(std::string command) {
+  std::cerr                                                           //
+      << "Usage: " << command                                         //
+      << " [--epoch-steps]"                                           //
+      << " [--final-dot <dot-file>]"                                  //
+      << " [--help]"                                                  //
+      << " [--hide-future-messages]"                                  //
+      << " [--show-routes-for <node>]"                                //
+      << " [--steps-dot <dot-file>]"                                  //
+      << " [--] <trace-file>" << std::endl                            //
+      << std::endl                                                    //
+      << " --epoch-steps             "                                //
+      << "- Only show one step per epoch in the steps dot file."      //
+      << std::endl                                                    //
+      << " --final-dot <dot-file>    "                                //
+      << "- Generate a dot file showing the final result."            //
+      << std::endl                                                    //
+      << " --help                    "                                //
+      << "- Show this help screen."                                   //
+      << std::endl                                                    //
+      << " --hide-future-messages    "                                //
+      << "- Declutter dot files by only showing the current message " //
+      << "(default: show)."                                           //
+      << std::endl                                                    //
+      << " --show-routes-for <node>  "                                //
+      << "- Declutter dot files by only showing routes for <node> "   //
+      << "(default: show all)."                                       //
+      << std::endl                                                    //
+      << " --steps-dot <dot-file>    "                                //
+      << "- Generate a dot file showing each simulation step."        //
+      << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments.
+  std::string trace_file_name;
+  std::string steps_dot_file_name;
+  std::string final_dot_file_name;
+  bool positional_mode = false;
+
+  for (int a = 1; a < argc; ++a) {
+    std::string arg = argv[a];
+    if (arg == "--epoch-steps") {
+      epoch_steps = true;
+    } else if (arg == "--final-dot") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      final_dot_file_name = argv[++a];
+    } else if (arg == "--help") {
+      show_usage(argv[0]);
+    } else if (arg == "--hide-future-messages") {
+      show_future_messages = false;
+    } else if (arg == "--show-routes-for") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      try {
+        show_routes_for = std::stoi(argv[++a]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+    } else if (arg == "--steps-dot") {
+      if (argc <= a + 1) {
+        show_usage(argv[0]);
+      }
+      steps_dot_file_name = argv[++a];
+    } else if (arg == "--") {
+      positional_mode = true;
+    } else {
+      if ((arg.rfind("-", 0) == 0 && !positional_mode) ||
+          !trace_file_name.empty()) {
+        std::cerr << "Unknown option: " << arg << std::endl;
+        show_usage(argv[0]);
+      }
+      trace_file_name = arg;
+    }
+  }
+
+  if (trace_file_name.empty()) {
+    show_usage(argv[0]);
+  }
+  trace_file.open(trace_file_name, std::ios::binary);
+  if (!trace_file.is_open()) {
+    std::cerr << "Error opening trace file: " << trace_file_name << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (!steps_dot_file_name.empty()) {
+    steps_dot_file.open(steps_dot_file_name);
+    if (!steps_dot_file.is_open()) {
+      std::cerr << "Error opening output file: " << steps_dot_file_name
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!final_dot_file_name.empty()) {
+    final_dot_file.open(final_dot_file_name);
+    if (!final_dot_file.is_open()) {
+      std::cerr << "Error opening output file: " << final_dot_file_name
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  read_header();
+  replay_trace();
+  return 0;
+}